@@ -1,53 +1,1761 @@
 #ifndef KVFIFO_H
 #define KVFIFO_H
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
 #include <cstddef>
+#include <concepts>
+#include <cstdint>
 #include <iterator>
+#include <limits>
 #include <list>
 #include <map>
 #include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <ranges>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Zapis operacji na kolejkach do pliku (zob. kvfifo_trace.h). Bez
+// KVFIFO_TRACE nie kosztuje nic.
+#ifdef KVFIFO_TRACE
+#include "kvfifo_trace.h"
+#define KVFIFO_TRACE_OP(code, ...)                  \
+  kvfifo_trace::record<kvfifo_trace::op::code>(this \
+                                               __VA_OPT__(, ) __VA_ARGS__)
+#else
+#define KVFIFO_TRACE_OP(code, ...) ((void)0)
+#endif
+
+// Histogramy czasów operacji (zob. kvfifo_latency.h). Bez
+// KVFIFO_LATENCY_HISTOGRAMS nie kosztują nic.
+#ifdef KVFIFO_LATENCY_HISTOGRAMS
+#include "kvfifo_latency.h"
+#define KVFIFO_LATENCY(code) \
+  kvfifo_latency::scope kvfifo_latency_scope(kvfifo_latency::op::code)
+#else
+#define KVFIFO_LATENCY(code) ((void)0)
+#endif
+
+// Hierarchiczne koło czasowe (ang. hierarchical timing wheel) dla elementów
+// z terminem ważności. Czas mierzymy w abstrakcyjnych tyknięciach.
+//
+// Poziom L ma 64 kubełki. Kubełek s na poziomie L zawiera zegary, których
+// termin zgadza się z bieżącym czasem na bitach powyżej 6L + 6, a na bitach
+// [6L, 6L + 6) jest równy s. Zegary zbyt odległe trafiają do listy overflow.
+// Gdy czas dochodzi do początku kubełka na poziomie L, jego zegary są
+// rozrzucane na niższe poziomy. Zegary z terminem sprzed bieżącego czasu
+// (np. wstawione z zerowym ttl) czekają na krótkiej liście overdue. Mapy
+// bitowe zajętych kubełków pozwalają przeskakiwać puste fragmenty osi czasu,
+// więc advance działa w czasie proporcjonalnym do liczby wygasłych
+// i przerzuconych zegarów, a nie do upływu czasu.
+//
+// Zegary przenosimy między kubełkami przez splice, więc iterator do zegara
+// (position) pozostaje ważny aż do jego usunięcia. Wszystkie listy używają
+// tego samego alokatora, także listy z stage.
+template <typename Handle, typename Alloc = std::allocator<Handle>>
+class kvfifo_timer_wheel {
+ public:
+  using ticks_t = std::uint64_t;
+
+ private:
+  static constexpr unsigned slot_bits = 6;
+  static constexpr unsigned slots = 1u << slot_bits;
+  static constexpr unsigned levels = 4;
+  // Numery "poziomów" list overflow i overdue.
+  static constexpr unsigned overflow_level = levels;
+  static constexpr unsigned overdue_level = levels + 1;
+  static constexpr ticks_t never = std::numeric_limits<ticks_t>::max();
+
+  struct timer {
+    ticks_t deadline;
+    Handle handle;
+    unsigned level = overflow_level;
+    unsigned slot = 0;
+  };
+
+ public:
+  using timers_t = std::list<
+      timer,
+      typename std::allocator_traits<Alloc>::template rebind_alloc<timer>>;
+  using position = typename timers_t::iterator;
+
+ private:
+  using slots_t = std::array<timers_t, slots>;
+
+  template <std::size_t... Is>
+  static std::array<slots_t, levels> make_buckets(
+      Alloc const &alloc, std::index_sequence<Is...>) noexcept {
+    return {{((void)Is,
+              make_slots(alloc, std::make_index_sequence<slots>()))...}};
+  }
+
+  template <std::size_t... Is>
+  static slots_t make_slots(Alloc const &alloc,
+                            std::index_sequence<Is...>) noexcept {
+    return {{((void)Is, timers_t(alloc))...}};
+  }
+
+  std::array<slots_t, levels> buckets;
+  std::array<std::uint64_t, levels> occupied{};
+  timers_t overflow;
+  timers_t overdue;
+  // Najmniejsze jeszcze nieprzetworzone tyknięcie.
+  ticks_t current;
+  std::size_t armed = 0;
+
+  static constexpr ticks_t window_base(ticks_t t, unsigned level) noexcept {
+    const unsigned shift = slot_bits * (level + 1);
+    return (t >> shift) << shift;
+  }
+
+  static constexpr unsigned slot_of(ticks_t t, unsigned level) noexcept {
+    return static_cast<unsigned>(t >> (slot_bits * level)) & (slots - 1);
+  }
+
+  // Pierwszy zajęty kubełek poziomu o numerze >= from.
+  std::optional<unsigned> first_occupied(unsigned level,
+                                         unsigned from) const noexcept {
+    if (from >= slots) return std::nullopt;
+    const std::uint64_t later = occupied[level] & (~std::uint64_t{0} << from);
+    if (later == 0) return std::nullopt;
+    return static_cast<unsigned>(std::countr_zero(later));
+  }
+
+  timers_t &bucket(unsigned level, unsigned slot) noexcept {
+    return level == overflow_level  ? overflow
+           : level == overdue_level ? overdue
+                                    : buckets[level][slot];
+  }
+
+  // Przenosi (bez alokacji) zegar z listy from do kubełka wyznaczonego przez
+  // jego termin względem bieżącego czasu.
+  void relink(timers_t &from, position where) noexcept {
+    const ticks_t deadline = where->deadline;
+    where->level = deadline < current ? overdue_level : overflow_level;
+    where->slot = 0;
+    for (unsigned level = 0; level < levels && deadline >= current; ++level) {
+      if (window_base(deadline, level) == window_base(current, level)) {
+        where->level = level;
+        where->slot = slot_of(deadline, level);
+        occupied[level] |= std::uint64_t{1} << where->slot;
+        break;
+      }
+    }
+    timers_t &to = bucket(where->level, where->slot);
+    to.splice(to.end(), from, where);
+  }
+
+  void unmark_if_empty(unsigned level, unsigned slot) noexcept {
+    if (level < levels && buckets[level][slot].empty()) {
+      occupied[level] &= ~(std::uint64_t{1} << slot);
+    }
+  }
+
+  // Ustawia bieżący czas na t i rozrzuca kubełki zaczynające się w t, od
+  // najwyższego poziomu. Wywołujący gwarantuje, że między starym a nowym
+  // czasem nie zaczyna się żaden niepusty kubełek.
+  void jump(ticks_t t) noexcept {
+    current = t;
+    unsigned top = 0;
+    while (top < levels && t == window_base(t, top)) ++top;
+    for (unsigned level = top; level >= 1; --level) {
+      const unsigned slot = level == overflow_level ? 0 : slot_of(t, level);
+      timers_t pending(overflow.get_allocator());
+      pending.splice(pending.end(), bucket(level, slot));
+      unmark_if_empty(level, slot);
+      while (!pending.empty()) relink(pending, pending.begin());
+    }
+  }
+
+  // Najwcześniejszy początek niepustego kubełka na poziomach >= 1, a jeśli
+  // takiego nie ma, to początek okna najwyższego poziomu z najbliższym
+  // zegarem z listy overflow (także z terminem never, żeby jump przeniósł go
+  // na niższe poziomy). Złożoność O(1) plus O(rozmiar overflow).
+  ticks_t next_window() const noexcept {
+    for (unsigned level = 1; level < levels; ++level) {
+      auto slot = first_occupied(level, slot_of(current, level) + 1);
+      if (slot) {
+        return window_base(current, level) |
+               (ticks_t{*slot} << (slot_bits * level));
+      }
+    }
+    ticks_t earliest = never;
+    for (const auto &waiting : overflow) {
+      earliest = std::min(earliest, waiting.deadline);
+    }
+    return overflow.empty() ? never : window_base(earliest, levels - 1);
+  }
+
+ public:
+  explicit kvfifo_timer_wheel(ticks_t current_ = 0,
+                              Alloc const &alloc = Alloc()) noexcept
+      : buckets(make_buckets(alloc, std::make_index_sequence<levels>())),
+        overflow(alloc),
+        overdue(alloc),
+        current(current_) {}
+  kvfifo_timer_wheel(kvfifo_timer_wheel const &) = delete;
+  kvfifo_timer_wheel &operator=(kvfifo_timer_wheel const &) = delete;
+
+  ticks_t now() const noexcept { return current; }
+  std::size_t size() const noexcept { return armed; }
+  Alloc get_allocator() const noexcept {
+    return Alloc(overflow.get_allocator());
+  }
+
+  // Pamięć zajmowana przez koło i zegary (węzeł listy to dwa wskaźniki
+  // i zegar).
+  std::size_t bytes() const noexcept {
+    return sizeof(*this) + armed * (2 * sizeof(void *) + sizeof(timer));
+  }
+
+  // Przygotowuje zegar do wstawienia. Tylko tu jest alokacja.
+  static timers_t stage(ticks_t deadline, Handle const &handle,
+                        Alloc const &alloc) {
+    timers_t staged(alloc);
+    staged.push_back({deadline, handle});
+    return staged;
+  }
+
+  // Wstawia zegar przygotowany przez stage.
+  position insert(timers_t &staged) noexcept {
+    position where = staged.begin();
+    relink(staged, where);
+    ++armed;
+    return where;
+  }
+
+  position arm(ticks_t deadline, Handle const &handle) {
+    auto staged = stage(deadline, handle, overflow.get_allocator());
+
+    // Dalej bez wyjątków.
+
+    return insert(staged);
+  }
+
+  void disarm(position where) noexcept {
+    const unsigned level = where->level, slot = where->slot;
+    bucket(level, slot).erase(where);
+    unmark_if_empty(level, slot);
+    --armed;
+  }
+
+  static ticks_t deadline(position where) noexcept { return where->deadline; }
+
+  static Handle &handle(position where) noexcept { return where->handle; }
+
+  // Przenosi zegar do innego koła (bez alokacji).
+  void transfer(position where, kvfifo_timer_wheel &to) noexcept {
+    const unsigned level = where->level, slot = where->slot;
+    to.relink(bucket(level, slot), where);
+    unmark_if_empty(level, slot);
+    --armed;
+    ++to.armed;
+  }
+
+  // Dolne ograniczenie na najwcześniejszy termin. Jeśli jest większe od now,
+  // to advance(now) nie usunie żadnego zegara.
+  ticks_t next_expiry() const noexcept {
+    if (armed == 0) return never;
+    ticks_t earliest = never;
+    for (const auto &waiting : overdue) {
+      earliest = std::min(earliest, waiting.deadline);
+    }
+    auto slot = first_occupied(0, slot_of(current, 0));
+    if (slot) return std::min(earliest, window_base(current, 0) | *slot);
+    return std::min(earliest, next_window());
+  }
+
+  // Usuwa wszystkie zegary z terminem <= now i dla każdego z nich, już po
+  // odpięciu od koła, woła expired(handle).
+  template <typename Expired>
+  void advance(ticks_t now, Expired &&expired) noexcept {
+    for (auto walk = overdue.begin(); walk != overdue.end();) {
+      if (walk->deadline > now) {
+        ++walk;
+        continue;
+      }
+      Handle handle = walk->handle;
+      walk = overdue.erase(walk);
+      --armed;
+      expired(handle);
+    }
+    while (armed > 0 && current <= now) {
+      auto slot = first_occupied(0, slot_of(current, 0));
+      const ticks_t t =
+          slot ? window_base(current, 0) | *slot : next_window();
+      if (t > now) break;
+      if (!slot) {
+        jump(t);
+        continue;
+      }
+      current = t;
+      timers_t &due = buckets[0][*slot];
+      while (!due.empty()) {
+        Handle handle = due.front().handle;
+        due.pop_front();
+        --armed;
+        expired(handle);
+      }
+      occupied[0] &= ~(std::uint64_t{1} << *slot);
+      if (t == never) return;
+      jump(t + 1);
+    }
+    // Między current a now + 1 nie zaczyna się żaden niepusty kubełek, chyba
+    // że dokładnie w now + 1, a ten jump rozrzuci.
+    if (current <= now && now != never) jump(now + 1);
+  }
+
+  // Przejmuje wszystkie zegary z other (bez alokacji), wołając fix(handle)
+  // dla każdego z nich. Złożoność O(liczba zegarów w other).
+  template <typename Fix>
+  void adopt(kvfifo_timer_wheel &other, Fix &&fix) noexcept {
+    auto take = [&](timers_t &from) {
+      while (!from.empty()) {
+        fix(from.front().handle);
+        relink(from, from.begin());
+        ++armed;
+      }
+    };
+    for (auto &level : other.buckets) {
+      for (auto &slot : level) take(slot);
+    }
+    take(other.overflow);
+    take(other.overdue);
+    other.occupied.fill(0);
+    other.armed = 0;
+  }
+
+  void clear() noexcept {
+    for (auto &level : buckets) {
+      for (auto &slot : level) slot.clear();
+    }
+    occupied.fill(0);
+    overflow.clear();
+    overdue.clear();
+    armed = 0;
+  }
+};
+
+// Mapa uporządkowana (drzewo AVL), której węzły pamiętają rozmiar i sumę wag
+// swojego poddrzewa. Daje to w czasie O(log n) element o danym numerze,
+// numer elementu i sumę wag elementów przed nim. Waga elementu to
+// Weigh()(wartość); po zmianie wagi wartości w mapie trzeba wywołać reweigh.
+//
+// Interfejs to podzbiór interfejsu std::map (z węzłami do przepinania między
+// mapami) potrzebny kvfifo_simple. Iterator pozostaje ważny aż do usunięcia
+// jego elementu, a end() do zniszczenia lub zamiany (swap) mapy.
+template <typename Key, typename T, typename Compare, typename Weigh,
+          typename Alloc>
+class kvfifo_rank_map {
+ public:
+  using key_type = Key;
+  using mapped_type = T;
+  using value_type = std::pair<Key const, T>;
+
+ private:
+  // Strażnik (end()) ma tylko link: jego lewe dziecko to korzeń, a rodzic to
+  // nullptr.
+  struct link {
+    link *parent = nullptr;
+    link *left = nullptr;
+    link *right = nullptr;
+    // Liczba węzłów i suma wag w poddrzewie.
+    std::size_t count = 0;
+    std::size_t total = 0;
+    int height = 0;
+  };
+
+  struct node : link {
+    value_type value;
+
+    template <typename... Args>
+    explicit node(Args &&...args) : value(std::forward<Args>(args)...) {}
+  };
+
+  using node_alloc_t =
+      typename std::allocator_traits<Alloc>::template rebind_alloc<node>;
+  using node_traits = std::allocator_traits<node_alloc_t>;
+
+  template <bool Const>
+  class basic_iterator {
+   public:
+    using iterator_category = std::bidirectional_iterator_tag;
+    using difference_type = std::ptrdiff_t;
+    using value_type = kvfifo_rank_map::value_type;
+    using pointer = std::conditional_t<Const, value_type const *, value_type *>;
+    using reference =
+        std::conditional_t<Const, value_type const &, value_type &>;
+
+    basic_iterator() = default;
+    // iterator zamienia się na const_iterator.
+    template <bool C = Const>
+      requires C
+    basic_iterator(basic_iterator<false> const &that) noexcept
+        : at(that.at) {}
+
+    reference operator*() const noexcept {
+      return static_cast<node *>(at)->value;
+    }
+    pointer operator->() const noexcept { return &**this; }
+
+    basic_iterator &operator++() noexcept {
+      at = next(at);
+      return *this;
+    }
+    basic_iterator operator++(int) noexcept {
+      auto old = *this;
+      ++(*this);
+      return old;
+    }
+    basic_iterator &operator--() noexcept {
+      at = prev(at);
+      return *this;
+    }
+    basic_iterator operator--(int) noexcept {
+      auto old = *this;
+      --(*this);
+      return old;
+    }
+
+    // Przesunięcie o n elementów (także do end()). Złożoność O(log n).
+    basic_iterator &operator+=(difference_type n) noexcept {
+      const auto target = static_cast<difference_type>(rank_of(at)) + n;
+      at = nth_link(header_of(at), static_cast<std::size_t>(target));
+      return *this;
+    }
+    basic_iterator &operator-=(difference_type n) noexcept {
+      return *this += -n;
+    }
+    friend basic_iterator operator+(basic_iterator it, difference_type n) {
+      return it += n;
+    }
+    friend basic_iterator operator-(basic_iterator it, difference_type n) {
+      return it -= n;
+    }
+    difference_type operator-(basic_iterator const &that) const noexcept {
+      return static_cast<difference_type>(rank_of(at)) -
+             static_cast<difference_type>(rank_of(that.at));
+    }
+
+    friend bool operator==(basic_iterator const &a,
+                           basic_iterator const &b) noexcept {
+      return a.at == b.at;
+    }
+
+   private:
+    friend class kvfifo_rank_map;
+    friend class basic_iterator<!Const>;
+
+    explicit basic_iterator(link *at_) noexcept : at(at_) {}
+
+    link *at = nullptr;
+  };
+
+ public:
+  using iterator = basic_iterator<false>;
+  using const_iterator = basic_iterator<true>;
+
+  // Węzeł wyjęty z mapy przez extract, do wstawienia do innej mapy z równym
+  // alokatorem.
+  class node_type {
+   public:
+    node_type() = default;
+    node_type(node_type &&that) noexcept
+        : held(std::exchange(that.held, nullptr)), alloc(that.alloc) {}
+    // Alokatora (np. polymorphic_allocator) może nie dać się przypisać, więc
+    // tworzymy go od nowa.
+    node_type &operator=(node_type &&that) noexcept {
+      if (this == &that) return *this;
+      reset();
+      held = std::exchange(that.held, nullptr);
+      alloc.reset();
+      if (that.alloc) alloc.emplace(*that.alloc);
+      return *this;
+    }
+    ~node_type() { reset(); }
+
+    bool empty() const noexcept { return held == nullptr; }
+    explicit operator bool() const noexcept { return held != nullptr; }
+    Key const &key() const noexcept { return held->value.first; }
+    T &mapped() const noexcept { return held->value.second; }
+
+   private:
+    friend class kvfifo_rank_map;
+
+    node_type(node *held_, node_alloc_t const &alloc_) noexcept
+        : held(held_), alloc(alloc_) {}
+
+    void reset() noexcept {
+      if (held != nullptr) destroy_node(*alloc, std::exchange(held, nullptr));
+    }
+
+    node *held = nullptr;
+    std::optional<node_alloc_t> alloc;
+  };
+
+  explicit kvfifo_rank_map(Alloc const &alloc_ = Alloc()) noexcept
+      : alloc(alloc_) {}
+  kvfifo_rank_map(kvfifo_rank_map const &) = delete;
+  kvfifo_rank_map &operator=(kvfifo_rank_map const &) = delete;
+  ~kvfifo_rank_map() { clear(); }
+
+  Alloc get_allocator() const noexcept { return Alloc(alloc); }
+
+  iterator begin() noexcept { return iterator(leftmost); }
+  const_iterator begin() const noexcept { return const_iterator(leftmost); }
+  iterator end() noexcept { return iterator(&header); }
+  const_iterator end() const noexcept {
+    return const_iterator(const_cast<link *>(&header));
+  }
+
+  std::size_t size() const noexcept { return count_of(root()); }
+  bool empty() const noexcept { return root() == nullptr; }
+
+  // Suma wag wszystkich elementów.
+  std::size_t total_weight() const noexcept { return total_of(root()); }
+
+  template <typename Q>
+  iterator lower_bound(Q const &k) {
+    return iterator(lower_bound_link(k));
+  }
+  template <typename Q>
+  const_iterator lower_bound(Q const &k) const {
+    return const_iterator(lower_bound_link(k));
+  }
+
+  template <typename Q>
+  iterator find(Q const &k) {
+    return iterator(find_link(k));
+  }
+  template <typename Q>
+  const_iterator find(Q const &k) const {
+    return const_iterator(find_link(k));
+  }
+
+  // Element o numerze i (od 0) albo end(), jeśli i >= size().
+  const_iterator nth(std::size_t i) const noexcept {
+    return const_iterator(nth_link(const_cast<link *>(&header), i));
+  }
+
+  // Numer elementu (size() dla end()).
+  std::size_t rank(const_iterator it) const noexcept {
+    return rank_of(it.at);
+  }
+
+  // Suma wag elementów przed it.
+  std::size_t weight_before(const_iterator it) const noexcept {
+    link const *x = it.at;
+    if (x == &header) return total_weight();
+    std::size_t result = total_of(x->left);
+    for (; x->parent != &header; x = x->parent) {
+      if (x == x->parent->right) {
+        result += x->parent->total - total_of(x);
+      }
+    }
+    return result;
+  }
+
+  template <typename... Args>
+  std::pair<iterator, bool> try_emplace(Key const &k, Args &&...args) {
+    auto at = lower_bound(k);
+    if (at != end() && !comp(k, at->first)) return {at, false};
+    return {emplace_hint(at, std::piecewise_construct,
+                         std::forward_as_tuple(k),
+                         std::forward_as_tuple(std::forward<Args>(args)...)),
+            true};
+  }
+
+  T &operator[](Key const &k) { return try_emplace(k).first->second; }
+
+  // Wstawia nowy element (klucza nie może być w mapie). Podpowiedź nie jest
+  // potrzebna, bo i tak poprawiamy całą ścieżkę do korzenia.
+  template <typename... Args>
+  iterator emplace_hint(const_iterator, Args &&...args) {
+    node_alloc_t a(alloc);
+    node *n = node_traits::allocate(a, 1);
+    try {
+      node_traits::construct(a, n, std::forward<Args>(args)...);
+    } catch (...) {
+      node_traits::deallocate(a, n, 1);
+      throw;
+    }
+
+    // Dalej bez wyjątków (poza porównaniem kluczy).
+
+    return link_node(n);
+  }
+
+  // Wstawia węzeł, jeśli klucza jeszcze nie ma (wtedy nh zostaje pusty).
+  iterator insert(const_iterator, node_type &&nh) {
+    if (nh.empty()) return end();
+    auto at = lower_bound(nh.key());
+    if (at != end() && !comp(nh.key(), at->first)) return at;
+    return link_node(std::exchange(nh.held, nullptr));
+  }
+
+  node_type extract(const_iterator it) noexcept {
+    unlink_node(it.at);
+    return node_type(static_cast<node *>(it.at), alloc);
+  }
+
+  iterator erase(const_iterator it) noexcept {
+    iterator following(next(it.at));
+    unlink_node(it.at);
+    destroy_node(alloc, static_cast<node *>(it.at));
+    return following;
+  }
+
+  // Usuwa elementy z [first, last). Zamiast usuwać je po kolei, dzielimy
+  // drzewo na trzy części i sklejamy skrajne, więc złożoność to O(d + log n)
+  // dla d usuniętych.
+  iterator erase(const_iterator first, const_iterator last) noexcept {
+    const std::size_t from = rank_of(first.at);
+    const std::size_t to = rank_of(last.at);
+    if (from == to) return iterator(last.at);
+    auto [left, rest] = split(root(), from);
+    auto [doomed, right] = split(rest, to - from);
+    destroy_all(doomed);
+    set_root(join(left, right));
+    return iterator(last.at);
+  }
+
+  // Przepina z other elementy, których kluczy tu nie ma. Złożoność
+  // O(k log n) dla k elementów other.
+  void merge(kvfifo_rank_map &other) {
+    for (link *x = other.leftmost; x != &other.header;) {
+      link *following = next(x);
+      if (find_link(static_cast<node *>(x)->value.first) == &header) {
+        other.unlink_node(x);
+        link_node(static_cast<node *>(x));
+      }
+      x = following;
+    }
+  }
+
+  // Poprawia sumy wag na ścieżce od it do korzenia. Złożoność O(log n).
+  void reweigh(const_iterator it) noexcept {
+    for (link *x = it.at; x != &header; x = x->parent) update(x);
+  }
+
+  // Poprawia sumy wag całej mapy. Złożoność O(n).
+  void reweigh_all() noexcept { update_all(root()); }
+
+  void swap(kvfifo_rank_map &that) noexcept {
+    std::swap(header.left, that.header.left);
+    std::swap(leftmost, that.leftmost);
+    for (auto *m : {this, &that}) {
+      if (m->header.left == nullptr) {
+        m->leftmost = &m->header;
+      } else {
+        m->header.left->parent = &m->header;
+      }
+    }
+    if constexpr (node_traits::propagate_on_container_swap::value) {
+      std::swap(alloc, that.alloc);
+    }
+  }
+
+  void clear() noexcept {
+    destroy_all(root());
+    header.left = nullptr;
+    leftmost = &header;
+  }
+
+  // Rozmiar węzła razem z elementem.
+  static constexpr std::size_t node_bytes = sizeof(node);
+
+ private:
+  static std::size_t count_of(link const *x) noexcept {
+    return x == nullptr ? 0 : x->count;
+  }
+  static std::size_t total_of(link const *x) noexcept {
+    return x == nullptr ? 0 : x->total;
+  }
+  static int height_of(link const *x) noexcept {
+    return x == nullptr ? 0 : x->height;
+  }
+
+  static void update(link *x) noexcept {
+    x->height = 1 + std::max(height_of(x->left), height_of(x->right));
+    x->count = 1 + count_of(x->left) + count_of(x->right);
+    x->total = Weigh()(static_cast<node *>(x)->value.second) +
+               total_of(x->left) + total_of(x->right);
+  }
+
+  static void update_all(link *x) noexcept {
+    if (x == nullptr) return;
+    update_all(x->left);
+    update_all(x->right);
+    update(x);
+  }
+
+  static link *next(link *x) noexcept {
+    if (x->right != nullptr) {
+      x = x->right;
+      while (x->left != nullptr) x = x->left;
+      return x;
+    }
+    link *p = x->parent;
+    while (p->right == x) {
+      x = p;
+      p = p->parent;
+    }
+    return p;
+  }
+
+  static link *prev(link *x) noexcept {
+    if (x->parent == nullptr) {
+      // Poprzednik end() to największy element.
+      x = x->left;
+      while (x->right != nullptr) x = x->right;
+      return x;
+    }
+    if (x->left != nullptr) {
+      x = x->left;
+      while (x->right != nullptr) x = x->right;
+      return x;
+    }
+    link *p = x->parent;
+    while (p->left == x) {
+      x = p;
+      p = p->parent;
+    }
+    return p;
+  }
+
+  static link *header_of(link *x) noexcept {
+    while (x->parent != nullptr) x = x->parent;
+    return x;
+  }
+
+  static std::size_t rank_of(link const *x) noexcept {
+    if (x->parent == nullptr) return count_of(x->left);
+    std::size_t result = count_of(x->left);
+    for (; x->parent->parent != nullptr; x = x->parent) {
+      if (x == x->parent->right) result += count_of(x->parent->left) + 1;
+    }
+    return result;
+  }
+
+  static link *nth_link(link *header, std::size_t i) noexcept {
+    link *x = header->left;
+    if (i >= count_of(x)) return header;
+    for (;;) {
+      const std::size_t before = count_of(x->left);
+      if (i == before) return x;
+      if (i < before) {
+        x = x->left;
+      } else {
+        i -= before + 1;
+        x = x->right;
+      }
+    }
+  }
+
+  static void destroy_node(node_alloc_t a, node *n) noexcept {
+    node_traits::destroy(a, n);
+    node_traits::deallocate(a, n, 1);
+  }
+
+  void destroy_all(link *x) noexcept {
+    if (x == nullptr) return;
+    destroy_all(x->left);
+    destroy_all(x->right);
+    destroy_node(alloc, static_cast<node *>(x));
+  }
+
+  link *root() const noexcept { return header.left; }
+
+  template <typename Q>
+  link *lower_bound_link(Q const &k) const {
+    link *result = const_cast<link *>(&header);
+    for (link *x = root(); x != nullptr;) {
+      if (comp(static_cast<node *>(x)->value.first, k)) {
+        x = x->right;
+      } else {
+        result = x;
+        x = x->left;
+      }
+    }
+    return result;
+  }
+
+  template <typename Q>
+  link *find_link(Q const &k) const {
+    link *at = lower_bound_link(k);
+    if (at != &header && comp(k, static_cast<node *>(at)->value.first)) {
+      return const_cast<link *>(&header);
+    }
+    return at;
+  }
+
+  // Podpina w miejsce a (u jego rodzica) poddrzewo b.
+  static void replace(link *a, link *b) noexcept {
+    link *p = a->parent;
+    if (p->left == a) {
+      p->left = b;
+    } else {
+      p->right = b;
+    }
+    if (b != nullptr) b->parent = p;
+  }
+
+  // Operacje na poddrzewach zwracają nowy korzeń poddrzewa. Jego pole
+  // parent ustawia wywołujący, podpinając go na miejsce starego.
+
+  static link *rotate_left(link *x) noexcept {
+    link *y = x->right;
+    x->right = y->left;
+    if (y->left != nullptr) y->left->parent = x;
+    y->left = x;
+    x->parent = y;
+    update(x);
+    update(y);
+    return y;
+  }
+
+  static link *rotate_right(link *x) noexcept {
+    link *y = x->left;
+    x->left = y->right;
+    if (y->right != nullptr) y->right->parent = x;
+    y->right = x;
+    x->parent = y;
+    update(x);
+    update(y);
+    return y;
+  }
+
+  // Poprawia liczniki x i przywraca warunek AVL w x, jeśli wysokości
+  // poddrzew x różnią się o 2.
+  static link *balance(link *x) noexcept {
+    update(x);
+    const int skew = height_of(x->left) - height_of(x->right);
+    if (skew > 1) {
+      if (height_of(x->left->left) < height_of(x->left->right)) {
+        x->left = rotate_left(x->left);
+        x->left->parent = x;
+      }
+      return rotate_right(x);
+    }
+    if (skew < -1) {
+      if (height_of(x->right->right) < height_of(x->right->left)) {
+        x->right = rotate_right(x->right);
+        x->right->parent = x;
+      }
+      return rotate_left(x);
+    }
+    return x;
+  }
+
+  // Drzewo z elementów l, m i r (w tej kolejności). Złożoność
+  // O(|wysokość l - wysokość r| + 1).
+  static link *join(link *l, link *m, link *r) noexcept {
+    if (height_of(l) > height_of(r) + 1) {
+      l->right = join(l->right, m, r);
+      l->right->parent = l;
+      return balance(l);
+    }
+    if (height_of(r) > height_of(l) + 1) {
+      r->left = join(l, m, r->left);
+      r->left->parent = r;
+      return balance(r);
+    }
+    m->left = l;
+    m->right = r;
+    if (l != nullptr) l->parent = m;
+    if (r != nullptr) r->parent = m;
+    update(m);
+    return m;
+  }
+
+  // Odpina najmniejszy element t (do min).
+  static link *remove_min(link *t, link *&min) noexcept {
+    if (t->left == nullptr) {
+      min = t;
+      return t->right;
+    }
+    t->left = remove_min(t->left, min);
+    if (t->left != nullptr) t->left->parent = t;
+    return balance(t);
+  }
+
+  static link *join(link *l, link *r) noexcept {
+    if (r == nullptr) return l;
+    link *m = nullptr;
+    r = remove_min(r, m);
+    return join(l, m, r);
+  }
+
+  // Dzieli t na i pierwszych elementów i resztę. Złożoność O(log n).
+  static std::pair<link *, link *> split(link *t, std::size_t i) noexcept {
+    if (t == nullptr) return {nullptr, nullptr};
+    link *l = t->left;
+    link *r = t->right;
+    const std::size_t before = count_of(l);
+    if (i <= before) {
+      auto [a, b] = split(l, i);
+      return {a, join(b, t, r)};
+    }
+    auto [a, b] = split(r, i - before - 1);
+    return {join(l, t, a), b};
+  }
+
+  void set_root(link *t) noexcept {
+    header.left = t;
+    leftmost = &header;
+    if (t == nullptr) return;
+    t->parent = &header;
+    for (leftmost = t; leftmost->left != nullptr;) leftmost = leftmost->left;
+  }
+
+  // Poprawia liczniki i wyważa drzewo od x aż do korzenia.
+  void retrace(link *x) noexcept {
+    while (x != &header) {
+      link *p = x->parent;
+      const bool was_left = p->left == x;
+      link *y = balance(x);
+      y->parent = p;
+      (was_left ? p->left : p->right) = y;
+      x = p;
+    }
+  }
+
+  iterator link_node(node *n) {
+    link *parent = &header;
+    bool left = true;
+    for (link *x = root(); x != nullptr;) {
+      parent = x;
+      left = comp(n->value.first, static_cast<node *>(x)->value.first);
+      x = left ? x->left : x->right;
+    }
+
+    // Dalej bez wyjątków.
+
+    n->parent = parent;
+    n->left = n->right = nullptr;
+    (left ? parent->left : parent->right) = n;
+    if (leftmost == &header || (left && parent == leftmost)) leftmost = n;
+    retrace(n);
+    return iterator(n);
+  }
+
+  void unlink_node(link *z) noexcept {
+    if (z == leftmost) leftmost = next(z);
+    link *fix;
+    if (z->left == nullptr || z->right == nullptr) {
+      fix = z->parent;
+      replace(z, z->left != nullptr ? z->left : z->right);
+    } else {
+      // Następnik z zajmuje jego miejsce w drzewie (przepinamy węzły, a nie
+      // wartości, żeby iteratory pozostały ważne).
+      link *y = z->right;
+      while (y->left != nullptr) y = y->left;
+      if (y->parent == z) {
+        fix = y;
+      } else {
+        fix = y->parent;
+        replace(y, y->right);
+        y->right = z->right;
+        y->right->parent = y;
+      }
+      replace(z, y);
+      y->left = z->left;
+      y->left->parent = y;
+    }
+    retrace(fix);
+  }
+
+  link header;
+  // Najmniejszy element (albo &header), żeby begin() było O(1).
+  link *leftmost = &header;
+  [[no_unique_address]] Compare comp;
+  [[no_unique_address]] node_alloc_t alloc;
+};
+
+// Numery elementów w kolejności kolejki. Elementy zajmują sloty tablicy,
+// rosnąco w tej kolejności, ale nie muszą leżeć obok siebie: usunięty
+// element zostawia wolny slot. Drzewo Fenwicka liczy zajęte sloty, więc
+// numer elementu (liczba zajętych slotów przed nim) i element o danym
+// numerze są w czasie O(log c) dla c slotów. Nowe elementy zajmują wolne
+// sloty za ostatnim albo przed pierwszym z dotąd zajętych; gdy ich
+// zabraknie, właściciel buduje indeks od nowa (assign), z zapasem
+// proporcjonalnym do liczby elementów, więc przebudowy kosztują O(1)
+// zamortyzowane na operację.
+//
+// Slot elementu pamiętamy w tablicy mieszającej obok, a nie w samym
+// elemencie, więc elementy kolejek bez zapytań o numery nic nie kosztują.
+template <typename T, typename Alloc>
+class kvfifo_slot_index {
+  template <typename U>
+  using alloc_t =
+      typename std::allocator_traits<Alloc>::template rebind_alloc<U>;
+  using counts_t = std::vector<std::size_t, alloc_t<std::size_t>>;
+  using owners_t = std::vector<T *, alloc_t<T *>>;
+  using slots_t =
+      std::unordered_map<T const *, std::size_t, std::hash<T const *>,
+                         std::equal_to<T const *>,
+                         alloc_t<std::pair<T const *const, std::size_t>>>;
+
+ public:
+  explicit kvfifo_slot_index(Alloc const &alloc)
+      : tree(alloc), owners(alloc), slots_of(alloc) {}
+
+  // Zajmuje kolejne sloty elementami [first, last) (n elementów), zostawiając
+  // wolne sloty po obu stronach. Silna gwarancja. Złożoność O(n).
+  template <typename It>
+  void assign(It first, It last, std::size_t n) {
+    const std::size_t slots = 2 * n + 16;
+    counts_t new_tree(slots + 1, 0, tree.get_allocator());
+    owners_t new_owners(slots, nullptr, owners.get_allocator());
+    slots_t new_slots_of(slots_of.get_allocator());
+    new_slots_of.reserve(n);
+    std::size_t slot = (slots - n) / 2;
+    for (auto walk = first; walk != last; ++walk) {
+      new_slots_of.emplace(&*walk, slot++);
+    }
+
+    // Dalej bez wyjątków.
+
+    front = back = (slots - n) / 2;
+    for (; first != last; ++first, ++back) {
+      new_owners[back] = &*first;
+      new_tree[back + 1] = 1;
+    }
+    // Drzewo Fenwicka z tablicy liczników w czasie O(c).
+    for (std::size_t i = 1; i <= slots; ++i) {
+      const std::size_t parent = i + (i & -i);
+      if (parent <= slots) new_tree[parent] += new_tree[i];
+    }
+    tree.swap(new_tree);
+    owners.swap(new_owners);
+    slots_of.swap(new_slots_of);
+  }
+
+  // Oddaje pamięć.
+  void reset() noexcept {
+    counts_t(tree.get_allocator()).swap(tree);
+    owners_t(owners.get_allocator()).swap(owners);
+    slots_t(slots_of.get_allocator()).swap(slots_of);
+    front = back = 0;
+  }
+
+  // Czy jest m wolnych slotów za ostatnim (przed pierwszym) zajętym.
+  bool back_room(std::size_t m) const noexcept {
+    return owners.size() - back >= m;
+  }
+  bool front_room(std::size_t m) const noexcept { return front >= m; }
+
+  // Rezerwuje m wolnych slotów za ostatnim (przed pierwszym) i zwraca numer
+  // pierwszego z nich. Trzeba je potem zająć przez occupy albo move.
+  std::size_t claim_back(std::size_t m) noexcept {
+    back += m;
+    return back - m;
+  }
+  std::size_t claim_front(std::size_t m) noexcept { return front -= m; }
+
+  // Zajmuje slot nowym elementem owner. Zgłasza wyjątek tylko, gdy zabraknie
+  // pamięci na wpis w tablicy slotów (wtedy nic nie zmienia).
+  void occupy(std::size_t slot, T *owner) {
+    slots_of.emplace(owner, slot);
+
+    // Dalej bez wyjątków.
+
+    mark(slot, owner);
+  }
+
+  // Przenosi owner do zarezerwowanego slotu slot.
+  void move(T *owner, std::size_t slot) noexcept {
+    auto &at = slots_of.find(owner)->second;
+    unmark(at);
+    at = slot;
+    mark(slot, owner);
+  }
+
+  void release(T const *owner) noexcept {
+    auto at = slots_of.find(owner);
+    unmark(at->second);
+    slots_of.erase(at);
+  }
+
+  // Liczba zajętych slotów przed slotem elementu owner, czyli jego numer.
+  std::size_t position(T const *owner) const noexcept {
+    std::size_t result = 0;
+    for (std::size_t i = slots_of.find(owner)->second; i > 0; i -= i & -i) {
+      result += tree[i];
+    }
+    return result;
+  }
+
+  // Właściciel i-tego (od 0) zajętego slotu; i musi być mniejsze od liczby
+  // zajętych slotów. Schodzimy po drzewie Fenwicka od najwyższej potęgi 2.
+  T *at(std::size_t i) const noexcept {
+    std::size_t slot = 0;
+    for (std::size_t step = std::bit_floor(tree.size() - 1); step > 0;
+         step >>= 1) {
+      if (slot + step < tree.size() && tree[slot + step] <= i) {
+        slot += step;
+        i -= tree[slot];
+      }
+    }
+    return owners[slot];
+  }
+
+  // Węzeł tablicy slotów liczymy jako wskaźnik, hasz i wpis. Pusta tablica
+  // nie alokuje kubełków.
+  std::size_t bytes() const noexcept {
+    std::size_t result = tree.capacity() * sizeof(std::size_t) +
+                         owners.capacity() * sizeof(T *);
+    if (!slots_of.empty()) {
+      result += slots_of.bucket_count() * sizeof(void *) +
+                slots_of.size() * (2 * sizeof(void *) +
+                                   sizeof(typename slots_t::value_type));
+    }
+    return result;
+  }
+
+ private:
+  void mark(std::size_t slot, T *owner) noexcept {
+    owners[slot] = owner;
+    for (std::size_t i = slot + 1; i < tree.size(); i += i & -i) ++tree[i];
+  }
+  void unmark(std::size_t slot) noexcept {
+    owners[slot] = nullptr;
+    for (std::size_t i = slot + 1; i < tree.size(); i += i & -i) --tree[i];
+  }
+
+  // tree[i] (od 1) to liczba zajętych slotów w (i - (i & -i), i].
+  counts_t tree;
+  owners_t owners;
+  // Slot każdego elementu.
+  slots_t slots_of;
+  // Zajęte sloty leżą w [front, back).
+  std::size_t front = 0, back = 0;
+};
+
+// Podział pamięci zajmowanej przez kvfifo, w bajtach. Rozmiary węzłów
+// kontenerów są szacowane (wskaźniki plus wartość, bez narzutu alokatora),
+// a pamięć, którą K i V alokują same (np. długie napisy), nie jest liczona.
+struct kvfifo_memory_usage {
+  // Wartości i (raz na każdy klucz) klucze.
+  std::size_t payload = 0;
+  // Węzły listy elementów i bloki kontrolne kluczy.
+  std::size_t node_overhead = 0;
+  // Mapa kluczy z łańcuchami ich elementów i numery elementów.
+  std::size_t index = 0;
+  // Koło czasowe z zegarami elementów z terminem ważności.
+  std::size_t timers = 0;
+  // Pozostałe: sam obiekt z danymi, wagi, śledzenie referencji.
+  std::size_t bookkeeping = 0;
+  // Ile z tego jest współdzielone z innymi kopiami, a ile należy tylko do
+  // tej kolejki. shared + exclusive == total().
+  std::size_t shared = 0;
+  std::size_t exclusive = 0;
+
+  std::size_t total() const noexcept {
+    return payload + node_overhead + index + timers + bookkeeping;
+  }
+};
+
+template <typename K, typename V,
+          typename Alloc = std::allocator<std::pair<K const, V>>>
+class kvfifo_simple {
+ public:
+  using ticks_t = std::uint64_t;
+
+ private:
+  struct entry;
+
+  // Wszystko, co trzymamy, alokujemy alokatorem Alloc (przepiętym na
+  // właściwy typ). Przepinanie węzłów między kolejkami wymaga równych
+  // alokatorów.
+  template <typename T>
+  using alloc_t =
+      typename std::allocator_traits<Alloc>::template rebind_alloc<T>;
+
+  // Struktura danych: trzymamy wszystkie elementy kolejki na liście.
+  // Dla szybkiego dostępu do elementów o danym kluczu, mamy mapę z klucza na
+  // łańcuch jego wystąpień: element mapy wskazuje (iteratorami) najstarsze
+  // i najnowsze, a kolejne są połączone przez pola samych elementów. Klucz,
+  // który występuje raz, kosztuje więc tylko element mapy, a kolejne
+  // wystąpienia nie alokują niczego poza elementem listy. Każdy klucz jest
+  // trzymany raz (we współdzielonym obiekcie, na który wskazują jego
+  // elementy i mapa). Wyjątkiem są małe, trywialnie kopiowalne klucze (np.
+  // liczby): wskaźnik z licznikiem byłby większy od nich, więc trzymamy je
+  // wprost w elementach i mapie.
+  //
+  // Wykorzystuje to zachowanie std::list polegające na tym, że iterator dla
+  // elementu unieważnia się tylko gdy ten element jest usuwany (także przy
+  // przepinaniu do innej listy przez splice).
+
+  // Lista elementów.
+  using items_t = std::list<entry, alloc_t<entry>>;
+  using item_iterator_t = items_t::iterator;
+
+  // Wystąpienia klucza, od najstarszego. Pola prev_at_key i next_at_key
+  // elementu mają sens tylko, gdy element nie jest odpowiednio pierwszy
+  // i ostatni, więc nigdy nie porównujemy ich z iteratorem pustym.
+  class key_chain {
+   public:
+    class iterator {
+     public:
+      using iterator_category = std::forward_iterator_tag;
+      using difference_type = std::ptrdiff_t;
+      using value_type = item_iterator_t;
+      using reference = item_iterator_t const &;
+
+      iterator() = default;
+      iterator(item_iterator_t node_, size_t left_) noexcept
+          : node(node_), left(left_) {}
+
+      item_iterator_t const &operator*() const noexcept { return node; }
+
+      // Następnik czytamy przed przejściem, więc bieżący element można potem
+      // usunąć.
+      iterator &operator++() noexcept {
+        if (--left > 0) node = node->next_at_key;
+        return *this;
+      }
+      iterator operator++(int) noexcept {
+        auto old = *this;
+        ++(*this);
+        return old;
+      }
+
+      bool operator==(iterator const &that) const noexcept {
+        return left == that.left;
+      }
+
+     private:
+      item_iterator_t node;
+      // Liczba elementów od bieżącego do końca łańcucha.
+      size_t left = 0;
+    };
+
+    iterator begin() const noexcept { return {first, count}; }
+    iterator end() const noexcept { return {}; }
+
+    item_iterator_t front() const noexcept { return first; }
+    item_iterator_t back() const noexcept { return last; }
+    size_t size() const noexcept { return count; }
+    bool empty() const noexcept { return count == 0; }
+
+    void push_back(item_iterator_t node) noexcept {
+      if (count == 0) {
+        first = node;
+      } else {
+        last->next_at_key = node;
+        node->prev_at_key = last;
+      }
+      last = node;
+      ++count;
+    }
+
+    void erase(item_iterator_t node) noexcept {
+      if (node == first) {
+        if (count > 1) first = node->next_at_key;
+      } else {
+        node->prev_at_key->next_at_key = node->next_at_key;
+      }
+      if (node == last) {
+        if (count > 1) last = node->prev_at_key;
+      } else {
+        node->next_at_key->prev_at_key = node->prev_at_key;
+      }
+      --count;
+    }
+
+    void pop_front() noexcept { erase(first); }
+
+    // Dołącza na koniec elementy that, that zostaje pusty.
+    void splice_back(key_chain &that) noexcept {
+      if (that.count == 0) return;
+      if (count == 0) {
+        first = that.first;
+      } else {
+        last->next_at_key = that.first;
+        that.first->prev_at_key = last;
+      }
+      last = that.last;
+      count += std::exchange(that.count, 0);
+    }
+
+   private:
+    item_iterator_t first, last;
+    size_t count = 0;
+  };
+
+  // Klucz trzymany wprost, z tym samym interfejsem co wskaźnik na klucz.
+  struct inline_key {
+    K key;
+    K const &operator*() const noexcept { return key; }
+    K const *get() const noexcept { return &key; }
+  };
+  static constexpr bool inline_keys =
+      std::is_trivially_copyable_v<K> &&
+      sizeof(K) <= sizeof(std::shared_ptr<K const>);
+  using key_ptr_t = std::conditional_t<inline_keys, inline_key,
+                                       std::shared_ptr<K const>>;
+  // Porównuje klucze, także wskazywane.
+  struct key_less {
+    using is_transparent = void;
+    bool operator()(key_ptr_t const &a, key_ptr_t const &b) const {
+      return *a < *b;
+    }
+    bool operator()(K const &a, key_ptr_t const &b) const { return a < *b; }
+    bool operator()(key_ptr_t const &a, K const &b) const { return *a < b; }
+  };
+  struct chain_size {
+    size_t operator()(key_chain const &chain) const noexcept {
+      return chain.size();
+    }
+  };
+  // Mapa z klucza na łańcuch jego elementów. Zna liczbę kluczy i elementów
+  // w każdym poddrzewie, więc zapytania o numery i przedziały kluczy są
+  // O(log n). Po zmianie długości łańcucha trzeba wywołać reweigh.
+  using items_by_key_t =
+      kvfifo_rank_map<key_ptr_t, key_chain, key_less, chain_size, Alloc>;
+
+  // Zegar elementu z terminem ważności wskazuje wszystko, co trzeba usunąć,
+  // gdy element wygaśnie, więc usunięcie nie wymaga szukania w mapie.
+  struct timer_target {
+    item_iterator_t item;
+    typename items_by_key_t::iterator key;
+  };
+  using timer_wheel_t = kvfifo_timer_wheel<timer_target, Alloc>;
+
+  // Koło tworzone leniwie, w pamięci z alokatora, który samo pamięta.
+  struct timers_deleter {
+    void operator()(timer_wheel_t *wheel) noexcept {
+      alloc_t<timer_wheel_t> alloc(wheel->get_allocator());
+      std::allocator_traits<alloc_t<timer_wheel_t>>::destroy(alloc, wheel);
+      std::allocator_traits<alloc_t<timer_wheel_t>>::deallocate(alloc, wheel,
+                                                                1);
+    }
+  };
+  using timers_ptr_t = std::unique_ptr<timer_wheel_t, timers_deleter>;
+
+  struct entry {
+    key_ptr_t key;
+    V value;
+    // Zegar w timers, jeśli element ma termin ważności.
+    std::optional<typename timer_wheel_t::position> timer;
+    // Sąsiednie elementy o tym samym kluczu, zob. key_chain.
+    item_iterator_t prev_at_key{}, next_at_key{};
+
+    std::pair<K const &, V const &> as_pair() const { return {*key, value}; }
+    std::pair<K const &, V &> as_pair() { return {*key, value}; }
+  };
+
+  // Wszystkie elementy. Kontenery trzymamy bezpośrednio, bo cały obiekt
+  // i tak jest współdzielony przez kvfifo, a puste nie alokują pamięci.
+  items_t items;
+  // Referencje do elementów o danym kluczu. Kopia robiona przy odłączaniu
+  // nie ma indeksu (indexed == false, mapa jest pusta), buduje go dopiero
+  // pierwsza operacja na kluczach. Kolejki używane tylko przez front i pop
+  // nigdy go nie potrzebują.
+  //
+  // Indeks (i numery poniżej) mogą więc powstać w metodzie stałej, na
+  // obiekcie współdzielonym przez kilka kopii kvfifo, z których każdą może
+  // czytać inny wątek. Budowę chroni mutex building, a gotowość ogłaszają
+  // indexed i positioned (atomowe), więc równoległe stałe operacje na
+  // różnych kopiach są bezpieczne, tak jak dla kontenerów standardowych.
+  // Budowa zmienia tylko indeks i pola łańcuchów kluczy w elementach
+  // (czytane wyłącznie przez indeks), nigdy kluczy ani wartości, które inne
+  // wątki mogą właśnie czytać; dlatego elementy dodane bez indeksu
+  // zachowują własne kopie klucza.
+  mutable items_by_key_t items_by_key;
+  mutable std::atomic<bool> indexed = true;
+  // Numery elementów w kolejce. Tak jak indeks kluczy, budowane dopiero przy
+  // pierwszym zapytaniu o numer (positioned == false oznacza, że ich nie
+  // ma), a potem utrzymywane przez push, pop i przesuwanie elementów.
+  // Operacje przepinające wiele elementów naraz (append, extract) po prostu
+  // je porzucają.
+  mutable kvfifo_slot_index<entry, Alloc> positions;
+  mutable std::atomic<bool> positioned = false;
+  mutable std::mutex building;
+  // Kursory czytające elementy w kolejności wstawiania, niezależnie od
+  // kolejki. Elementy wstawione przy otwartych kursorach tworzą dziennik
+  // (log): łańcuch przez pola next_in_log od najstarszego elementu, którego
+  // nie przeczytał któryś kursor, do log_tail (nullptr, gdy ostatni
+  // dopisany element już nie istnieje). Kursor pamięta następny element do
+  // przeczytania i liczbę nieprzeczytanych (unread == 0 znaczy, że
+  // przeczytał wszystko, a next jest pusty). Element usunięty z kolejki, na
+  // który czeka jeszcze któryś kursor, trafia do retained.
+  // Liczba czekających kursorów nie maleje wzdłuż dziennika, więc spada do
+  // zera zawsze na jego początku.
+  //
+  // Pola dziennika trzymamy w tablicy log obok elementów, tylko dla
+  // elementów, na które czeka któryś kursor (readers > 0), więc bez
+  // kursorów elementy nic za nie nie płacą.
+  struct cursor {
+    item_iterator_t next;
+    size_t unread = 0;
+  };
+  // Następny element w kolejności wstawiania, liczba kursorów, które
+  // jeszcze elementu nie przeczytały, i czy element jest już tylko
+  // w retained.
+  struct log_link {
+    item_iterator_t next_in_log{};
+    std::uint32_t readers = 0;
+    bool retired = false;
+  };
+  using log_t =
+      std::unordered_map<entry const *, log_link, std::hash<entry const *>,
+                         std::equal_to<entry const *>,
+                         alloc_t<std::pair<entry const *const, log_link>>>;
+  using cursor_name_t =
+      std::basic_string<char, std::char_traits<char>, alloc_t<char>>;
+  using cursors_t =
+      std::map<cursor_name_t, cursor, std::less<>,
+               alloc_t<std::pair<cursor_name_t const, cursor>>>;
+  cursors_t cursors;
+  log_t log;
+  items_t retained;
+  entry *log_tail = nullptr;
+  // Zegary elementów z terminem ważności. Tworzone przy pierwszym takim
+  // elemencie, bo koło zajmuje kilka kilobajtów.
+  timers_ptr_t timers;
+  // Sprawiedliwe (round robin) obsługiwanie kluczy: klucz, którego
+  // najstarszy element zdejmie pop_fair (end() oznacza powrót do początku),
+  // oraz liczba elementów zdjętych z niego w bieżącej turze.
+  typename items_by_key_t::iterator fair_key;
+  size_t fair_served = 0;
+  // Wagi kluczy (deficit round robin): w jednej turze klucz może oddać tyle
+  // elementów, ile wynosi jego waga. Domyślnie 1.
+  std::map<K, size_t, std::less<K>, alloc_t<std::pair<K const, size_t>>>
+      weights;
+  // Aktualne non-const referencje do wartości wydane na zewnątrz: owner to
+  // kvfifo, które je wydało, a aliased to posortowane adresy tych wartości.
+  // Referencje wydajemy tylko wtedy, gdy dane nie są współdzielone, więc
+  // każda kopia zrobiona później widzi te wartości przez swoje overlay.
+  // Właściciel może się zmienić (przeniesienie, zniszczenie) także wtedy,
+  // gdy inne wątki czytają kopie, stąd atomic.
+  std::atomic<void const *> owner = nullptr;
+  std::vector<V const *, alloc_t<V const *>> aliased;
+
+  timers_ptr_t make_timers(ticks_t now) const {
+    alloc_t<timer_wheel_t> alloc(get_allocator());
+    auto *wheel =
+        std::allocator_traits<alloc_t<timer_wheel_t>>::allocate(alloc, 1);
+
+    // Dalej bez wyjątków (konstruktor koła ich nie zgłasza).
+
+    std::allocator_traits<alloc_t<timer_wheel_t>>::construct(
+        alloc, wheel, now, get_allocator());
+    return timers_ptr_t(wheel);
+  }
+
+  key_ptr_t make_key(K const &k) const {
+    if constexpr (inline_keys) {
+      return {k};
+    } else {
+      return std::allocate_shared<K const>(get_allocator(), k);
+    }
+  }
+
+  void forget_refs() noexcept {
+    owner.store(nullptr, std::memory_order_relaxed);
+    aliased.clear();
+  }
+
+  // Usuwa pusty już element mapy, przesuwając kursor pop_fair jeśli na niego
+  // wskazywał.
+  void erase_key(typename items_by_key_t::iterator key) noexcept {
+    if (key == fair_key) {
+      fair_key = std::next(key);
+      fair_served = 0;
+    }
+    items_by_key.erase(key);
+  }
+
+  // Po usunięciu elementów z łańcucha klucza: usuwa klucz, jeśli łańcuch jest
+  // pusty, a w przeciwnym razie poprawia liczniki w mapie.
+  void shrink_key(typename items_by_key_t::iterator key) noexcept {
+    if (key->second.empty()) {
+      erase_key(key);
+    } else {
+      items_by_key.reweigh(key);
+    }
+  }
+
+  typename items_by_key_t::iterator fair_key_or_begin() noexcept {
+    return fair_key == items_by_key.end() ? items_by_key.begin() : fair_key;
+  }
+  typename items_by_key_t::const_iterator fair_key_or_begin() const noexcept {
+    return fair_key == items_by_key.end() ? items_by_key.begin() : fair_key;
+  }
+
+  size_t weight(K const &k) const {
+    if (weights.empty()) return 1;
+    auto it = weights.find(k);
+    return it == weights.end() ? 1 : it->second;
+  }
 
-template <typename K, typename V>
-class kvfifo_simple {
- private:
-  struct entry {
-    K key;
-    V value;
+  // Odpina element, który zaraz zostanie usunięty z items, od zegara
+  // i numerów.
+  void retire(entry &e) noexcept {
+    if (e.timer) timers->disarm(*e.timer);
+    e.timer.reset();
+    if (positioned) positions.release(&e);
+  }
 
-    std::pair<K const &, V const &> as_pair() const { return {key, value}; }
-    std::pair<K const &, V &> as_pair() { return {key, value}; }
-  };
+  // Porzuca numery elementów, zbuduje je znowu place.
+  void forget_positions() noexcept {
+    if (!positioned) return;
+    positions.reset();
+    positioned = false;
+  }
 
-  // Struktura danych: trzymamy wszystkie elementy kolejki na liście.
-  // Dla szybkiego dostępu do elementów o danym kluczu, mamy mapę dla danego
-  // klucza trzymającą referencje (iteratory) do wszystkich wystąpień elementów
-  // o tym kluczu.
-  //
-  // Wykorzystuje to zachowanie std::list polegające na tym, że iterator dla
-  // elementu unieważnia się tylko gdy ten element jest usuwany.
+  // Daje nowemu ostatniemu elementowi numer (albo porzuca numery, jeśli
+  // zabrakło wolnych slotów lub pamięci; zbuduje je znowu place).
+  void place_back(entry &e) noexcept {
+    if (!positioned) return;
+    if (!positions.back_room(1)) return forget_positions();
+    try {
+      positions.occupy(positions.claim_back(1), &e);
+    } catch (...) {
+      forget_positions();
+    }
+  }
 
-  // Lista elementów.
-  using items_t = std::list<entry>;
-  using shared_items_t = std::shared_ptr<items_t>;
-  using item_iterator_t = items_t::iterator;
-  // Lista iteratorów do elementów.
-  using item_iterators_t = std::list<item_iterator_t>;
-  // Mapa z klucza na listę iteratorów do elementów.
-  using items_by_key_t = std::map<K, item_iterators_t>;
-  using shared_items_by_key_t = std::shared_ptr<items_by_key_t>;
-
-  // Wszystkie elementy.
-  shared_items_t items;
-  // Referencje do elementów o danym kluczu.
-  shared_items_by_key_t items_by_key;
-  // Prawda jeśli na zewnątrz (bo zwróciliśmy w jakiejś metodzie) istnieje
-  // aktualna non-const referencja.
-  bool external_ref_exists = false;
+  // Buduje numery elementów, jeśli ich nie ma. Silna gwarancja. Złożoność
+  // O(n) za pierwszym razem, potem O(1).
+  void place() const {
+    if (positioned.load(std::memory_order_acquire)) return;
+    std::lock_guard lock(building);
+    if (positioned.load(std::memory_order_relaxed)) return;
+    auto &all = const_cast<items_t &>(items);
+    positions.assign(all.begin(), all.end(), all.size());
+
+    // Dalej bez wyjątków.
+
+    positioned.store(true, std::memory_order_release);
+  }
+
+  // Wpis dziennika elementu, na który czeka któryś kursor.
+  log_link &link_of(entry const &e) noexcept { return log.find(&e)->second; }
+  bool awaited(entry const &e) const noexcept {
+    return !log.empty() && log.contains(&e);
+  }
+
+  // Usuwa element z items. Jeśli czeka na niego któryś kursor, to element
+  // przechodzi do retained, skąd usunie go ostatni kursor, który go
+  // przeczyta.
+  void discard(item_iterator_t node) noexcept {
+    if (!awaited(*node)) {
+      if (&*node == log_tail) log_tail = nullptr;
+      items.erase(node);
+      return;
+    }
+    link_of(*node).retired = true;
+    retained.splice(retained.end(), items, node);
+  }
+
+  // Przygotowuje (alokuje) wpisy dziennika dla elementów [first, last),
+  // które zaraz dopisze enlist. Bez kursorów nic nie robi. Silna gwarancja.
+  template <typename It>
+  log_t stage_log(It first, It last) {
+    log_t staged(log.get_allocator());
+    if (cursors.empty()) return staged;
+    for (; first != last; ++first) staged.emplace(&*first, log_link());
+    log.reserve(log.size() + staged.size());
+    return staged;
+  }
+
+  // Dopisuje nowy element kolejki do dziennika, biorąc jego wpis
+  // z staged (zob. stage_log). Złożoność O(c) dla c kursorów.
+  void enlist(item_iterator_t node, log_t &staged) noexcept {
+    if (cursors.empty()) return;
+    bool behind = false;
+    for (auto &[name, c] : cursors) {
+      if (c.unread++ == 0) {
+        c.next = node;
+      } else {
+        behind = true;
+      }
+    }
+    // Jeśli któryś kursor nie przeczytał log_tail, to log_tail istnieje
+    // i ma wpis.
+    if (behind) link_of(*log_tail).next_in_log = node;
+    auto link = staged.extract(&*node);
+    link.mapped().readers = static_cast<std::uint32_t>(cursors.size());
+    // Miejsce zarezerwowało stage_log, więc tablica nie jest przebudowywana.
+    log.insert(std::move(link));
+    log_tail = &*node;
+  }
+
+  // Kursor przeczytał node albo przestał na niego czekać.
+  void pass(item_iterator_t node) noexcept {
+    auto link = log.find(&*node);
+    if (--link->second.readers > 0) return;
+    const bool retired = link->second.retired;
+    log.erase(link);
+    if (!retired) return;
+    if (&*node == log_tail) log_tail = nullptr;
+    retained.erase(node);
+  }
+
+  void push(K const &k, V const &v, std::optional<ticks_t> deadline) {
+    if (deadline) {
+      index();
+    } else if (!indexed) {
+      items_t staged(get_allocator());
+      staged.push_back({make_key(k), v, std::nullopt});
+      auto staged_log = stage_log(staged.begin(), staged.end());
+
+      // Dalej bez wyjątków.
+
+      items.splice(items.end(), staged);
+      place_back(items.back());
+      enlist(std::prev(items.end()), staged_log);
+
+      // Bo modyfikacja unieważnia.
+      forget_refs();
+      return;
+    }
+
+    // Trzeba dodać nowy element na koniec items. Trzeba dołączyć go do
+    // łańcucha jego klucza w items_by_key, a jeśli ma termin ważności, to
+    // dodać zegar w timers. Element tworzymy na osobnej liście i na końcu
+    // przepinamy (jego adres się nie zmienia, więc można pod nim
+    // przygotować wpis dziennika), a wcześniej przygotowujemy resztę. Jeśli
+    // klucz już jest, to dołączenie do łańcucha niczego nie alokuje.
+    auto items_at_key = items_by_key.lower_bound(k);
+    const bool key_exists =
+        items_at_key != items_by_key.end() && !(k < *items_at_key->first);
+    // Nowy element mapy dla przypadku gdy klucza nie ma w mapie.
+    typename items_by_key_t::node_type items_by_key_please_insert_maybe;
+    if (!key_exists) {
+      items_by_key_t staged(get_allocator());
+      items_by_key_please_insert_maybe =
+          staged.extract(staged.try_emplace(make_key(k)).first);
+    }
+    typename timer_wheel_t::timers_t timer_please_insert_maybe(
+        get_allocator());
+    timers_ptr_t timers_please_create_maybe;
+    if (deadline) {
+      timer_please_insert_maybe = timer_wheel_t::stage(
+          *deadline, {items.end(), items_at_key}, get_allocator());
+      if (!timers) timers_please_create_maybe = make_timers(0);
+    }
+    items_t staged(get_allocator());
+    staged.emplace_back(key_exists ? items_at_key->first
+                                   : items_by_key_please_insert_maybe.key(),
+                        v, std::nullopt);
+    auto staged_log = stage_log(staged.begin(), staged.end());
+
+    // Dalej bez wyjątków.
+
+    items.splice(items.end(), staged);
+    const auto item = std::prev(items.end());
+    place_back(*item);
+    enlist(item, staged_log);
+    auto key = items_at_key;
+    if (key_exists) {
+      key->second.push_back(item);
+      items_by_key.reweigh(key);
+    } else {
+      items_by_key_please_insert_maybe.mapped().push_back(item);
+      key = items_by_key.insert(items_at_key,
+                                std::move(items_by_key_please_insert_maybe));
+    }
+    if (deadline) {
+      auto &handle =
+          timer_wheel_t::handle(timer_please_insert_maybe.begin());
+      handle = {item, key};
+      if (timers_please_create_maybe) timers.swap(timers_please_create_maybe);
+      item->timer = timers->insert(timer_please_insert_maybe);
+    }
+
+    // Bo modyfikacja unieważnia.
+    forget_refs();
+  }
+
+  // Przenosi element mapy key (z łańcuchem elementów) i zegary jego
+  // elementów do to. Same elementy musi wcześniej przepiąć wywołujący.
+  void move_key(typename items_by_key_t::iterator key,
+                kvfifo_simple &to) noexcept {
+    if (key == fair_key) {
+      fair_key = std::next(key);
+      fair_served = 0;
+    }
+    auto there = to.items_by_key.insert(to.items_by_key.end(),
+                                        items_by_key.extract(key));
+    for (const auto &node : there->second) {
+      auto &timer = node->timer;
+      if (!timer) continue;
+      timers->transfer(*timer, *to.timers);
+      timer_wheel_t::handle(*timer).key = there;
+    }
+  }
+
+  // Buduje indeks kluczy, jeśli go nie ma. Silna gwarancja. Złożoność
+  // O(n log n) za pierwszym razem, potem O(1).
+  void index() const {
+    if (indexed.load(std::memory_order_acquire)) return;
+    std::lock_guard lock(building);
+    if (indexed.load(std::memory_order_relaxed)) return;
+    // Indeks trzyma zwykłe iteratory, a stałość obiektu nie dotyczy indeksu.
+    auto &all = const_cast<items_t &>(items);
+    items_by_key_t new_items_by_key(get_allocator());
+    for (auto walk = all.begin(); walk != all.end(); ++walk) {
+      new_items_by_key[walk->key].push_back(walk);
+    }
+    new_items_by_key.reweigh_all();
+
+    // Dalej bez wyjątków.
+
+    // Pusta mapa, więc merge tylko przepina węzły (fair_key == end()
+    // pozostaje ważny).
+    items_by_key.merge(new_items_by_key);
+    indexed.store(true, std::memory_order_release);
+  }
+
+  // Czy na któryś element klucza czeka kursor.
+  bool awaited(typename items_by_key_t::const_iterator key) const noexcept {
+    if (cursors.empty()) return false;
+    for (const auto &node : key->second) {
+      if (awaited(*node)) return true;
+    }
+    return false;
+  }
+
+  static std::optional<ticks_t> deadline_of(entry const &e) noexcept {
+    if (!e.timer) return std::nullopt;
+    return timer_wheel_t::deadline(*e.timer);
+  }
+
+  bool has_timers(typename items_by_key_t::const_iterator key) const noexcept {
+    if (!timers || timers->size() == 0) return false;
+    for (const auto &node : key->second) {
+      if (node->timer) return true;
+    }
+    return false;
+  }
 
  public:
-  kvfifo_simple()
-      : items(std::make_shared<items_t>()),
-        items_by_key(std::make_shared<items_by_key_t>()) {}
+  explicit kvfifo_simple(Alloc const &alloc = Alloc())
+      : items(alloc),
+        items_by_key(alloc),
+        positions(alloc),
+        cursors(alloc),
+        log(alloc),
+        retained(alloc),
+        fair_key(items_by_key.end()),
+        weights(alloc),
+        aliased(alloc) {}
+
+  Alloc get_allocator() const noexcept { return Alloc(items.get_allocator()); }
 
   kvfifo_simple &operator=(kvfifo_simple that) noexcept {
     auto new_items = that.item;
@@ -56,154 +1764,974 @@ class kvfifo_simple {
     return (*this);
   }
 
-  bool has_external_refs() const noexcept { return external_ref_exists; }
+  // Wartości, które właściciel mógł zmienić od chwili zrobienia kopii,
+  // posortowane po adresie.
+  using overlay_t =
+      std::vector<std::pair<V const *, V>, alloc_t<std::pair<V const *, V>>>;
+
+  bool owned_by(void const *who) const noexcept {
+    return owner.load(std::memory_order_relaxed) == who;
+  }
+
+  void disown(void const *who) noexcept {
+    owner.compare_exchange_strong(who, nullptr, std::memory_order_relaxed);
+  }
+
+  // Przekazuje własność przy przenoszeniu kvfifo.
+  void pass_ownership(void const *from, void const *to) noexcept {
+    owner.compare_exchange_strong(from, to, std::memory_order_relaxed);
+  }
+
+  bool has_aliases() const noexcept { return !aliased.empty(); }
+
+  // Czy wydano już non-const referencję do v. Złożoność O(log a).
+  bool aliases(V const &v) const noexcept {
+    return std::binary_search(aliased.begin(), aliased.end(), &v,
+                              std::less<>());
+  }
+
+  // Obecne wartości pod wydanymi referencjami. Złożoność O(a).
+  overlay_t snapshot() const {
+    overlay_t overlay(get_allocator());
+    overlay.reserve(aliased.size());
+    for (auto value : aliased) overlay.emplace_back(value, *value);
+    return overlay;
+  }
+
+  // Zapamiętuje, że who wydał non-const referencję do v. Dane nie mogą być
+  // współdzielone. Złożoność O(a), zwykle a jest małe.
+  void alias(V const &v, void const *who) {
+    auto at = std::lower_bound(aliased.begin(), aliased.end(), &v,
+                               std::less<>());
+    if (at == aliased.end() || *at != &v) {
+      const auto index = at - aliased.begin();
+      if (aliased.size() == aliased.capacity()) {
+        aliased.reserve(2 * aliased.size() + 1);
+      }
 
-  std::shared_ptr<kvfifo_simple> copy() const {
-    auto copy = std::make_shared<kvfifo_simple<K, V>>();
+      // Dalej bez wyjątków.
 
-    auto new_items = std::make_shared<items_t>(*items);
-    auto new_items_by_key = std::make_shared<items_by_key_t>();
-    for (auto walk = new_items->begin(); walk != new_items->end(); ++walk) {
-      (*new_items_by_key)[walk->key].push_back(walk);
+      aliased.insert(aliased.begin() + index, &v);
     }
+    owner.store(who, std::memory_order_relaxed);
+  }
 
-    // Dalej bez wyjątków.
+  // Kopiuje kursory, dziennik i zatrzymane elementy do copy, której items
+  // to już kopie naszych, w tej samej kolejności. Złożoność O(n + r log r),
+  // gdzie r to liczba elementów, na które czekają kursory.
+  template <typename View>
+  void copy_cursors(kvfifo_simple &copy, View const &view) const {
+    if (cursors.empty()) return;
+    // Kopie elementów z dziennika, posortowane po adresie oryginału.
+    std::vector<std::pair<entry const *, item_iterator_t>> twins;
+    auto there = copy.items.begin();
+    for (auto const &e : items) {
+      if (awaited(e)) twins.emplace_back(&e, there);
+      ++there;
+    }
+    const bool same_keys = copy.get_allocator() == get_allocator();
+    for (auto const &e : retained) {
+      twins.emplace_back(
+          &e, copy.retained.emplace(copy.retained.end(),
+                                    same_keys ? e.key : copy.make_key(*e.key),
+                                    view(e.value), std::nullopt));
+    }
+    std::sort(twins.begin(), twins.end(), [](auto const &a, auto const &b) {
+      return std::less<>()(a.first, b.first);
+    });
+    auto twin = [&twins](entry const *node) {
+      return std::lower_bound(twins.begin(), twins.end(), node,
+                              [](auto const &a, entry const *b) {
+                                return std::less<>()(a.first, b);
+                              })
+          ->second;
+    };
+    for (auto const &[name, c] : cursors) {
+      copy.cursors.emplace(
+          cursor_name_t(name.begin(), name.end(), copy.get_allocator()),
+          cursor{c.unread > 0 ? twin(&*c.next) : item_iterator_t(), c.unread});
+    }
+    copy.log.reserve(twins.size());
+    for (auto const &[e, node] : twins) {
+      log_link const &link = log.find(e)->second;
+      copy.log.emplace(&*node,
+                       log_link{log_tail != e ? twin(&*link.next_in_log)
+                                              : item_iterator_t(),
+                                link.readers, link.retired});
+    }
+    // Element z dziennika, na który czeka kursor, jest przed log_tail albo
+    // nim jest, więc wtedy log_tail istnieje.
+    if (!twins.empty()) copy.log_tail = &*twin(log_tail);
+  }
+
+  // Kopia, w której każda wartość v ma wartość view(v).
+  template <typename View>
+  std::shared_ptr<kvfifo_simple> copy(View const &view) const {
+    auto copy =
+        std::allocate_shared<kvfifo_simple>(get_allocator(), get_allocator());
 
-    copy->items = new_items;
-    copy->items_by_key = new_items_by_key;
+    // Budujemy od razu w nowym obiekcie, nikt poza nami go nie widzi. Jeśli
+    // coś się nie uda, to zostanie po prostu zniszczony.
+
+    for (auto const &e : items) {
+      copy->items.emplace_back(e.key, view(e.value), e.timer);
+    }
+    copy_cursors(*copy, view);
+    copy->weights = weights;
+    // Indeks kopiujemy od razu tylko, gdy korzystają z niego zegary albo
+    // kursor pop_fair.
+    const bool timed = timers && timers->size() > 0;
+    if (!timed && fair_key == items_by_key.end()) {
+      copy->indexed = false;
+      return copy;
+    }
+    auto &new_items_by_key = copy->items_by_key;
+    for (auto walk = copy->items.begin(); walk != copy->items.end(); ++walk) {
+      new_items_by_key[walk->key].push_back(walk);
+    }
+    new_items_by_key.reweigh_all();
+    // Skopiowane elementy wskazują zegary w starym kole, trzeba zbudować nowe.
+    if (timed) {
+      copy->timers = copy->make_timers(timers->now());
+      for (auto key_it = new_items_by_key.begin();
+           key_it != new_items_by_key.end(); ++key_it) {
+        for (const auto &node : key_it->second) {
+          auto &timer = node->timer;
+          if (!timer) continue;
+          timer = copy->timers->arm(timer_wheel_t::deadline(*timer),
+                                    {node, key_it});
+        }
+      }
+    }
+    copy->fair_key = fair_key == items_by_key.end()
+                         ? new_items_by_key.end()
+                         : new_items_by_key.find(fair_key->first);
+    copy->fair_served = fair_served;
 
     return copy;
   }
 
-  void push(K const &k, V const &v) {
-    // Trzeba dodać nowy element na koniec items. Trzeba zapisać referencję do
-    // niego w odpowiednim miejscu w items_by_key.
-    items_t items_please_push_back = {{k, v}};
-    // Zapisujemy nowy element mapy dla przypadku gdy trzeba stworzyć nowy
-    // element mapy, i nowy element listy dla przypadku gdy już jest w mapie.
-    items_by_key_t items_by_key_please_insert_maybe = {
-        {k, {items_please_push_back.begin()}}};
-    item_iterators_t item_at_key_please_push_back_maybe = {
-        items_please_push_back.begin()};
-
-    // Dalej bez wyjątków.
-
-    items->splice(items->end(), items_please_push_back);
-    auto items_at_key = items_by_key->find(k);
-    if (items_at_key == items_by_key->end()) {
-      // Klucz nie istniał.
-      items_by_key->merge(items_by_key_please_insert_maybe);
-    } else {
-      // Istniał.
-      items_at_key->second.splice(items_at_key->second.end(),
-                                  item_at_key_please_push_back_maybe);
+  // Kopia w pamięci z alokatora alloc. Jeśli jest inny niż nasz, to
+  // kopiujemy też klucze (żeby kopia nie zależała od naszej pamięci), więc
+  // budujemy ją przez push. Złożoność O(n log n).
+  template <typename View>
+  std::shared_ptr<kvfifo_simple> copy(View const &view,
+                                      Alloc const &alloc) const {
+    if (alloc == get_allocator()) return copy(view);
+    auto copy = std::allocate_shared<kvfifo_simple>(alloc, alloc);
+    if (timers && timers->size() > 0) {
+      copy->timers = copy->make_timers(timers->now());
+    }
+    for (auto const &e : items) {
+      copy->push(*e.key, view(e.value), deadline_of(e));
+    }
+    copy_cursors(*copy, view);
+    for (auto const &[k, w] : weights) copy->weights.emplace(k, w);
+    if (fair_key != items_by_key.end()) {
+      copy->fair_key = copy->items_by_key.find(*fair_key->first);
+      copy->fair_served = fair_served;
     }
 
-    // Bo modyfikacja unieważnia.
-    external_ref_exists = false;
+    return copy;
+  }
+
+  void push(K const &k, V const &v) { push(k, v, std::nullopt); }
+
+  // Wypełnia pustą kolejkę parami (klucz, wartość) z [first, last), w tej
+  // kolejności. Elementy powstają w jednym przejściu, a indeks z węzłów
+  // posortowanych stabilnie po kluczu: mapę budujemy od najmniejszego klucza,
+  // wstawiając na koniec z podpowiedzią, więc nie przeszukujemy jej, a każdy
+  // klucz alokujemy raz. Silna gwarancja. Złożoność O(n log n) porównań
+  // kluczy i O(n + d) alokacji, gdzie d to liczba różnych kluczy.
+  template <std::forward_iterator It, std::sentinel_for<It> Sentinel>
+  void assign(It first, Sentinel last) {
+    items_t new_items(get_allocator());
+    std::vector<std::pair<It, item_iterator_t>> nodes;
+    nodes.reserve(static_cast<size_t>(std::ranges::distance(first, last)));
+    // Klucz wspólny z mapą wpiszemy później, a trzymany wprost od razu.
+    auto own_key = [this](K const &k) {
+      if constexpr (inline_keys) {
+        return make_key(k);
+      } else {
+        return key_ptr_t();
+      }
+    };
+    for (auto walk = first; walk != last; ++walk) {
+      nodes.emplace_back(
+          walk, new_items.emplace(new_items.end(), own_key(std::get<0>(*walk)),
+                                  std::get<1>(*walk), std::nullopt));
+    }
+    std::stable_sort(nodes.begin(), nodes.end(),
+                     [](auto const &a, auto const &b) {
+                       return std::get<0>(*a.first) < std::get<0>(*b.first);
+                     });
+    items_by_key_t new_items_by_key(get_allocator());
+    for (auto group = nodes.begin(); group != nodes.end();) {
+      K const &k = std::get<0>(*group->first);
+      auto items_at_key = new_items_by_key.emplace_hint(
+          new_items_by_key.end(), make_key(k), key_chain());
+      for (; group != nodes.end() && !(k < std::get<0>(*group->first));
+           ++group) {
+        items_at_key->second.push_back(group->second);
+        group->second->key = items_at_key->first;
+      }
+    }
+    new_items_by_key.reweigh_all();
+
+    // Dalej bez wyjątków.
+
+    items.splice(items.end(), new_items);
+    items_by_key.swap(new_items_by_key);
+    fair_key = items_by_key.end();
+    forget_positions();
+  }
+
+  // Element wygaśnie w pierwszym expire(now) z now >= deadline.
+  void push(K const &k, V const &v, ticks_t deadline) {
+    push(k, v, std::optional<ticks_t>(deadline));
   }
 
   void pop() {
-    auto [key, value] = items->front();
-    items->pop_front();
-    auto &items_at_key = items_by_key->at(key);
-    items_at_key.pop_front();
-    if (items_at_key.empty()) items_by_key->erase(key);
+    if (!indexed) {
+      // Bez wyjątków.
+      if (positioned) positions.release(&items.front());
+      discard(items.begin());
+
+      // Bo modyfikacja unieważnia.
+      forget_refs();
+      return;
+    }
+    const auto node = items.begin();
+    auto items_at_key = items_by_key.find(node->key);
+
+    // Dalej bez wyjątków.
+
+    retire(*node);
+    items_at_key->second.pop_front();
+    shrink_key(items_at_key);
+    discard(node);
 
     // Bo modyfikacja unieważnia.
-    external_ref_exists = false;
+    forget_refs();
   }
 
   void pop(K const &k) {
-    auto &items_at_key = items_by_key->at(k);
+    index();
+    auto key = items_by_key.find(k);
+    auto &items_at_key = key->second;
     const auto node = items_at_key.front();
+    retire(*node);
     items_at_key.pop_front();
-    if (items_at_key.empty()) items_by_key->erase(k);
-    items->erase(node);
+    shrink_key(key);
+    discard(node);
 
     // // Bo modyfikacja unieważnia.
-    external_ref_exists = false;
+    forget_refs();
+  }
+
+  // Usuwa wszystkie elementy o kluczu k jednym wyszukaniem w mapie.
+  // Złożoność O(m + log n).
+  void pop_all(K const &k) {
+    index();
+    pop_all(items_by_key.find(k));
+  }
+
+  void pop_all(typename items_by_key_t::iterator key) noexcept {
+    // Bez wyjątków.
+
+    // Iterator łańcucha przechodzi dalej przed usunięciem elementu.
+    for (auto at_key = key->second.begin(); at_key != key->second.end();) {
+      const auto node = *at_key++;
+      retire(*node);
+      discard(node);
+    }
+    erase_key(key);
+
+    // Bo modyfikacja unieważnia.
+    forget_refs();
+  }
+
+  // Elementy do usunięcia przez erase_if, posortowane po adresie.
+  using erase_plan = std::vector<entry const *>;
+
+  // Pierwsza faza erase_if: wszystko, co może zgłosić wyjątek (pred
+  // i alokacja). pred(k, v) jest wołane raz dla każdego elementu, w
+  // kolejności kolejki. Złożoność O(n + d log d) dla d wybranych.
+  template <typename Pred>
+  erase_plan plan_erase_if(Pred &pred) const {
+    erase_plan doomed;
+    for (auto const &e : items) {
+      if (pred(static_cast<K const &>(*e.key), e.value)) doomed.push_back(&e);
+    }
+    std::sort(doomed.begin(), doomed.end(), std::less<>());
+    return doomed;
+  }
+
+  // Druga faza: usuwa wybrane elementy, poprawiając łańcuchy kluczy na
+  // miejscu, bez przebudowy mapy. Złożoność O(n log d).
+  void erase(erase_plan const &doomed) noexcept {
+    if (doomed.empty()) return;
+    auto is_doomed = [&](entry const &e) noexcept {
+      return std::binary_search(doomed.begin(), doomed.end(), &e,
+                                std::less<>());
+    };
+    if (!indexed) {
+      // Bez indeksu nie ma też zegarów.
+      if (cursors.empty()) {
+        items.remove_if(is_doomed);
+      } else {
+        for (auto walk = items.begin(); walk != items.end();) {
+          const auto node = walk++;
+          if (is_doomed(*node)) discard(node);
+        }
+      }
+      forget_positions();
+    } else {
+      for (auto key = items_by_key.begin(); key != items_by_key.end();) {
+        auto &items_at_key = key->second;
+        for (auto at_key = items_at_key.begin();
+             at_key != items_at_key.end();) {
+          const auto node = *at_key++;
+          if (!is_doomed(*node)) continue;
+          retire(*node);
+          items_at_key.erase(node);
+          discard(node);
+        }
+        const auto next = std::next(key);
+        shrink_key(key);
+        key = next;
+      }
+    }
+
+    // Bo modyfikacja unieważnia.
+    forget_refs();
+  }
+
+  // Iteratory do elementów mapy dla kluczy z keys (end() dla brakujących),
+  // w kolejności keys. Złożoność O(r log n).
+  template <typename Range>
+  std::vector<typename items_by_key_t::iterator> find_keys(
+      Range const &keys) {
+    index();
+    std::vector<typename items_by_key_t::iterator> found;
+    for (K const &k : keys) found.push_back(items_by_key.find(k));
+    return found;
+  }
+
+  bool is_end(typename items_by_key_t::iterator key) const noexcept {
+    return key == items_by_key.end();
+  }
+
+  // Przesuwa elementy o danym kluczu na koniec (lub początek) kolejki,
+  // zachowując ich kolejność. Węzły przepinamy przez splice, więc łańcuchy
+  // w items_by_key i zegary pozostają ważne, a nic nie jest kopiowane.
+  // Złożoność O(m).
+  void move_to_back(typename items_by_key_t::iterator key) noexcept {
+    // Bez wyjątków.
+    const size_t m = key->second.size();
+    if (positioned && !positions.back_room(m)) forget_positions();
+    for (const auto &node : key->second) {
+      items.splice(items.end(), items, node);
+      if (positioned) positions.move(&*node, positions.claim_back(1));
+    }
+
+    // Bo modyfikacja unieważnia.
+    forget_refs();
+  }
+
+  void move_to_front(typename items_by_key_t::iterator key) noexcept {
+    // Bez wyjątków.
+    const size_t m = key->second.size();
+    if (positioned && !positions.front_room(m)) forget_positions();
+    if (positioned) {
+      size_t slot = positions.claim_front(m);
+      for (const auto &node : key->second) positions.move(&*node, slot++);
+    }
+    auto before = items.begin();
+    for (const auto &node : key->second) {
+      if (node == before) {
+        ++before;
+      } else {
+        items.splice(before, items, node);
+      }
+    }
+
+    // Bo modyfikacja unieważnia.
+    forget_refs();
   }
 
   void move_to_back(K const &k) {
-    // Trzeba zamienić wszystkie elementy z kluczem k: usunąć wszystkie z items,
-    // i dodać nowe na koniec. Przez to trzeba zamienić referencje w
-    // items_by_key (zmienią się wszystkie).
-    item_iterators_t items_at_key_please_swap;
-    items_t items_please_push_back;
-    item_iterators_t items_please_erase;
-    auto &items_at_key = items_by_key->at(k);
-    for (const auto &node : items_at_key) {
-      items_please_push_back.push_back(*node);
-      items_at_key_please_swap.push_back(
-          std::prev(items_please_push_back.end()));
-      items_please_erase.push_back(node);
+    index();
+    move_to_back(items_by_key.find(k));
+  }
+
+  void move_to_front(K const &k) {
+    index();
+    move_to_front(items_by_key.find(k));
+  }
+
+  // Grupy lądują na końcu w kolejności keys (przy powtórzeniach decyduje
+  // ostatnie wystąpienie).
+  void move_to_back(std::vector<typename items_by_key_t::iterator> const
+                        &keys) noexcept {
+    for (auto key : keys) move_to_back(key);
+  }
+
+  // Grupy lądują na początku w kolejności keys (przy powtórzeniach decyduje
+  // pierwsze wystąpienie).
+  void move_to_front(std::vector<typename items_by_key_t::iterator> const
+                         &keys) noexcept {
+    for (auto key = keys.rbegin(); key != keys.rend(); ++key) {
+      move_to_front(*key);
+    }
+  }
+
+  // Elementy mapy dla kluczy z [lo, hi) (pusty zakres, jeśli hi <= lo).
+  // Złożoność O(log n).
+  using key_range_t = std::pair<typename items_by_key_t::iterator,
+                                typename items_by_key_t::iterator>;
+
+  key_range_t find_range(K const &lo, K const &hi) {
+    index();
+    const auto first = items_by_key.lower_bound(lo);
+    return {first, lo < hi ? items_by_key.lower_bound(hi) : first};
+  }
+
+  // Usuwa elementy wszystkich kluczy z range, a ich elementy mapy wycina
+  // z drzewa naraz. Złożoność O(m + log n).
+  void pop_range(key_range_t range) noexcept {
+    // Bez wyjątków.
+    if (range.first == range.second) return;
+    for (auto key = range.first; key != range.second; ++key) {
+      auto &chain = key->second;
+      for (auto at_key = chain.begin(); at_key != chain.end();) {
+        const auto node = *at_key++;
+        retire(*node);
+        discard(node);
+      }
+    }
+    const size_t fair = items_by_key.rank(fair_key);
+    if (items_by_key.rank(range.first) <= fair &&
+        fair < items_by_key.rank(range.second)) {
+      fair_key = range.second;
+      fair_served = 0;
+    }
+    items_by_key.erase(range.first, range.second);
+
+    // Bo modyfikacja unieważnia.
+    forget_refs();
+  }
+
+  // Grupy kluczy z range lądują na końcu w kolejności rosnących kluczy.
+  // Złożoność O(m).
+  void move_to_back(key_range_t range) noexcept {
+    for (auto key = range.first; key != range.second; ++key) {
+      move_to_back(key);
+    }
+  }
+
+  // Przygotowanie do append: wszystko, co może zgłosić wyjątek.
+  struct append_plan {
+    // Klucze obecne w obu kolejkach: (element mapy other, element mapy
+    // this), posortowane po adresie elementu other.
+    std::vector<std::pair<typename items_by_key_t::iterator,
+                          typename items_by_key_t::iterator>>
+        common;
+    timers_ptr_t timers;
+    // Wpisy dziennika dla dołączanych elementów, jeśli mamy kursory.
+    log_t log;
+  };
+
+  append_plan plan_append(kvfifo_simple &other) {
+    append_plan plan{{}, {}, stage_log(other.items.begin(), other.items.end())};
+    // Jeśli obie strony nie mają indeksu, to wystarczy przepiąć elementy.
+    if (indexed || other.indexed) {
+      index();
+      other.index();
+    }
+    for (auto key = other.items_by_key.begin();
+         key != other.items_by_key.end(); ++key) {
+      auto here = items_by_key.find(key->first);
+      if (here != items_by_key.end()) plan.common.emplace_back(key, here);
+    }
+    std::sort(plan.common.begin(), plan.common.end(),
+              [](auto const &a, auto const &b) {
+                return std::less<>()(&*a.first, &*b.first);
+              });
+    if (!timers && other.timers && other.timers->size() > 0) {
+      plan.timers = make_timers(0);
+    }
+    return plan;
+  }
+
+  // Przepina wszystkie elementy other na koniec kolejki, other zostaje
+  // pusta. Łańcuchy elementów kluczy obecnych w obu kolejkach są sklejane,
+  // a pozostałe elementy mapy przenoszone przez merge, więc nic nie jest
+  // kopiowane. Złożoność O(k log n + t), gdzie k to liczba kluczy w other,
+  // a t to liczba elementów other z terminem ważności.
+  void append(kvfifo_simple &other, append_plan &plan) noexcept {
+    // Bez wyjątków.
+    const bool enlisting = !other.items.empty() && !cursors.empty();
+    const auto appended = other.items.begin();
+    items.splice(items.end(), other.items);
+    forget_positions();
+    other.forget_positions();
+    // Dołączone elementy są dla naszych kursorów nowe, a kursory other
+    // przepadają.
+    if (enlisting) {
+      for (auto walk = appended; walk != items.end(); ++walk) {
+        enlist(walk, plan.log);
+      }
+    }
+    other.cursors.clear();
+    other.log.clear();
+    other.retained.clear();
+    other.log_tail = nullptr;
+    for (auto &[there, here] : plan.common) {
+      here->second.splice_back(there->second);
+      items_by_key.reweigh(here);
+    }
+    // Przenosi elementy mapy kluczy, których tu nie było. W other zostają
+    // puste łańcuchy kluczy wspólnych.
+    items_by_key.merge(other.items_by_key);
+    if (other.timers && other.timers->size() > 0) {
+      if (!timers) timers.swap(plan.timers);
+      timers->adopt(*other.timers, [&](timer_target &target) noexcept {
+        auto renamed = std::lower_bound(
+            plan.common.begin(), plan.common.end(), &*target.key,
+            [](auto const &a, auto const *b) {
+              return std::less<>()(&*a.first, b);
+            });
+        if (renamed != plan.common.end() && renamed->first == target.key) {
+          target.key = renamed->second;
+        }
+      });
+    }
+    other.items_by_key.clear();
+    other.fair_key = other.items_by_key.end();
+    other.fair_served = 0;
+    other.indexed = true;
+
+    // Bo modyfikacja unieważnia.
+    forget_refs();
+    other.forget_refs();
+  }
+
+  // Przenosi wszystkie elementy o kluczu k do nowej kolejki, bez kopiowania
+  // wartości. Jedyne alokacje to nowy obiekt (i koło czasowe, jeśli
+  // przenoszone elementy mają terminy ważności). Złożoność O(m + log n).
+  std::shared_ptr<kvfifo_simple> extract(K const &k) {
+    index();
+    auto key = items_by_key.find(k);
+    auto extracted =
+        std::allocate_shared<kvfifo_simple>(get_allocator(), get_allocator());
+    if (has_timers(key)) {
+      extracted->timers = extracted->make_timers(timers->now());
+    }
+    if (awaited(key)) {
+      // Elementy, na które czekają kursory, zostają w retained, więc nowa
+      // kolejka dostaje ich kopie.
+      for (const auto &node : key->second) {
+        extracted->push(k, node->value, deadline_of(*node));
+      }
+
+      // Dalej bez wyjątków.
+
+      pop_all(key);
+      forget_positions();
+      return extracted;
+    }
+
+    // Dalej bez wyjątków.
+
+    for (const auto &node : key->second) {
+      extracted->items.splice(extracted->items.end(), items, node);
+    }
+    move_key(key, *extracted);
+    forget_positions();
+
+    // Bo modyfikacja unieważnia.
+    forget_refs();
+    return extracted;
+  }
+
+  // Przenosi do nowej kolejki elementy wszystkich kluczy k, dla których
+  // pred(k), zachowując ich kolejność. pred jest wołane raz dla każdego
+  // klucza. Złożoność O(n + k log n) dla k wybranych kluczy: żeby zachować
+  // kolejność między kluczami, przeglądamy całą kolejkę raz.
+  template <typename Pred>
+  std::shared_ptr<kvfifo_simple> extract_if(Pred &pred) {
+    index();
+    std::vector<typename items_by_key_t::iterator> keys;
+    std::vector<entry const *> picked;
+    auto extracted =
+        std::allocate_shared<kvfifo_simple>(get_allocator(), get_allocator());
+    bool timed = false;
+    for (auto key = items_by_key.begin(); key != items_by_key.end(); ++key) {
+      if (!pred(static_cast<K const &>(*key->first))) continue;
+      keys.push_back(key);
+      for (const auto &node : key->second) picked.push_back(&*node);
+      timed = timed || has_timers(key);
+    }
+    std::sort(picked.begin(), picked.end(), std::less<>());
+    if (timed) {
+      extracted->timers = extracted->make_timers(timers->now());
+    }
+    if (std::any_of(keys.begin(), keys.end(),
+                    [this](auto key) { return awaited(key); })) {
+      // Jak w extract: kursory zatrzymują oryginały.
+      for (auto const &e : items) {
+        if (!std::binary_search(picked.begin(), picked.end(), &e,
+                                std::less<>())) {
+          continue;
+        }
+        extracted->push(*e.key, e.value, deadline_of(e));
+      }
+
+      // Dalej bez wyjątków.
+
+      for (auto key : keys) pop_all(key);
+      forget_positions();
+      return extracted;
     }
 
     // Dalej bez wyjątków.
 
-    items->splice(items->end(), items_please_push_back);
-    for (const auto &node : items_please_erase) items->erase(node);
-    items_at_key.swap(items_at_key_please_swap);
+    if (keys.empty()) return extracted;
+    for (auto walk = items.begin(); walk != items.end();) {
+      auto node = walk++;
+      if (std::binary_search(picked.begin(), picked.end(), &*node,
+                             std::less<>())) {
+        extracted->items.splice(extracted->items.end(), items, node);
+      }
+    }
+    for (auto key : keys) move_key(key, *extracted);
+    forget_positions();
 
     // Bo modyfikacja unieważnia.
-    external_ref_exists = false;
+    forget_refs();
+    return extracted;
   }
 
   std::pair<K const &, V &> front() {
-    external_ref_exists = true;
-    return items->front().as_pair();
+    return items.front().as_pair();
   }
   std::pair<K const &, V const &> front() const {
-    return items->front().as_pair();
+    return items.front().as_pair();
   }
   std::pair<K const &, V &> back() {
-    external_ref_exists = true;
-    return items->back().as_pair();
+    return items.back().as_pair();
   }
   std::pair<K const &, V const &> back() const {
-    return items->back().as_pair();
+    return items.back().as_pair();
   }
 
   std::pair<K const &, V &> first(K const &k) {
-    external_ref_exists = true;
-    return items_by_key->at(k).front()->as_pair();
+    index();
+    return items_by_key.find(k)->second.front()->as_pair();
   }
   std::pair<K const &, V const &> first(K const &k) const {
-    return items_by_key->at(k).front()->as_pair();
+    index();
+    return items_by_key.find(k)->second.front()->as_pair();
   }
   std::pair<K const &, V &> last(K const &k) {
-    external_ref_exists = true;
-    return items_by_key->at(k).back()->as_pair();
+    index();
+    return items_by_key.find(k)->second.back()->as_pair();
+  }
+  std::pair<K const &, V const &> last(K const &k) const {
+    index();
+    return items_by_key.find(k)->second.back()->as_pair();
+  }
+
+  // Numery elementów (liczba elementów przed nimi w kolejce). Złożoność
+  // O(log n), a gdy numerów nie ma (zob. positions), O(n).
+  size_t position_of_first(K const &k) const {
+    index();
+    place();
+    return positions.position(&*items_by_key.find(k)->second.front());
+  }
+  size_t position_of_last(K const &k) const {
+    index();
+    place();
+    return positions.position(&*items_by_key.find(k)->second.back());
+  }
+
+  // Element o numerze i, i < size().
+  std::pair<K const &, V &> at(size_t i) {
+    place();
+    return positions.at(i)->as_pair();
+  }
+  std::pair<K const &, V const &> at(size_t i) const {
+    place();
+    return static_cast<entry const *>(positions.at(i))->as_pair();
+  }
+
+  // Najstarszy element klucza, na który przypada kolej w obsłudze round
+  // robin. Złożoność O(1).
+  std::pair<K const &, V &> front_fair() {
+    index();
+    return fair_key_or_begin()->second.front()->as_pair();
+  }
+  std::pair<K const &, V const &> front_fair() const {
+    index();
+    return fair_key_or_begin()->second.front()->as_pair();
+  }
+
+  // Usuwa element zwracany przez front_fair. Kolejny klucz (rosnąco, potem od
+  // początku) dostaje kolej, gdy bieżący wyczerpie swoją wagę albo elementy.
+  // Złożoność O(1) zamortyzowane, O(log w) gdy ustawiono w wag.
+  void pop_fair() {
+    index();
+    auto key = fair_key_or_begin();
+    const size_t key_weight = weight(*key->first);
+
+    // Dalej bez wyjątków.
+
+    fair_key = key;
+    const auto node = key->second.front();
+    retire(*node);
+    key->second.pop_front();
+    discard(node);
+    if (key->second.empty()) {
+      erase_key(key);
+    } else {
+      items_by_key.reweigh(key);
+      if (++fair_served >= key_weight) {
+        ++fair_key;
+        fair_served = 0;
+      }
+    }
+
+    // Bo modyfikacja unieważnia.
+    forget_refs();
+  }
+
+  void set_weight(K const &k, size_t w) {
+    if (w == 1) {
+      weights.erase(k);
+    } else {
+      weights.insert_or_assign(k, w);
+    }
+  }
+
+  size_t size() const noexcept { return items.size(); }
+
+  bool empty() const noexcept { return items.empty(); }
+
+  // Woła f dla każdej wartości (albo tylko wartości klucza *k) w kolejności
+  // kolejki. Złożoność O(n), dla klucza O(m + log n).
+  template <typename F>
+  void visit(K const *k, F &&f) const {
+    if (k == nullptr) {
+      for (auto const &e : items) f(e.value);
+      return;
+    }
+    index();
+    auto key = items_by_key.find(*k);
+    if (key == items_by_key.end()) return;
+    for (auto const &node : key->second) f(node->value);
+  }
+
+  // Bez shared i exclusive, te zależą od tego, kto patrzy. Złożoność O(1),
+  // a bez indeksu O(n log n), bo liczymy różne obiekty kluczy.
+  kvfifo_memory_usage memory_usage() const {
+    constexpr size_t link = 2 * sizeof(void *);
+    constexpr size_t tree_link = 4 * sizeof(void *);
+    // allocate_shared trzyma licznik referencji obok klucza. Klucze trzymane
+    // wprost liczymy w każdym elemencie (kopie w mapie należą do indeksu).
+    constexpr size_t key_control =
+        inline_keys ? 0 : 2 * sizeof(long) + sizeof(void *);
+    constexpr size_t inline_key_bytes = inline_keys ? sizeof(K) : 0;
+    // Indeks i numery może właśnie budować inny wątek, więc patrzymy na nie
+    // tylko, gdy są gotowe.
+    const bool built = indexed.load(std::memory_order_acquire);
+    const size_t index_keys = built ? items_by_key.size() : 0;
+    const size_t positions_bytes =
+        positioned.load(std::memory_order_acquire) ? positions.bytes() : 0;
+    // Pola łańcucha klucza w elemencie liczymy do indeksu, o ile jest.
+    const size_t chain_link = built ? 2 * sizeof(item_iterator_t) : 0;
+    // Elementy zatrzymane dla kursorów liczymy jak elementy kolejki.
+    const size_t entries = items.size() + retained.size();
+
+    size_t keys = index_keys;
+    if (inline_keys) {
+      keys = entries;
+    } else if (!built) {
+      std::vector<K const *> key_objects;
+      key_objects.reserve(items.size());
+      for (auto const &e : items) key_objects.push_back(e.key.get());
+      std::sort(key_objects.begin(), key_objects.end(), std::less<>());
+      keys = std::unique(key_objects.begin(), key_objects.end()) -
+             key_objects.begin();
+    }
+    kvfifo_memory_usage usage;
+    usage.payload = entries * sizeof(V) + keys * sizeof(K);
+    usage.node_overhead =
+        entries * (link + sizeof(entry) - sizeof(V) - inline_key_bytes -
+                   chain_link) +
+        keys * key_control;
+    usage.index = index_keys * items_by_key_t::node_bytes +
+                  items.size() * chain_link + positions_bytes;
+    usage.timers = timers ? timers->bytes() : 0;
+    usage.bookkeeping =
+        sizeof(*this) + aliased.capacity() * sizeof(V const *) +
+        weights.size() * (tree_link + sizeof(std::pair<K const, size_t>)) +
+        cursors.size() * (tree_link + sizeof(typename cursors_t::value_type));
+    if (!log.empty()) {
+      usage.bookkeeping +=
+          log.bucket_count() * sizeof(void *) +
+          log.size() * (link + sizeof(typename log_t::value_type));
+    }
+    return usage;
+  }
+
+  // Oddaje pamięć, która została po skokach ruchu: puste koło czasowe
+  // i nadmiarową pojemność śledzenia referencji.
+  void shrink_to_fit() {
+    aliased.shrink_to_fit();
+
+    // Dalej bez wyjątków.
+
+    if (timers && timers->size() == 0) timers.reset();
+  }
+
+  size_t count(K const &k) const {
+    index();
+    auto it = items_by_key.find(k);
+    if (it == items_by_key.end()) {
+      return 0;
+    }
+    return it->second.size();
+  }
+
+  // Zapytania o klucze według ich kolejności. Złożoność O(log n).
+  size_t distinct_keys() const {
+    index();
+    return items_by_key.size();
+  }
+
+  // Klucz o numerze i (od 0) w kolejności rosnącej, i < distinct_keys().
+  K const &nth_key(size_t i) const {
+    index();
+    return *items_by_key.nth(i)->first;
+  }
+
+  // Liczba różnych kluczy mniejszych od k.
+  size_t key_rank(K const &k) const {
+    index();
+    return items_by_key.rank(items_by_key.lower_bound(k));
+  }
+
+  // Liczba różnych kluczy i liczba elementów z kluczami w [lo, hi).
+  size_t distinct_keys(K const &lo, K const &hi) const {
+    if (!(lo < hi)) return 0;
+    return key_rank(hi) - key_rank(lo);
+  }
+  size_t count_range(K const &lo, K const &hi) const {
+    if (!(lo < hi)) return 0;
+    index();
+    return items_by_key.weight_before(items_by_key.lower_bound(hi)) -
+           items_by_key.weight_before(items_by_key.lower_bound(lo));
+  }
+
+  // Kursory (zob. cursors). Złożoność O(log c) dla c kursorów.
+  cursor const *find_cursor(std::string_view name) const {
+    auto it = cursors.find(name);
+    return it == cursors.end() ? nullptr : &it->second;
+  }
+
+  void open_cursor(std::string_view name) {
+    cursors.emplace(cursor_name_t(name, get_allocator()), cursor());
+  }
+
+  static size_t cursor_lag(cursor const &c) noexcept { return c.unread; }
+
+  // Następny element dla kursora, który nie przeczytał wszystkiego.
+  static std::pair<K const &, V const &> cursor_front(
+      cursor const &c) noexcept {
+    entry const &e = *c.next;
+    return e.as_pair();
   }
-  std::pair<K const &, V const &> last(K const &k) const {
-    return items_by_key->at(k).back()->as_pair();
+
+  void cursor_pop(std::string_view name) {
+    auto &c = cursors.find(name)->second;
+
+    // Dalej bez wyjątków.
+
+    const auto node = c.next;
+    if (--c.unread > 0) {
+      c.next = link_of(*node).next_in_log;
+    } else {
+      c.next = item_iterator_t();
+    }
+    pass(node);
   }
 
-  size_t size() const noexcept { return items->size(); }
+  // Złożoność O(u + log c), gdzie u to liczba elementów, których kursor
+  // nie przeczytał.
+  void close_cursor(std::string_view name) {
+    auto c = cursors.find(name);
 
-  bool empty() const noexcept { return items->empty(); }
+    // Dalej bez wyjątków.
 
-  size_t count(K const &k) const noexcept {
-    // Bez wyjątków.
-    auto it = items_by_key->find(k);
-    if (it == items_by_key->end()) {
-      return 0;
+    // Następnik czytamy przed pass, które może usunąć element.
+    for (size_t left = c->second.unread; left > 0; --left) {
+      const auto node = c->second.next;
+      if (left > 1) c->second.next = link_of(*node).next_in_log;
+      pass(node);
     }
-    return it->second.size();
+    cursors.erase(c);
+    if (cursors.empty()) log_tail = nullptr;
   }
 
   void clear() noexcept {
     if (empty()) return;
 
     // Bez wyjątków.
-    items->clear();
-    items_by_key->clear();
+    if (cursors.empty()) {
+      items.clear();
+    } else {
+      while (!items.empty()) discard(items.begin());
+    }
+    items_by_key.clear();
+    if (timers) timers->clear();
+    fair_key = items_by_key.end();
+    fair_served = 0;
+    indexed = true;
+    forget_positions();
+
+    // Bo modyfikacja unieważnia.
+    forget_refs();
+  }
+
+  // Dolne ograniczenie na najwcześniejszy termin ważności elementu.
+  ticks_t next_expiry() const noexcept {
+    return timers ? timers->next_expiry() : std::numeric_limits<ticks_t>::max();
+  }
+
+  // Usuwa elementy z terminem ważności <= now. Złożoność O(e) plus koszt
+  // przerzucenia zegarów między poziomami koła, gdzie e to liczba usuniętych.
+  size_t expire(ticks_t now) noexcept {
+    if (!timers) return 0;
+
+    // Bez wyjątków.
+    size_t expired = 0;
+    timers->advance(now, [&](timer_target const &target) noexcept {
+      target.key->second.erase(target.item);
+      shrink_key(target.key);
+      if (positioned) positions.release(&*target.item);
+      discard(target.item);
+      ++expired;
+    });
+
+    // Bo modyfikacja unieważnia.
+    if (expired > 0) forget_refs();
+    return expired;
   }
 
   class k_iterator {
    private:
-    using keys_iterator_t = items_by_key_t::iterator;
+    using keys_iterator_t = items_by_key_t::const_iterator;
     keys_iterator_t keys_iterator;
 
    public:
@@ -215,7 +2743,7 @@ class kvfifo_simple {
     using value_type = K;
     using reference = K &;
 
-    const K &operator*() const { return keys_iterator->first; }
+    const K &operator*() const { return *keys_iterator->first; }
 
     k_iterator &operator=(k_iterator that) {
       keys_iterator = that.keys_iterator;
@@ -242,169 +2770,795 @@ class kvfifo_simple {
       return old;
     }
 
-    bool operator==(const kvfifo_simple<K, V>::k_iterator &that) const {
+    // Przesunięcie o n kluczy i odległość między kluczami w czasie
+    // O(log n), bez przechodzenia po kolejnych kluczach.
+    k_iterator &operator+=(difference_type n) {
+      keys_iterator += n;
+      return *this;
+    }
+    k_iterator &operator-=(difference_type n) {
+      keys_iterator -= n;
+      return *this;
+    }
+    friend k_iterator operator+(k_iterator it, difference_type n) {
+      return it += n;
+    }
+    friend k_iterator operator-(k_iterator it, difference_type n) {
+      return it -= n;
+    }
+    friend difference_type operator-(k_iterator const &a,
+                                     k_iterator const &b) {
+      return a.keys_iterator - b.keys_iterator;
+    }
+
+    bool operator==(const k_iterator &that) const {
       return keys_iterator == that.keys_iterator;
     }
-    bool operator!=(const kvfifo_simple<K, V>::k_iterator &that) const {
+    bool operator!=(const k_iterator &that) const {
       return keys_iterator != that.keys_iterator;
     }
   };
 
   static_assert(std::bidirectional_iterator<k_iterator>);
-  k_iterator k_begin() const noexcept {
-    return k_iterator(items_by_key->begin());
+  k_iterator k_begin() const {
+    index();
+    return k_iterator(items_by_key.begin());
+  }
+  k_iterator k_end() const {
+    index();
+    return k_iterator(items_by_key.end());
   }
-  k_iterator k_end() const noexcept { return k_iterator(items_by_key->end()); }
 };
 
-template <typename K, typename V>
+// Zakres kluczy dla operacji na wielu kluczach naraz. Wykluczamy typy
+// zamienialne na K (np. napis jako zakres znaków), żeby nie zasłaniały
+// wersji dla jednego klucza.
+template <typename Range, typename K>
+concept kvfifo_key_range =
+    std::ranges::forward_range<Range const> &&
+    std::convertible_to<std::ranges::range_reference_t<Range const>,
+                        K const &> &&
+    !std::convertible_to<Range const &, K const &>;
+
+template <typename K, typename V,
+          typename Alloc = std::allocator<std::pair<K const, V>>>
 class kvfifo {
  private:
-  using shared_simple = std::shared_ptr<kvfifo_simple<K, V>>;
-  using k_iterator = kvfifo_simple<K, V>::k_iterator;
+  using shared_simple = std::shared_ptr<kvfifo_simple<K, V, Alloc>>;
+  using k_iterator = kvfifo_simple<K, V, Alloc>::k_iterator;
+  using ticks_t = kvfifo_simple<K, V, Alloc>::ticks_t;
+  using overlay_t = kvfifo_simple<K, V, Alloc>::overlay_t;
   shared_simple simple;
+  // Dane mogą być współdzielone z kvfifo, które wydało non-const referencje
+  // (właścicielem). Zamiast kopiować wszystko, zapamiętujemy tylko wartości
+  // pod tymi referencjami z chwili zrobienia kopii.
+  std::shared_ptr<const overlay_t> overlay;
+  // Czas z ostatniego expire, od niego liczymy terminy w push_with_ttl.
+  // Trzymamy go poza współdzielonym stanem, żeby expire, które niczego nie
+  // usuwa, nie musiało robić kopii.
+  ticks_t now = 0;
+  // Alokator dla nowych danych. Kopie robione przy odłączaniu dziedziczą
+  // alokator danych, z których powstały.
+  [[no_unique_address]] Alloc allocator;
+
+  // Wartość v tak, jak ją widzi ta kopia.
+  V const &view(V const &v) const noexcept {
+    if (overlay) {
+      auto it = std::lower_bound(
+          overlay->begin(), overlay->end(), &v,
+          [](auto const &a, V const *b) { return std::less<>()(a.first, b); });
+      if (it != overlay->end() && it->first == &v) return it->second;
+    }
+    return v;
+  }
+
+  std::pair<K const &, V const &> viewed(
+      std::pair<K const &, V const &> ref) const noexcept {
+    return {ref.first, view(ref.second)};
+  }
+
+  // Czy ta kopia widzi dane dokładnie tak, jak leżą w pamięci.
+  bool live() const noexcept { return !overlay; }
+
+  shared_simple copy_simple() const {
+    KVFIFO_LATENCY(detach);
+    return simple->copy([this](V const &v) -> V const & { return view(v); });
+  }
+  shared_simple copy_simple(Alloc const &alloc) const {
+    KVFIFO_LATENCY(detach);
+    return simple->copy([this](V const &v) -> V const & { return view(v); },
+                        alloc);
+  }
 
   shared_simple get_safe_simple() {
-    return simple == nullptr ? std::make_shared<kvfifo_simple<K, V>>()
-           : simple.unique() ? simple
-                             : simple->copy();
+    return simple == nullptr ? std::allocate_shared<kvfifo_simple<K, V, Alloc>>(
+                                   allocator, allocator)
+           : simple.unique() && live() ? simple
+                                       : copy_simple();
+  }
+
+  void set_simple(shared_simple simple_) noexcept {
+    if (simple_ == simple) return;
+    if (simple != nullptr) simple->disown(this);
+    simple = std::move(simple_);
+    overlay.reset();
+  }
+
+  // Wartości, które ma widzieć nasza kopia.
+  std::shared_ptr<const overlay_t> overlay_for_copy() const {
+    KVFIFO_LATENCY(copy);
+    if (simple != nullptr && simple->owned_by(this) && simple->has_aliases()) {
+      return std::allocate_shared<const overlay_t>(simple->get_allocator(),
+                                                   simple->snapshot());
+    }
+    return overlay;
+  }
+
+  // Wydaje non-const referencję zwróconą przez get. Zapisy przez nią nie
+  // mogą być widoczne w innych kopiach, a te mogły już wziąć const
+  // referencje do tej wartości. Dlatego gdy dane są współdzielone, najpierw
+  // je odłączamy (jak każda modyfikacja, unieważnia to wcześniejsze
+  // referencje). Wyjątkiem jest wartość, do której właściciel już wydał
+  // referencję: pozostałe kopie widzą ją przez swoje overlay, więc dane
+  // zostają współdzielone i niczego w nich nie zmieniamy.
+  template <typename Get>
+  std::pair<K const &, V &> hand_out(Get get) {
+    if (simple->owned_by(this) && !simple.unique()) {
+      auto ref = get(*simple);
+      if (simple->aliases(ref.second)) return ref;
+    }
+    auto simple_2 = get_safe_simple();
+    auto ref = get(*simple_2);
+    simple_2->alias(ref.second, this);
+
+    // Dalej bez wyjątków.
+
+    set_simple(simple_2);
+    return ref;
+  }
+
+  kvfifo(shared_simple simple_, ticks_t now_) noexcept
+      : simple(std::move(simple_)),
+        now(now_),
+        allocator(simple->get_allocator()) {
+    KVFIFO_TRACE_OP(extracted);
+  }
+
+  // Kursor o danej nazwie. Wyrzuca std::invalid_argument jeśli go nie ma
+  // (albo jeśli przeczytał on już wszystkie elementy).
+  auto const &assert_cursor_exists(std::string_view name) const {
+    auto const *c = simple == nullptr ? nullptr : simple->find_cursor(name);
+    if (c == nullptr) throw std::invalid_argument("cursor missing");
+    return *c;
+  }
+  auto const &assert_cursor_unread(std::string_view name) const {
+    auto const &c = assert_cursor_exists(name);
+    if (simple->cursor_lag(c) == 0) {
+      throw std::invalid_argument("cursor at end");
+    }
+    return c;
   }
 
   // Wyrzuca std::invalid_argument jeśli nie ma żadnego elementu z danym
   // kluczem. W szczególności też jeśli nie ma żadnych elementów.
   void assert_key_exists(const K &k) const {
-    if (count(k) == 0) throw std::invalid_argument("key missing");
+    if (simple == nullptr || simple->count(k) == 0) {
+      throw std::invalid_argument("key missing");
+    }
+  }
+
+  // Szuka grup dla kluczy z keys i wykonuje na nich move (bez wyjątków).
+  // Jeśli dane nie są współdzielone, to szukamy tylko raz.
+  template <typename Range, typename Move>
+  void move_groups(Range const &keys, Move move) {
+    if (simple == nullptr) {
+      if (std::ranges::begin(keys) == std::ranges::end(keys)) return;
+      throw std::invalid_argument("key missing");
+    }
+    auto groups = simple->find_keys(keys);
+    for (auto group : groups) {
+      if (simple->is_end(group)) throw std::invalid_argument("key missing");
+    }
+    auto simple_2 = get_safe_simple();
+    if (simple_2 != simple) groups = simple_2->find_keys(keys);
+
+    // Dalej bez wyjątków.
+
+    move(simple_2, groups);
+    set_simple(simple_2);
   }
 
+  // Wybory predykatów erase_if i extract_if do zapisu operacji. Bez
+  // KVFIFO_TRACE predykat jest przekazywany bez opakowania.
+#ifdef KVFIFO_TRACE
+  using trace_selection = kvfifo_trace::selection;
+#else
+  struct trace_selection {
+    template <typename Pred>
+    Pred &by_position(Pred &pred) noexcept {
+      return pred;
+    }
+    template <typename Pred>
+    Pred &by_key(Pred &pred) noexcept {
+      return pred;
+    }
+  };
+#endif
+
   // Wyrzuca std::invalid_argument jeśli nie ma żadnych elementów.
   void assert_nonempty() const {
     if (empty()) throw std::invalid_argument("empty");
   }
 
+  // Woła f dla wartości widzianych przez tę kopię (wszystkich albo tylko
+  // klucza *k).
+  template <typename F>
+  void visit(K const *k, F &&f) const {
+    if (simple == nullptr) return;
+    if (live()) {
+      simple->visit(k, f);
+    } else {
+      simple->visit(k, [&](V const &v) { f(view(v)); });
+    }
+  }
+
+  template <typename Pred>
+  size_t count_values_if(K const *k, Pred &pred) const {
+    KVFIFO_LATENCY(count_if);
+    size_t counted = 0;
+    visit(k, [&](V const &v) { counted += pred(v) ? 1 : 0; });
+    return counted;
+  }
+
+  V sum_values(K const *k) const {
+    KVFIFO_LATENCY(sum);
+    V sum = 0;
+    visit(k, [&](V const &v) { sum += v; });
+    return sum;
+  }
+
+  std::pair<V, V> min_max_values(K const *k) const {
+    KVFIFO_LATENCY(min_max);
+    std::pair<V, V> result{std::numeric_limits<V>::max(),
+                           std::numeric_limits<V>::lowest()};
+    visit(k, [&](V const &v) {
+      result.first = std::min(result.first, v);
+      result.second = std::max(result.second, v);
+    });
+    return result;
+  }
+
  public:
-  kvfifo() : simple(std::make_shared<kvfifo_simple<K, V>>()) {}
+  kvfifo() : kvfifo(Alloc()) {}
+  // Kolejka, której dane (elementy, indeks, zegary, klucze) są alokowane
+  // przez allocator_.
+  explicit kvfifo(Alloc const &allocator_)
+      : simple(std::allocate_shared<kvfifo_simple<K, V, Alloc>>(allocator_,
+                                                                allocator_)),
+        allocator(allocator_) {
+    KVFIFO_TRACE_OP(create);
+  }
   kvfifo(kvfifo const &that)
-      : simple(that.simple == nullptr             ? nullptr
-               : that.simple->has_external_refs() ? that.simple->copy()
-                                                  : that.simple) {}
-  kvfifo(kvfifo &&that) noexcept : simple(that.simple) {
+      : simple(that.simple),
+        overlay(that.overlay_for_copy()),
+        now(that.now),
+        allocator(std::allocator_traits<Alloc>::
+                      select_on_container_copy_construction(that.allocator)) {
+    KVFIFO_TRACE_OP(copy, &that);
+  }
+  kvfifo(kvfifo &&that) noexcept
+      : simple(that.simple),
+        overlay(std::move(that.overlay)),
+        now(that.now),
+        allocator(that.allocator) {
+    KVFIFO_TRACE_OP(move, &that);
+    if (simple != nullptr) simple->pass_ownership(&that, this);
     that.simple = nullptr;
   }
+  // Kolejka z par (klucz, wartość) z [first, last), w tej kolejności.
+  // Złożoność O(n log n), ale bez szukania w mapie dla każdego elementu.
+  template <std::forward_iterator It>
+  kvfifo(It first, It last, Alloc const &allocator_ = Alloc())
+      : simple(std::allocate_shared<kvfifo_simple<K, V, Alloc>>(allocator_,
+                                                                allocator_)),
+        allocator(allocator_) {
+    KVFIFO_LATENCY(assign_range);
+    simple->assign(first, last);
+    KVFIFO_TRACE_OP(create_range, std::ranges::subrange(first, last));
+  }
+  ~kvfifo() {
+    KVFIFO_TRACE_OP(destroy);
+    if (simple != nullptr) simple->disown(this);
+  }
 
   kvfifo &operator=(kvfifo that) noexcept {
-    simple = that.simple == nullptr             ? nullptr
-             : that.simple->has_external_refs() ? that.simple->copy()
-                                                : that.simple;
+    KVFIFO_LATENCY(assign);
+    KVFIFO_TRACE_OP(assign, &that);
+    if (simple != nullptr) simple->disown(this);
+    simple = that.simple;
+    overlay = that.overlay;
+    now = that.now;
+    if (simple != nullptr) simple->pass_ownership(&that, this);
 
     return (*this);
   }
 
   void push(K const &k, V const &v) {
+    KVFIFO_LATENCY(push);
+    KVFIFO_TRACE_OP(push, k, v);
     auto simple_2 = get_safe_simple();
 
     // Dalej bez wyjątków.
 
     simple_2->push(k, v);
-    simple = simple_2;
+    set_simple(simple_2);
+  }
+
+  // Zastępuje zawartość kolejki (także wagi kluczy i kursory) parami (klucz,
+  // wartość) z range, w tej kolejności. Silna gwarancja. Złożoność
+  // O(n log n).
+  template <std::ranges::forward_range R>
+  void assign(R &&range) {
+    KVFIFO_LATENCY(assign_range);
+    auto simple_2 = std::allocate_shared<kvfifo_simple<K, V, Alloc>>(
+        get_allocator(), get_allocator());
+    simple_2->assign(std::ranges::begin(range), std::ranges::end(range));
+
+    // Dalej bez wyjątków.
+
+    set_simple(simple_2);
+    KVFIFO_TRACE_OP(assign_range, range);
+  }
+
+  // Wstawia element, który wygaśnie ttl tyknięć po czasie z ostatniego
+  // expire. Złożoność O(log n).
+  void push_with_ttl(K const &k, V const &v, ticks_t ttl) {
+    KVFIFO_LATENCY(push_with_ttl);
+    KVFIFO_TRACE_OP(push_with_ttl, k, v, ttl);
+    const ticks_t deadline =
+        ttl > std::numeric_limits<ticks_t>::max() - now
+            ? std::numeric_limits<ticks_t>::max()
+            : now + ttl;
+    auto simple_2 = get_safe_simple();
+
+    // Dalej bez wyjątków.
+
+    simple_2->push(k, v, deadline);
+    set_simple(simple_2);
+  }
+
+  // Usuwa elementy, których termin ważności minął (jest <= now), i zwraca ich
+  // liczbę. Złożoność proporcjonalna do liczby usuniętych elementów (plus
+  // przerzucenia zegarów w kole). Kopii nie robi, jeśli nic nie wygasa.
+  size_t expire(ticks_t now_) {
+    KVFIFO_LATENCY(expire);
+    KVFIFO_TRACE_OP(expire, now_);
+    if (simple == nullptr || simple->next_expiry() > now_) {
+      now = std::max(now, now_);
+      return 0;
+    }
+    auto simple_2 = get_safe_simple();
+
+    // Dalej bez wyjątków.
+
+    set_simple(simple_2);
+    now = std::max(now, now_);
+    return simple_2->expire(now_);
   }
 
   void pop() {
+    KVFIFO_LATENCY(pop);
+    KVFIFO_TRACE_OP(pop);
     assert_nonempty();
     auto simple_2 = get_safe_simple();
 
     // Dalej bez wyjątków.
 
     simple_2->pop();
-    simple = simple_2;
+    set_simple(simple_2);
   }
 
   void pop(K const &k) {
+    KVFIFO_LATENCY(pop_key);
+    KVFIFO_TRACE_OP(pop_key, k);
     assert_key_exists(k);
     auto simple_2 = get_safe_simple();
 
     // Dalej bez wyjątków.
 
     simple_2->pop(k);
-    simple = simple_2;
+    set_simple(simple_2);
   }
 
-  void move_to_back(K const &k) {
+  // Usuwa wszystkie elementy o kluczu k. Zgłasza wyjątek
+  // std::invalid_argument, gdy elementu o podanym kluczu nie ma w kolejce.
+  // Złożoność O(m + log n).
+  void pop_all(K const &k) {
+    KVFIFO_LATENCY(pop_all);
+    KVFIFO_TRACE_OP(pop_all, k);
     assert_key_exists(k);
     auto simple_2 = get_safe_simple();
 
     // Dalej bez wyjątków.
 
-    simple_2->move_to_back(k);
-    simple = simple_2;
+    simple_2->pop_all(k);
+    set_simple(simple_2);
   }
 
-  std::pair<K const &, V &> front() {
-    assert_nonempty();
+  // Usuwa wszystkie elementy, dla których pred(k, v), i zwraca ich liczbę.
+  // pred jest wołane raz dla każdego elementu, w kolejności kolejki. Jeśli
+  // zgłosi wyjątek, kolejka się nie zmienia. Złożoność O(n log d), gdzie d
+  // to liczba usuniętych elementów.
+  template <typename Pred>
+  size_t erase_if(Pred pred) {
+    KVFIFO_LATENCY(erase_if);
+    trace_selection chosen;
+    if (empty()) {
+      KVFIFO_TRACE_OP(erase_if, chosen);
+      return 0;
+    }
     auto simple_2 = get_safe_simple();
+    auto &&watched = chosen.by_position(pred);
+    const auto doomed = simple_2->plan_erase_if(watched);
 
     // Dalej bez wyjątków.
 
-    simple = simple_2;
+    simple_2->erase(doomed);
+    set_simple(simple_2);
+    KVFIFO_TRACE_OP(erase_if, chosen);
+    return doomed.size();
+  }
+
+  // Usuwa wszystkie elementy z kluczami z przedziału [lo, hi) (pustego, jeśli
+  // hi <= lo) i zwraca ich liczbę. Jeśli takich nie ma, to dane nie są
+  // kopiowane. Elementy mapy kluczy są wycinane naraz, więc złożoność to
+  // O(m + log n), gdzie m to liczba usuniętych elementów.
+  size_t pop_range(K const &lo, K const &hi) {
+    KVFIFO_LATENCY(pop_range);
+    KVFIFO_TRACE_OP(pop_range, lo, hi);
+    const size_t doomed = count_range(lo, hi);
+    if (doomed == 0) return 0;
+    auto simple_2 = get_safe_simple();
+    const auto range = simple_2->find_range(lo, hi);
+
+    // Dalej bez wyjątków.
 
-    return simple_2->front();
+    simple_2->pop_range(range);
+    set_simple(simple_2);
+    return doomed;
   }
-  std::pair<K const &, V const &> front() const {
-    assert_nonempty();
+
+  void move_to_back(K const &k) {
+    KVFIFO_LATENCY(move_to_back);
+    KVFIFO_TRACE_OP(move_to_back, k);
+    assert_key_exists(k);
+    auto simple_2 = get_safe_simple();
 
     // Dalej bez wyjątków.
 
-    return simple->front();
+    simple_2->move_to_back(k);
+    set_simple(simple_2);
   }
-  std::pair<K const &, V &> back() {
-    assert_nonempty();
+
+  // Przesuwa na koniec elementy wszystkich kluczy z przedziału [lo, hi),
+  // grupami w kolejności rosnących kluczy (jak move_to_back(k) dla kolejnych
+  // kluczy), i zwraca ich liczbę. Złożoność O(m + log n).
+  size_t move_range_to_back(K const &lo, K const &hi) {
+    KVFIFO_LATENCY(move_range_to_back);
+    KVFIFO_TRACE_OP(move_range_to_back, lo, hi);
+    const size_t moved = count_range(lo, hi);
+    if (moved == 0) return 0;
+    auto simple_2 = get_safe_simple();
+    const auto range = simple_2->find_range(lo, hi);
+
+    // Dalej bez wyjątków.
+
+    simple_2->move_to_back(range);
+    set_simple(simple_2);
+    return moved;
+  }
+
+  // Przenosi wszystkie elementy other na koniec kolejki (w ich kolejności),
+  // other zostaje pusta, bez kursorów i wag kluczy (także gdy już była
+  // pusta). Jeśli obie kolejki mają dane na wyłączność, to
+  // węzły są przepinane bez kopiowania wartości w czasie
+  // O(k log n + t), gdzie k to liczba różnych kluczy w other, a t to liczba
+  // jej elementów z terminem ważności. Jeśli dane other są współdzielone,
+  // to najpierw są kopiowane (liniowo).
+  void append(kvfifo &&other) {
+    KVFIFO_LATENCY(append);
+    KVFIFO_TRACE_OP(append, &other);
+    if (other.empty()) {
+      // Bez wyjątków.
+      if (&other != this) other.set_simple(nullptr);
+      return;
+    }
     auto simple_2 = get_safe_simple();
+    // Węzły można przepiąć tylko między kolejkami z równymi alokatorami.
+    auto other_simple =
+        !(other.simple->get_allocator() == simple_2->get_allocator())
+            ? other.copy_simple(simple_2->get_allocator())
+        : other.simple != simple ? other.get_safe_simple()
+                                 : other.copy_simple();
+    auto plan = simple_2->plan_append(*other_simple);
 
     // Dalej bez wyjątków.
 
-    simple = simple_2;
+    simple_2->append(*other_simple, plan);
+    set_simple(simple_2);
+    if (&other != this) other.set_simple(nullptr);
+  }
+
+  // Przenosi wszystkie elementy o kluczu k (w ich kolejności) do nowej
+  // kolejki i ją zwraca. Wartości nie są kopiowane, a jedyną alokacją jest
+  // nowy współdzielony obiekt. Zgłasza wyjątek std::invalid_argument, gdy
+  // elementu o podanym kluczu nie ma w kolejce. Złożoność O(m + log n).
+  kvfifo extract(K const &k) {
+    KVFIFO_LATENCY(extract);
+    KVFIFO_TRACE_OP(extract, k);
+    assert_key_exists(k);
+    auto simple_2 = get_safe_simple();
+    auto extracted = simple_2->extract(k);
+
+    // Dalej bez wyjątków.
 
-    return simple_2->back();
+    set_simple(simple_2);
+    return kvfifo(std::move(extracted), now);
   }
-  std::pair<K const &, V const &> back() const {
-    assert_nonempty();
+
+  // Jak extract, ale dla wszystkich kluczy k, dla których pred(k). Kolejność
+  // elementów (także o różnych kluczach) jest zachowana. Złożoność
+  // O(n + k log n), gdzie k to liczba wybranych kluczy.
+  template <typename Pred>
+  kvfifo extract_if(Pred pred) {
+    KVFIFO_LATENCY(extract_if);
+    trace_selection chosen;
+    auto simple_2 = get_safe_simple();
+    auto &&watched = chosen.by_key(pred);
+    auto extracted = simple_2->extract_if(watched);
 
     // Dalej bez wyjątków.
 
-    return simple->back();
+    set_simple(simple_2);
+    KVFIFO_TRACE_OP(extract_if, chosen);
+    return kvfifo(std::move(extracted), now);
   }
-  std::pair<K const &, V &> first(K const &k) {
+
+  // Przesuwa elementy o kluczu k na początek kolejki, zachowując ich
+  // kolejność względem siebie. Zgłasza wyjątek std::invalid_argument, gdy
+  // elementu o podanym kluczu nie ma w kolejce. Złożoność O(m + log n).
+  void move_to_front(K const &k) {
+    KVFIFO_LATENCY(move_to_front);
+    KVFIFO_TRACE_OP(move_to_front, k);
     assert_key_exists(k);
     auto simple_2 = get_safe_simple();
 
     // Dalej bez wyjątków.
 
-    simple = simple_2;
+    simple_2->move_to_front(k);
+    set_simple(simple_2);
+  }
+
+  // Wersje dla wielu kluczy naraz: grupy elementów trafiają na koniec (na
+  // początek) w kolejności kluczy w keys. Jedno sprawdzenie kopii i jedno
+  // wyszukanie każdego klucza. Zgłaszają std::invalid_argument (bez zmian
+  // w kolejce), jeśli któregoś klucza nie ma. Złożoność O(m + r log n),
+  // gdzie m to liczba przesuwanych elementów, a r to długość keys.
+  template <typename Range>
+    requires kvfifo_key_range<Range, K>
+  void move_to_back(Range const &keys) {
+    KVFIFO_LATENCY(move_to_back);
+    move_groups(keys, [](auto &simple_2, auto const &groups) noexcept {
+      simple_2->move_to_back(groups);
+    });
+    KVFIFO_TRACE_OP(move_keys_to_back, keys);
+  }
+
+  template <typename Range>
+    requires kvfifo_key_range<Range, K>
+  void move_to_front(Range const &keys) {
+    KVFIFO_LATENCY(move_to_front);
+    move_groups(keys, [](auto &simple_2, auto const &groups) noexcept {
+      simple_2->move_to_front(groups);
+    });
+    KVFIFO_TRACE_OP(move_keys_to_front, keys);
+  }
+
+  std::pair<K const &, V &> front() {
+    KVFIFO_LATENCY(front);
+    KVFIFO_TRACE_OP(front);
+    assert_nonempty();
+    return hand_out([](auto &simple_2) { return simple_2.front(); });
+  }
+  std::pair<K const &, V const &> front() const {
+    assert_nonempty();
+
+    // Dalej bez wyjątków.
+
+    return viewed(simple->front());
+  }
+  std::pair<K const &, V &> back() {
+    KVFIFO_LATENCY(back);
+    KVFIFO_TRACE_OP(back);
+    assert_nonempty();
+    return hand_out([](auto &simple_2) { return simple_2.back(); });
+  }
+  std::pair<K const &, V const &> back() const {
+    assert_nonempty();
+
+    // Dalej bez wyjątków.
 
-    return simple_2->first(k);
+    return viewed(simple->back());
+  }
+  std::pair<K const &, V &> first(K const &k) {
+    KVFIFO_LATENCY(first);
+    KVFIFO_TRACE_OP(first, k);
+    assert_key_exists(k);
+    return hand_out([&k](auto &simple_2) { return simple_2.first(k); });
   }
   std::pair<K const &, V const &> first(K const &k) const {
     assert_key_exists(k);
 
     // Dalej bez wyjątków.
 
-    return simple->first(k);
+    return viewed(simple->first(k));
   }
   std::pair<K const &, V &> last(K const &k) {
+    KVFIFO_LATENCY(last);
+    KVFIFO_TRACE_OP(last, k);
+    assert_key_exists(k);
+    return hand_out([&k](auto &simple_2) { return simple_2.last(k); });
+  }
+  std::pair<K const &, V const &> last(K const &k) const {
     assert_key_exists(k);
-    auto simple_2 = get_safe_simple();
 
     // Dalej bez wyjątków.
 
-    simple = simple_2;
+    return viewed(simple->last(k));
+  }
+
+  // Element o numerze i (od 0, czyli front()) w kolejności kolejki. Jeśli
+  // i >= size(), to podnosi wyjątek std::invalid_argument. Złożoność
+  // O(log n); pierwsze zapytanie o numery buduje je w czasie O(n), podobnie
+  // jak pierwsze zapytanie po append, extract i extract_if.
+  std::pair<K const &, V &> at(size_t i) {
+    KVFIFO_LATENCY(at);
+    KVFIFO_TRACE_OP(at, i);
+    if (i >= size()) throw std::invalid_argument("no such element");
+    return hand_out([i](auto &simple_2) { return simple_2.at(i); });
+  }
+  std::pair<K const &, V const &> at(size_t i) const {
+    if (i >= size()) throw std::invalid_argument("no such element");
+    return viewed(simple->at(i));
+  }
 
-    return simple_2->last(k);
+  // Liczba elementów przed najstarszym (najnowszym) elementem o kluczu k.
+  // Jeśli klucza k nie ma w kolejce, to podnoszą wyjątek
+  // std::invalid_argument. Złożoność jak at.
+  size_t position_of_first(K const &k) const {
+    assert_key_exists(k);
+    return simple->position_of_first(k);
   }
-  std::pair<K const &, V const &> last(K const &k) const {
+  size_t position_of_last(K const &k) const {
     assert_key_exists(k);
+    return simple->position_of_last(k);
+  }
+
+  // Sprawiedliwa obsługa kluczy: front_fair zwraca najstarszy element
+  // klucza, na który przypada kolej, a pop_fair go usuwa. Klucze dostają
+  // kolej w rosnącej kolejności, cyklicznie, każdy na tyle elementów, ile
+  // wynosi jego waga. Jeśli kolejka jest pusta, to podnoszą wyjątek
+  // std::invalid_argument. Złożoność O(1) zamortyzowane (plus O(log w), jeśli
+  // ustawiono w wag).
+  std::pair<K const &, V &> front_fair() {
+    KVFIFO_LATENCY(front_fair);
+    KVFIFO_TRACE_OP(front_fair);
+    assert_nonempty();
+    return hand_out([](auto &simple_2) { return simple_2.front_fair(); });
+  }
+  std::pair<K const &, V const &> front_fair() const {
+    assert_nonempty();
+
+    // Dalej bez wyjątków.
+
+    return viewed(simple->front_fair());
+  }
+
+  void pop_fair() {
+    KVFIFO_LATENCY(pop_fair);
+    KVFIFO_TRACE_OP(pop_fair);
+    assert_nonempty();
+    auto simple_2 = get_safe_simple();
+    simple_2->pop_fair();
+
+    // Dalej bez wyjątków.
+
+    set_simple(simple_2);
+  }
+
+  // Ustawia wagę klucza dla pop_fair (także klucza, którego jeszcze nie ma
+  // w kolejce). Waga 0 jest niedozwolona (std::invalid_argument).
+  // Złożoność O(log w).
+  void set_weight(K const &k, size_t w) {
+    KVFIFO_LATENCY(set_weight);
+    KVFIFO_TRACE_OP(set_weight, k, w);
+    if (w == 0) throw std::invalid_argument("zero weight");
+    auto simple_2 = get_safe_simple();
+    simple_2->set_weight(k, w);
 
     // Dalej bez wyjątków.
 
-    return simple->last(k);
+    set_simple(simple_2);
+  }
+
+  // Ile pamięci zajmuje kolejka i ile z tego dzieli z innymi kopiami.
+  // Złożoność O(1) (O(n log n) dla kopii, która jeszcze nie zbudowała
+  // indeksu kluczy).
+  kvfifo_memory_usage memory_usage() const {
+    kvfifo_memory_usage usage;
+    if (simple != nullptr) {
+      usage = simple->memory_usage();
+      (simple.unique() ? usage.exclusive : usage.shared) = usage.total();
+    }
+    if (overlay) {
+      const size_t bytes =
+          sizeof(overlay_t) +
+          overlay->capacity() * sizeof(typename overlay_t::value_type);
+      usage.bookkeeping += bytes;
+      (overlay.unique() ? usage.exclusive : usage.shared) += bytes;
+    }
+    return usage;
+  }
+
+  // Oddaje nadmiarową pamięć. Nie odłącza współdzielonych danych (wtedy nic
+  // nie robi).
+  void shrink_to_fit() {
+    KVFIFO_LATENCY(shrink_to_fit);
+    if (simple != nullptr && simple.unique()) simple->shrink_to_fit();
+  }
+
+  // Operacje zbiorcze po wartościach, wszystkich albo tylko klucza k, w
+  // jednym przejściu bez kopiowania danych. Złożoność O(n), dla klucza
+  // O(m + log n).
+  template <typename Pred>
+  size_t count_if(Pred pred) const {
+    return count_values_if(nullptr, pred);
+  }
+  template <typename Pred>
+  size_t count_if(K const &k, Pred pred) const {
+    return count_values_if(&k, pred);
+  }
+
+  // Suma wartości (0 dla pustej kolejki albo brakującego klucza).
+  V sum() const
+    requires std::is_arithmetic_v<V>
+  {
+    return sum_values(nullptr);
+  }
+  V sum(K const &k) const
+    requires std::is_arithmetic_v<V>
+  {
+    return sum_values(&k);
+  }
+
+  // Najmniejsza i największa wartość. Jeśli nie ma żadnej, to podnosi
+  // wyjątek std::invalid_argument.
+  std::pair<V, V> min_max() const
+    requires std::is_arithmetic_v<V>
+  {
+    assert_nonempty();
+    return min_max_values(nullptr);
+  }
+  std::pair<V, V> min_max(K const &k) const
+    requires std::is_arithmetic_v<V>
+  {
+    assert_key_exists(k);
+    return min_max_values(&k);
+  }
+
+  // Alokator danych kolejki.
+  Alloc get_allocator() const noexcept {
+    return simple == nullptr ? allocator : simple->get_allocator();
   }
 
   size_t size() const noexcept {
@@ -415,25 +3569,133 @@ class kvfifo {
     return simple == nullptr ? true : simple->empty();
   }
 
-  size_t count(K const &k) const noexcept {
+  size_t count(K const &k) const {
+    KVFIFO_LATENCY(count);
+    KVFIFO_TRACE_OP(count, k);
     return simple == nullptr ? 0 : simple->count(k);
   }
 
   void clear() {
+    KVFIFO_LATENCY(clear);
+    KVFIFO_TRACE_OP(clear);
     auto simple_2 = get_safe_simple();
 
     // Dalej bez wyjątków.
 
     simple_2->clear();
-    simple = simple_2;
+    set_simple(simple_2);
+  }
+
+  // Kursory dla wielu niezależnych czytelników jednej kolejki (np. audytora
+  // i replikatora obok właściciela, który robi pop). Kursor widzi każdy
+  // element wstawiony po jego otwarciu (przez push, push_with_ttl albo
+  // append) dokładnie raz, w kolejności wstawiania, niezależnie od tego, co
+  // z kolejką robi jej właściciel: przesunięcia (move_to_back...) go nie
+  // dotyczą, a element usunięty z kolejki (pop, expire, clear...) zostaje
+  // w pamięci, dopóki nie przeczytają go wszystkie kursory. Elementy nie są
+  // przy tym kopiowane, z wyjątkiem extract i extract_if, które dają nowej
+  // kolejce kopie elementów, na które kursory jeszcze czekają. Kursory są
+  // częścią zawartości kolejki: kopiują się razem z nią, a assign(range)
+  // i append (w dołączanej kolejce) je usuwają.
+  //
+  // open_cursor otwiera kursor (wyjątek std::invalid_argument, jeśli już
+  // jest), close_cursor go zamyka, cursor_lag zwraca liczbę nieprzeczytanych
+  // elementów, cursor_front najstarszy z nich, a cursor_pop zalicza go jako
+  // przeczytany. Pozostałe podnoszą std::invalid_argument, gdy kursora nie
+  // ma, a cursor_front i cursor_pop także, gdy przeczytał wszystko.
+  // Złożoność O(log c) dla c kursorów (close_cursor O(u + log c) dla
+  // u nieprzeczytanych), a push przy otwartych kursorach kosztuje
+  // dodatkowo O(c).
+  void open_cursor(std::string_view name) {
+    KVFIFO_TRACE_OP(open_cursor, name);
+    if (simple != nullptr && simple->find_cursor(name) != nullptr) {
+      throw std::invalid_argument("cursor exists");
+    }
+    auto simple_2 = get_safe_simple();
+    simple_2->open_cursor(name);
+
+    // Dalej bez wyjątków.
+
+    set_simple(simple_2);
+  }
+
+  void close_cursor(std::string_view name) {
+    KVFIFO_LATENCY(close_cursor);
+    KVFIFO_TRACE_OP(close_cursor, name);
+    assert_cursor_exists(name);
+    auto simple_2 = get_safe_simple();
+
+    // Dalej bez wyjątków.
+
+    simple_2->close_cursor(name);
+    set_simple(simple_2);
+  }
+
+  size_t cursor_lag(std::string_view name) const {
+    return simple->cursor_lag(assert_cursor_exists(name));
+  }
+
+  std::pair<K const &, V const &> cursor_front(std::string_view name) const {
+    auto const &c = assert_cursor_unread(name);
+
+    // Dalej bez wyjątków.
+
+    return viewed(simple->cursor_front(c));
+  }
+
+  void cursor_pop(std::string_view name) {
+    KVFIFO_LATENCY(cursor_pop);
+    KVFIFO_TRACE_OP(cursor_pop, name);
+    assert_cursor_unread(name);
+    auto simple_2 = get_safe_simple();
+
+    // Dalej bez wyjątków.
+
+    simple_2->cursor_pop(name);
+    set_simple(simple_2);
   }
 
-  k_iterator k_begin() const noexcept {
+  k_iterator k_begin() const {
     return simple == nullptr ? k_iterator() : simple->k_begin();
   }
-  k_iterator k_end() const noexcept {
+  k_iterator k_end() const {
     return simple == nullptr ? k_iterator() : simple->k_end();
   }
+
+  // Liczba różnych kluczy w kolejce.
+  size_t distinct_keys() const {
+    return simple == nullptr ? 0 : simple->distinct_keys();
+  }
+
+  // Klucz o numerze i (od 0) w kolejności rosnącej. Jeśli i >=
+  // distinct_keys(), to podnosi wyjątek std::invalid_argument. Złożoność
+  // O(log n).
+  K const &nth_key(size_t i) const {
+    if (i >= distinct_keys()) throw std::invalid_argument("no such key");
+    return simple->nth_key(i);
+  }
+
+  // Liczba różnych kluczy mniejszych od k (k nie musi być w kolejce).
+  // Złożoność O(log n).
+  size_t key_rank(K const &k) const {
+    return simple == nullptr ? 0 : simple->key_rank(k);
+  }
+
+  // Liczba różnych kluczy i liczba elementów z kluczami z przedziału
+  // [lo, hi) (pustego, jeśli hi <= lo). Złożoność O(log n).
+  size_t distinct_keys(K const &lo, K const &hi) const {
+    return simple == nullptr ? 0 : simple->distinct_keys(lo, hi);
+  }
+  size_t count_range(K const &lo, K const &hi) const {
+    return simple == nullptr ? 0 : simple->count_range(lo, hi);
+  }
 };
 
+namespace pmr {
+// kvfifo, którego dane są alokowane z std::pmr::memory_resource.
+template <typename K, typename V>
+using kvfifo =
+    ::kvfifo<K, V, std::pmr::polymorphic_allocator<std::pair<K const, V>>>;
+}  // namespace pmr
+
 #endif
\ No newline at end of file
@@ -0,0 +1,300 @@
+#ifndef KVFIFO_CORO_H
+#define KVFIFO_CORO_H
+
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <list>
+#include <map>
+#include <optional>
+#include <utility>
+
+#include "kvfifo.h"
+
+// Prosty jednowątkowy wykonawca korutyn: kolejka gotowych do wznowienia
+// korutyn, obsługiwana przez run().
+class kvfifo_executor {
+ public:
+  // Korutyna uruchamiana przez wykonawcę (spawn). Nie zwraca wyniku. Wyjątek,
+  // który z niej wyleci, zgłasza run().
+  class task {
+   public:
+    struct promise_type {
+      kvfifo_executor *executor = nullptr;
+      std::list<std::coroutine_handle<>>::iterator link;
+
+      task get_return_object() noexcept {
+        return task(std::coroutine_handle<promise_type>::from_promise(*this));
+      }
+      std::suspend_always initial_suspend() noexcept { return {}; }
+      std::suspend_never final_suspend() noexcept { return {}; }
+      void return_void() noexcept {}
+      void unhandled_exception() noexcept {
+        if (!executor->failure) executor->failure = std::current_exception();
+      }
+
+      ~promise_type() {
+        if (executor != nullptr) executor->live.erase(link);
+      }
+    };
+
+    task(task &&that) noexcept : handle(std::exchange(that.handle, {})) {}
+    task &operator=(task that) noexcept {
+      std::swap(handle, that.handle);
+      return *this;
+    }
+    ~task() {
+      if (handle) handle.destroy();
+    }
+
+   private:
+    friend class kvfifo_executor;
+
+    explicit task(std::coroutine_handle<promise_type> handle_) noexcept
+        : handle(handle_) {}
+
+    std::coroutine_handle<promise_type> handle;
+  };
+
+  kvfifo_executor() = default;
+  kvfifo_executor(kvfifo_executor const &) = delete;
+  kvfifo_executor &operator=(kvfifo_executor const &) = delete;
+
+  // Niedokończone korutyny (np. czekające na element, który nigdy nie
+  // przyszedł) są niszczone razem z wykonawcą.
+  ~kvfifo_executor() {
+    while (!live.empty()) live.front().destroy();
+  }
+
+  // Przejmuje korutynę i ustawia ją w kolejce gotowych.
+  void spawn(task t) {
+    ready.push_back(t.handle);
+    try {
+      live.push_front(t.handle);
+    } catch (...) {
+      ready.pop_back();
+      throw;
+    }
+
+    // Dalej bez wyjątków.
+
+    t.handle.promise().executor = this;
+    t.handle.promise().link = live.begin();
+    t.handle = {};
+  }
+
+  // co_await executor.yield() odkłada bieżącą korutynę na koniec kolejki
+  // gotowych.
+  auto yield() noexcept {
+    struct awaiter {
+      kvfifo_executor *executor;
+
+      bool await_ready() const noexcept { return false; }
+      void await_suspend(std::coroutine_handle<> h) {
+        executor->ready.push_back(h);
+      }
+      void await_resume() const noexcept {}
+    };
+    return awaiter{this};
+  }
+
+  // Wznawia gotowe korutyny, dopóki jakieś są, i zwraca liczbę wznowień.
+  // Zgłasza pierwszy wyjątek, który wyleciał z korutyny.
+  size_t run() {
+    size_t resumed = 0;
+    rethrow_failure();
+    while (!ready.empty()) {
+      auto h = ready.front();
+      ready.pop_front();
+      h.resume();
+      ++resumed;
+      rethrow_failure();
+    }
+    return resumed;
+  }
+
+  // Liczba korutyn, które jeszcze się nie zakończyły.
+  size_t active() const noexcept { return live.size(); }
+
+ private:
+  void rethrow_failure() {
+    if (failure) std::rethrow_exception(std::exchange(failure, nullptr));
+  }
+
+  std::deque<std::coroutine_handle<>> ready;
+  std::list<std::coroutine_handle<>> live;
+  std::exception_ptr failure;
+};
+
+// Kolejka kvfifo z konsumentami w postaci korutyn. co_await channel.next()
+// czeka na najstarszy element, a co_await channel.next(k) na najstarszy
+// element o kluczu k, i wyjmuje go z kolejki (wartość jest przenoszona).
+//
+// Jeśli ktoś czeka na wstawiany element, push oddaje mu go bezpośrednio, bez
+// wstawiania do kolejki, i od razu wznawia jego korutynę (push wraca, gdy
+// korutyna znów się zawiesi). Z czekających, którym pasuje element, wybieramy
+// tego, który czeka najdłużej.
+template <typename K, typename V,
+          typename Alloc = std::allocator<std::pair<K const, V>>>
+class kvfifo_channel {
+ private:
+  struct waiter;
+  using waiters_t = std::list<waiter *>;
+  using key_waiters_t = std::map<K, waiters_t>;
+
+  struct waiter {
+    kvfifo_channel *channel;
+    std::optional<K> key;
+    std::coroutine_handle<> handle;
+    std::optional<std::pair<K, V>> delivered;
+    std::uint64_t ticket = 0;
+    bool linked = false;
+    typename key_waiters_t::iterator slot;
+    typename waiters_t::iterator link;
+
+    waiter(kvfifo_channel *channel_, std::optional<K> key_)
+        : channel(channel_), key(std::move(key_)) {}
+    waiter(waiter const &) = delete;
+    waiter &operator=(waiter const &) = delete;
+
+    void unlink() noexcept {
+      if (!linked) return;
+      linked = false;
+      if (!key) {
+        channel->any_waiters.erase(link);
+        return;
+      }
+      slot->second.erase(link);
+      if (slot->second.empty()) channel->key_waiters.erase(slot);
+    }
+
+    bool await_ready() const {
+      return key ? channel->items.count(*key) > 0 : !channel->items.empty();
+    }
+
+    void await_suspend(std::coroutine_handle<> handle_) {
+      if (key) {
+        auto slot_2 = channel->key_waiters.try_emplace(*key).first;
+        try {
+          link = slot_2->second.insert(slot_2->second.end(), this);
+        } catch (...) {
+          if (slot_2->second.empty()) channel->key_waiters.erase(slot_2);
+          throw;
+        }
+        slot = slot_2;
+      } else {
+        link = channel->any_waiters.insert(channel->any_waiters.end(), this);
+      }
+
+      // Dalej bez wyjątków.
+
+      handle = handle_;
+      ticket = channel->next_ticket++;
+      linked = true;
+    }
+
+    // Element oddany przez push albo najstarszy pasujący z kolejki.
+    std::pair<K, V> take() {
+      if (delivered) return std::move(*delivered);
+      auto &items = channel->items;
+      auto ref = key ? items.first(*key) : items.front();
+      std::pair<K, V> result(ref.first, std::move_if_noexcept(ref.second));
+
+      // Dalej bez wyjątków (ref jest niestałą referencją, więc dane nie są
+      // już współdzielone i pop nie robi kopii).
+
+      if (key) {
+        items.pop(*key);
+      } else {
+        items.pop();
+      }
+      return result;
+    }
+
+    ~waiter() { unlink(); }
+  };
+
+ public:
+  class awaiter_any : private waiter {
+   public:
+    explicit awaiter_any(kvfifo_channel *channel_) noexcept
+        : waiter(channel_, std::nullopt) {}
+    using waiter::await_ready;
+    using waiter::await_suspend;
+    std::pair<K, V> await_resume() { return waiter::take(); }
+  };
+
+  class awaiter_key : private waiter {
+   public:
+    awaiter_key(kvfifo_channel *channel_, K const &k_)
+        : waiter(channel_, k_) {}
+    using waiter::await_ready;
+    using waiter::await_suspend;
+    V await_resume() { return std::move(waiter::take().second); }
+  };
+
+  kvfifo_channel() = default;
+  explicit kvfifo_channel(Alloc const &alloc) : items(alloc) {}
+  kvfifo_channel(kvfifo_channel const &) = delete;
+  kvfifo_channel &operator=(kvfifo_channel const &) = delete;
+
+  // Korutyny, które jeszcze czekają, nie zostaną już wznowione przez ten
+  // kanał (można je bezpiecznie zniszczyć później).
+  ~kvfifo_channel() {
+    for (auto *w : any_waiters) w->linked = false;
+    for (auto &[k, waiters] : key_waiters) {
+      for (auto *w : waiters) w->linked = false;
+    }
+  }
+
+  // Oddaje element czekającej korutynie (i wznawia ją) albo wstawia go na
+  // koniec kolejki. Jeśli zgłosi wyjątek, kanał się nie zmienia.
+  void push(K const &k, V const &v) {
+    waiter *w = waiter_for(k);
+    if (w == nullptr) {
+      items.push(k, v);
+      return;
+    }
+    w->delivered.emplace(k, v);
+
+    // Dalej bez wyjątków.
+
+    w->unlink();
+    w->handle.resume();
+  }
+
+  awaiter_any next() noexcept { return awaiter_any(this); }
+  awaiter_key next(K const &k) { return awaiter_key(this, k); }
+
+  kvfifo<K, V, Alloc> const &queue() const noexcept { return items; }
+  size_t size() const noexcept { return items.size(); }
+  bool empty() const noexcept { return items.empty(); }
+
+  // Liczba czekających korutyn.
+  size_t waiting() const noexcept {
+    size_t result = any_waiters.size();
+    for (auto const &[k, waiters] : key_waiters) result += waiters.size();
+    return result;
+  }
+
+ private:
+  // Najdłużej czekający, któremu pasuje element o kluczu k. Złożoność
+  // O(log w).
+  waiter *waiter_for(K const &k) const {
+    waiter *result = any_waiters.empty() ? nullptr : any_waiters.front();
+    auto slot = key_waiters.find(k);
+    if (slot != key_waiters.end()) {
+      waiter *keyed = slot->second.front();
+      if (result == nullptr || keyed->ticket < result->ticket) result = keyed;
+    }
+    return result;
+  }
+
+  kvfifo<K, V, Alloc> items;
+  waiters_t any_waiters;
+  key_waiters_t key_waiters;
+  std::uint64_t next_ticket = 0;
+};
+
+#endif  // KVFIFO_CORO_H
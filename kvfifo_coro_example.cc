@@ -0,0 +1,140 @@
+#include "kvfifo_coro.h"
+
+#include <cassert>
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using channel_t = kvfifo_channel<int, std::string>;
+using task = kvfifo_executor::task;
+
+task consume_any(channel_t &channel, std::vector<std::string> &out, int n) {
+  for (int i = 0; i < n; ++i) {
+    auto [k, v] = co_await channel.next();
+    out.push_back(std::to_string(k) + ":" + v);
+  }
+}
+
+task consume_key(channel_t &channel, int k, std::vector<std::string> &out,
+                 int n) {
+  for (int i = 0; i < n; ++i) out.push_back(co_await channel.next(k));
+}
+
+task fail(channel_t &channel) {
+  co_await channel.next(7);
+  throw std::runtime_error("consumer");
+}
+
+task ping_pong(kvfifo_channel<int, int> &in, kvfifo_channel<int, int> &out,
+               int n) {
+  for (int i = 0; i < n; ++i) out.push(1, co_await in.next(0) + 1);
+}
+
+void handoff_test() {
+  kvfifo_executor executor;
+  channel_t channel;
+  std::vector<std::string> any, keyed;
+
+  // Elementy wstawione przed startem konsumenta czekają w kolejce.
+  channel.push(1, "a");
+  executor.spawn(consume_any(channel, any, 3));
+  executor.spawn(consume_key(channel, 2, keyed, 2));
+  assert(executor.run() == 2);
+  assert(any.size() == 1 && any[0] == "1:a");
+  assert(channel.empty() && channel.waiting() == 2);
+
+  // Konsument ogólny czeka dłużej, więc dostaje pierwszy element o kluczu 2,
+  // a drugi trafia do konsumenta klucza 2. Nic nie przechodzi przez kolejkę.
+  channel.push(2, "b");
+  channel.push(2, "c");
+  assert(any.size() == 2 && any[1] == "2:b");
+  assert(keyed.size() == 1 && keyed[0] == "c");
+  assert(channel.empty() && channel.waiting() == 2);
+
+  // Klucza 3 nikt konkretnie nie chce.
+  channel.push(3, "d");
+  channel.push(3, "e");
+  assert(any.size() == 3 && any[2] == "3:d");
+  assert(channel.size() == 1 && channel.queue().front().second == "e");
+  channel.push(2, "f");
+  assert(keyed.size() == 2 && keyed[1] == "f");
+  assert(channel.waiting() == 0 && executor.active() == 0);
+  assert(executor.run() == 0);
+}
+
+void ready_test() {
+  kvfifo_executor executor;
+  channel_t channel;
+  std::vector<std::string> keyed;
+  channel.push(1, "a");
+  channel.push(2, "b");
+  channel.push(1, "c");
+
+  // Gotowe elementy są wyjmowane bez zawieszania.
+  executor.spawn(consume_key(channel, 1, keyed, 2));
+  assert(executor.run() == 1 && executor.active() == 0);
+  assert(keyed.size() == 2 && keyed[0] == "a" && keyed[1] == "c");
+  assert(channel.size() == 1 && channel.queue().count(1) == 0);
+}
+
+void failure_test() {
+  kvfifo_executor executor;
+  channel_t channel;
+  executor.spawn(fail(channel));
+  executor.run();
+  channel.push(7, "x");
+  [[maybe_unused]] bool thrown = false;
+  try {
+    executor.run();
+  } catch (std::runtime_error const &) {
+    thrown = true;
+  }
+  assert(thrown && executor.active() == 0);
+}
+
+void abandon_test() {
+  // Korutyny czekające w chwili zniszczenia kanału lub wykonawcy.
+  std::vector<std::string> out;
+  {
+    kvfifo_executor executor;
+    channel_t channel;
+    executor.spawn(consume_any(channel, out, 1));
+    executor.spawn(consume_key(channel, 1, out, 1));
+    executor.run();
+    assert(channel.waiting() == 2 && executor.active() == 2);
+  }
+  {
+    channel_t channel;
+    kvfifo_executor executor;
+    executor.spawn(consume_key(channel, 1, out, 1));
+    executor.run();
+  }
+  assert(out.empty());
+}
+
+void handoff_bench() {
+  const int n = 1000000;
+  kvfifo_executor executor;
+  kvfifo_channel<int, int> in, out;
+  executor.spawn(ping_pong(in, out, n));
+  executor.run();
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < n; ++i) in.push(0, i);
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+  assert(out.size() == static_cast<size_t>(n));
+  assert(out.queue().back().second == n);
+  std::cout << "handoff: " << ns / n << " ns per element" << std::endl;
+}
+
+int main() {
+  handoff_test();
+  ready_test();
+  failure_test();
+  abandon_test();
+  handoff_bench();
+  std::cout << "All coroutine tests passed!" << std::endl;
+}
@@ -0,0 +1,220 @@
+#ifndef KVFIFO_LATENCY_H
+#define KVFIFO_LATENCY_H
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Histogramy czasów operacji na kolejkach kvfifo. Pomiary są wkompilowane
+// tylko wtedy, gdy przed dołączeniem kvfifo.h zdefiniowano
+// KVFIFO_LATENCY_HISTOGRAMS. Bez tego makra kvfifo.h nie dołącza tego pliku,
+// a miejsca pomiaru nie generują żadnego kodu.
+//
+// Czas mierzymy licznikiem cykli procesora (rdtsc), a tam, gdzie go nie ma,
+// zegarem steady_clock w nanosekundach (zob. unit). Każdy pomiar to dwa
+// odczyty licznika i dwa zwiększenia liczników atomowych (bez blokad, więc
+// kolejki w różnych wątkach mierzą się niezależnie).
+namespace kvfifo_latency {
+
+enum class op : std::uint8_t {
+  copy,           // konstruktor kopiujący
+  assign,         // operator=
+  detach,         // kopiowanie współdzielonych danych przed modyfikacją
+  push,
+  push_with_ttl,
+  assign_range,   // assign(range) i konstruktor z zakresu
+  expire,
+  pop,
+  pop_key,
+  pop_all,
+  pop_range,
+  erase_if,
+  move_to_back,
+  move_to_front,
+  move_range_to_back,
+  append,
+  extract,
+  extract_if,
+  front,          // niestałe dostępy do elementów (mogą odłączyć kopię)
+  back,
+  first,
+  last,
+  at,
+  front_fair,
+  pop_fair,
+  cursor_pop,
+  close_cursor,
+  set_weight,
+  count,
+  count_if,
+  sum,
+  min_max,
+  clear,
+  shrink_to_fit,
+};
+
+inline constexpr std::size_t op_count =
+    static_cast<std::size_t>(op::shrink_to_fit) + 1;
+
+inline constexpr char const *op_names[op_count] = {
+    "copy",          "assign",        "detach",
+    "push",          "push_with_ttl", "assign_range",
+    "expire",        "pop",           "pop_key",
+    "pop_all",       "pop_range",     "erase_if",
+    "move_to_back",  "move_to_front", "move_range_to_back",
+    "append",        "extract",       "extract_if",
+    "front",         "back",          "first",
+    "last",          "at",            "front_fair",
+    "pop_fair",      "cursor_pop",    "close_cursor",
+    "set_weight",    "count",         "count_if",
+    "sum",           "min_max",       "clear",
+    "shrink_to_fit"};
+
+#if defined(__x86_64__) || defined(__i386__)
+inline constexpr char const *unit = "cycles";
+inline std::uint64_t now() noexcept { return __rdtsc(); }
+#else
+inline constexpr char const *unit = "ns";
+inline std::uint64_t now() noexcept {
+  return static_cast<std::uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch())
+          .count());
+}
+#endif
+
+// Histogram log-liniowy: wartości mniejsze od 8 mają własne kubełki, a każdy
+// przedział [2^e, 2^(e+1)) jest dzielony na 8 równych kubełków, więc błąd
+// względny odczytanych percentyli to najwyżej 12,5%.
+class histogram {
+ public:
+  static constexpr unsigned sub_bits = 3;
+  static constexpr std::size_t buckets = (64 - sub_bits + 1) << sub_bits;
+
+  static std::size_t bucket_of(std::uint64_t value) noexcept {
+    if (value < (std::uint64_t{1} << sub_bits)) return value;
+    const unsigned e = std::bit_width(value) - 1;
+    return ((e - sub_bits + 1) << sub_bits) |
+           ((value >> (e - sub_bits)) & ((1u << sub_bits) - 1));
+  }
+
+  // Najmniejsza wartość w kubełku.
+  static std::uint64_t lower_bound(std::size_t bucket) noexcept {
+    if (bucket < (std::size_t{1} << sub_bits)) return bucket;
+    const unsigned e = (bucket >> sub_bits) + sub_bits - 1;
+    return (std::uint64_t{1} << e) |
+           (std::uint64_t{bucket & ((1u << sub_bits) - 1)} << (e - sub_bits));
+  }
+
+  std::array<std::uint64_t, buckets> counts{};
+  std::uint64_t total = 0;
+
+  std::uint64_t count() const noexcept {
+    std::uint64_t result = 0;
+    for (auto c : counts) result += c;
+    return result;
+  }
+
+  double mean() const noexcept {
+    const auto n = count();
+    return n == 0 ? 0.0 : static_cast<double>(total) / n;
+  }
+
+  // Dolne ograniczenie kubełka, w którym leży percentyl p (0 <= p <= 1).
+  std::uint64_t percentile(double p) const noexcept {
+    const auto n = count();
+    if (n == 0) return 0;
+    auto rank = static_cast<std::uint64_t>(p * (n - 1));
+    for (std::size_t bucket = 0; bucket < buckets; ++bucket) {
+      if (rank < counts[bucket]) return lower_bound(bucket);
+      rank -= counts[bucket];
+    }
+    return lower_bound(buckets - 1);
+  }
+};
+
+namespace detail {
+struct recorded {
+  std::array<std::atomic<std::uint64_t>, histogram::buckets> counts{};
+  std::atomic<std::uint64_t> total{0};
+};
+
+inline recorded all[op_count];
+}  // namespace detail
+
+inline void add(op code, std::uint64_t elapsed) noexcept {
+  auto &r = detail::all[static_cast<std::size_t>(code)];
+  r.counts[histogram::bucket_of(elapsed)].fetch_add(1,
+                                                    std::memory_order_relaxed);
+  r.total.fetch_add(elapsed, std::memory_order_relaxed);
+}
+
+// Mierzy czas od utworzenia do zniszczenia (także przez wyjątek).
+class scope {
+ public:
+  explicit scope(op code_) noexcept : code(code_), start(now()) {}
+  scope(scope const &) = delete;
+  scope &operator=(scope const &) = delete;
+  ~scope() { add(code, now() - start); }
+
+ private:
+  op code;
+  std::uint64_t start;
+};
+
+// Bieżący stan histogramu operacji code.
+inline histogram snapshot(op code) noexcept {
+  auto const &r = detail::all[static_cast<std::size_t>(code)];
+  histogram result;
+  for (std::size_t bucket = 0; bucket < histogram::buckets; ++bucket) {
+    result.counts[bucket] = r.counts[bucket].load(std::memory_order_relaxed);
+  }
+  result.total = r.total.load(std::memory_order_relaxed);
+  return result;
+}
+
+inline std::array<histogram, op_count> snapshot() noexcept {
+  std::array<histogram, op_count> result;
+  for (std::size_t code = 0; code < op_count; ++code) {
+    result[code] = snapshot(static_cast<op>(code));
+  }
+  return result;
+}
+
+inline void reset() noexcept {
+  for (auto &r : detail::all) {
+    for (auto &c : r.counts) c.store(0, std::memory_order_relaxed);
+    r.total.store(0, std::memory_order_relaxed);
+  }
+}
+
+// Wypisuje tabelę (operacje, które wystąpiły) do out.
+inline void print(std::FILE *out) {
+  std::fprintf(out, "%-18s %10s %10s %10s %10s %10s %10s  (%s)\n",
+               "operation", "count", "mean", "p50", "p90", "p99", "p99.9",
+               unit);
+  const auto histograms = snapshot();
+  for (std::size_t code = 0; code < op_count; ++code) {
+    auto const &h = histograms[code];
+    const auto n = h.count();
+    if (n == 0) continue;
+    std::fprintf(out, "%-18s %10llu %10.0f %10llu %10llu %10llu %10llu\n",
+                 op_names[code], static_cast<unsigned long long>(n), h.mean(),
+                 static_cast<unsigned long long>(h.percentile(0.5)),
+                 static_cast<unsigned long long>(h.percentile(0.9)),
+                 static_cast<unsigned long long>(h.percentile(0.99)),
+                 static_cast<unsigned long long>(h.percentile(0.999)));
+  }
+}
+
+}  // namespace kvfifo_latency
+
+#endif  // KVFIFO_LATENCY_H
@@ -0,0 +1,89 @@
+// Mierzy czasy operacji przykładowego obciążenia i wypisuje histogramy.
+// Sprawdza też liczby pomiarów i poprawność kubełków histogramu.
+
+#define KVFIFO_LATENCY_HISTOGRAMS
+#include "kvfifo.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using kvfifo_latency::histogram;
+using kvfifo_latency::op;
+
+// Zgłasza błąd sprawdzenia (niezależnie od NDEBUG).
+void require(bool condition, char const *what) {
+  if (!condition) throw std::runtime_error(what);
+}
+
+void bucket_test() {
+  // Kubełki są rosnące, a każda wartość leży w swoim kubełku z błędem
+  // względnym najwyżej 1/8.
+  for (std::size_t b = 1; b < histogram::buckets; ++b) {
+    require(histogram::lower_bound(b - 1) < histogram::lower_bound(b),
+            "buckets not increasing");
+    require(histogram::bucket_of(histogram::lower_bound(b)) == b,
+            "lower bound outside its bucket");
+  }
+  for (std::uint64_t v : {0ull, 1ull, 7ull, 8ull, 9ull, 100ull, 12345ull,
+                          (1ull << 40) + 12345, ~0ull}) {
+    const auto lower = histogram::lower_bound(histogram::bucket_of(v));
+    require(lower <= v && v - lower <= lower / 8, "bucket too wide");
+  }
+  require(histogram::bucket_of(~0ull) == histogram::buckets - 1,
+          "largest value not in the last bucket");
+}
+
+void count_test() {
+  kvfifo_latency::reset();
+  const int n = 10000;
+  kvfifo<int, std::string> kvf;
+  for (int i = 0; i < n; ++i) kvf.push(i % 100, std::to_string(i));
+  // Każda kopia, po której modyfikujemy kolejkę, kosztuje odłączenie.
+  std::vector<kvfifo<int, std::string>> copies;
+  for (int i = 0; i < 10; ++i) {
+    copies.push_back(kvf);
+    kvf.move_to_back(i);
+  }
+  for (int i = 0; i < 100; ++i) kvf.pop(i);
+  while (!kvf.empty()) kvf.pop();
+
+  auto push = kvfifo_latency::snapshot(op::push);
+  require(push.count() == n, "wrong push count");
+  require(push.percentile(0.5) <= push.percentile(0.99),
+          "percentiles not increasing");
+  require(push.percentile(0) <= push.mean(), "minimum above mean");
+  require(kvfifo_latency::snapshot(op::copy).count() == 10,
+          "wrong copy count");
+  require(kvfifo_latency::snapshot(op::detach).count() == 10,
+          "wrong detach count");
+  require(kvfifo_latency::snapshot(op::move_to_back).count() == 10,
+          "wrong move_to_back count");
+  require(kvfifo_latency::snapshot(op::pop_key).count() == 100,
+          "wrong pop(k) count");
+  require(kvfifo_latency::snapshot(op::pop).count() == n - 100,
+          "wrong pop count");
+  // Odłączenie kopiuje całą kolejkę, więc trwa dłużej niż typowy push.
+  auto detach = kvfifo_latency::snapshot(op::detach);
+  require(detach.percentile(0.5) > push.percentile(0.5),
+          "detach faster than push");
+
+  kvfifo_latency::print(stdout);
+  kvfifo_latency::reset();
+  require(kvfifo_latency::snapshot(op::push).count() == 0,
+          "reset left samples");
+}
+
+int main() {
+  try {
+    bucket_test();
+    count_test();
+  } catch (std::exception const &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  std::cout << "All latency tests passed!" << std::endl;
+}
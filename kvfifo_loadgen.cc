@@ -0,0 +1,504 @@
+// Klient obciążający kvfifo_server: wysyła paczki żądań (mieszanka push, pop,
+// pop(k), move_to_back i count) z wieloma ramkami w drodze naraz i wypisuje
+// przepustowość oraz opóźnienia ramek (od wysłania do odpowiedzi).
+//
+// Użycie: kvfifo_loadgen [--unix ścieżka | --tcp port] [--ops n]
+//                        [--batch b] [--depth d] [--keys k] [--value bajty]
+//                        [--queue nazwa] [--check]
+//
+// Z --check zamiast pomiaru porównuje odpowiedzi serwera bajt po bajcie
+// z wynikami tych samych operacji na lokalnej kolejce.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "kvfifo.h"
+#include "kvfifo_proto.h"
+
+namespace {
+
+using namespace kvfifo_proto;
+using clock_type = std::chrono::steady_clock;
+
+struct options {
+  char const *path = "kvfifo.sock";
+  int port = 0;
+  std::uint64_t ops = 1000000;
+  std::uint32_t batch = 64;
+  std::size_t depth = 16;
+  std::uint64_t keys = 1024;
+  std::size_t value = 16;
+  std::string queue = "load";
+  bool check = false;
+};
+
+class client {
+ public:
+  // Łączy się z serwerem, czekając do kilku sekund, aż zacznie nasłuchiwać.
+  explicit client(options const &o) {
+    for (int attempt = 0;; ++attempt) {
+      fd = o.port > 0 ? connect_tcp(o.port) : connect_unix(o.path);
+      if (fd >= 0) break;
+      if (attempt == 100) {
+        throw std::system_error(errno, std::system_category());
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+  }
+  ~client() { ::close(fd); }
+  client(client const &) = delete;
+  client &operator=(client const &) = delete;
+
+  void send(std::string_view frame) {
+    while (!frame.empty()) {
+      const ssize_t n = ::send(fd, frame.data(), frame.size(), MSG_NOSIGNAL);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        throw std::system_error(errno, std::system_category());
+      }
+      frame.remove_prefix(n);
+    }
+  }
+
+  // Kończy wysyłanie, ale dalej odbiera odpowiedzi.
+  void shutdown() {
+    if (::shutdown(fd, SHUT_WR) < 0) {
+      throw std::system_error(errno, std::system_category());
+    }
+  }
+
+  // Czeka na następną ramkę odpowiedzi i zwraca ją bez długości. Wynik jest
+  // ważny do następnego wywołania.
+  std::string_view receive() {
+    in.erase(0, used);
+    long long size;
+    while ((size = frame_size(in)) == 0) {
+      char buf[1 << 16];
+      const ssize_t n = ::read(fd, buf, sizeof(buf));
+      if (n == 0) throw std::runtime_error("server closed the connection");
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        throw std::system_error(errno, std::system_category());
+      }
+      in.append(buf, n);
+    }
+    if (size < 0) throw std::runtime_error("bad frame");
+    used = size;
+    return std::string_view(in).substr(4, size - 4);
+  }
+
+ private:
+  static int connect_unix(char const *path) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    return connect_to(AF_UNIX, reinterpret_cast<sockaddr *>(&addr),
+                      sizeof(addr));
+  }
+
+  static int connect_tcp(int port) {
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<std::uint16_t>(port));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    const int fd = connect_to(AF_INET, reinterpret_cast<sockaddr *>(&addr),
+                              sizeof(addr));
+    if (fd >= 0) {
+      const int on = 1;
+      ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    return fd;
+  }
+
+  static int connect_to(int family, sockaddr const *addr, socklen_t size) {
+    const int fd = ::socket(family, SOCK_STREAM, 0);
+    if (fd < 0) throw std::system_error(errno, std::system_category());
+    if (::connect(fd, addr, size) == 0) return fd;
+    const int error = errno;
+    ::close(fd);
+    errno = error;
+    return -1;
+  }
+
+  int fd = -1;
+  std::string in;
+  // Długość ostatnio zwróconej ramki, usuwanej przy następnym receive.
+  std::size_t used = 0;
+};
+
+struct request {
+  op code;
+  std::uint64_t key;
+};
+
+void put_request(writer &w, std::uint32_t queue, request r,
+                 std::string_view value) {
+  w.put8(static_cast<std::uint8_t>(r.code));
+  w.put32(queue);
+  switch (r.code) {
+    case op::push:
+      w.put64(r.key);
+      w.put32(static_cast<std::uint32_t>(value.size()));
+      w.put_bytes(value);
+      break;
+    case op::pop_key:
+    case op::move_to_back:
+    case op::count:
+      w.put64(r.key);
+      break;
+    default:
+      break;
+  }
+}
+
+std::uint32_t open_queue(client &c, std::string_view name) {
+  std::string frame;
+  writer w(frame);
+  const std::size_t start = w.begin_frame();
+  w.put8(static_cast<std::uint8_t>(op::open));
+  w.put16(static_cast<std::uint16_t>(name.size()));
+  w.put_bytes(name);
+  w.end_frame(start, 1);
+  c.send(frame);
+  reader r(c.receive());
+  if (r.get32() != 1 || static_cast<status>(r.get8()) != status::ok) {
+    throw std::runtime_error("open failed");
+  }
+  return r.get32();
+}
+
+// Zwraca losową operację w proporcjach obciążenia: połowa push, reszta
+// po równo między pop i pop(k), rzadziej move_to_back i count.
+request draw(std::mt19937_64 &rng, std::uint64_t keys) {
+  static constexpr op mix[] = {op::push,    op::push,         op::push,
+                               op::push,    op::push,         op::pop,
+                               op::pop,     op::pop_key,      op::pop_key,
+                               op::move_to_back, op::count};
+  return {mix[rng() % std::size(mix)], rng() % keys};
+}
+
+// Przechodzi przez odpowiedź na żądanie code. Zwraca false dla błędu.
+bool skip_response(reader &r, op code) {
+  if (static_cast<status>(r.get8()) == status::error) {
+    r.get_bytes(r.get16());
+    return false;
+  }
+  switch (code) {
+    case op::pop:
+      r.get64();
+      r.get_bytes(r.get32());
+      break;
+    case op::pop_key:
+      r.get_bytes(r.get32());
+      break;
+    case op::count:
+    case op::size:
+      r.get64();
+      break;
+    default:
+      break;
+  }
+  return true;
+}
+
+void load(options const &o) {
+  client c(o);
+  const std::uint32_t queue = open_queue(c, o.queue);
+  const std::string value(o.value, 'v');
+  std::mt19937_64 rng(1);
+
+  struct in_flight {
+    clock_type::time_point sent;
+    std::vector<op> codes;
+  };
+  std::deque<in_flight> pending;
+  std::vector<double> latencies;
+  std::uint64_t sent = 0, done = 0, errors = 0;
+  std::string frame;
+
+  const auto start = clock_type::now();
+  while (done < o.ops) {
+    // Dosyłamy ramki, aż w drodze będzie depth ramek.
+    while (sent < o.ops && pending.size() < o.depth) {
+      frame.clear();
+      writer w(frame);
+      const std::size_t at = w.begin_frame();
+      in_flight f;
+      const auto n = static_cast<std::uint32_t>(
+          std::min<std::uint64_t>(o.batch, o.ops - sent));
+      for (std::uint32_t i = 0; i < n; ++i) {
+        const request r = draw(rng, o.keys);
+        put_request(w, queue, r, value);
+        f.codes.push_back(r.code);
+      }
+      w.end_frame(at, n);
+      f.sent = clock_type::now();
+      c.send(frame);
+      pending.push_back(std::move(f));
+      sent += n;
+    }
+
+    reader r(c.receive());
+    const in_flight &f = pending.front();
+    if (r.get32() != f.codes.size()) throw std::runtime_error("bad response");
+    for (op code : f.codes) errors += !skip_response(r, code);
+    if (!r.good() || !r.done()) throw std::runtime_error("bad response");
+    latencies.push_back(
+        std::chrono::duration<double, std::micro>(clock_type::now() - f.sent)
+            .count());
+    done += f.codes.size();
+    pending.pop_front();
+  }
+  const double seconds =
+      std::chrono::duration<double>(clock_type::now() - start).count();
+
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&latencies](double p) {
+    return latencies[static_cast<std::size_t>(p * (latencies.size() - 1))];
+  };
+  std::printf("%llu ops in %.3f s, %.0f ops/s (batch %u, depth %zu)\n",
+              static_cast<unsigned long long>(done), seconds, done / seconds,
+              o.batch, o.depth);
+  std::printf("frame latency us: p50 %.1f p99 %.1f max %.1f\n",
+              percentile(0.5), percentile(0.99), latencies.back());
+  std::printf("%llu failed (empty queue or missing key)\n",
+              static_cast<unsigned long long>(errors));
+}
+
+// Dopisuje do w odpowiedź, jaką serwer powinien dać na r, i wykonuje r na
+// model.
+void expect(kvfifo<std::uint64_t, std::string> &model, writer &w, request r,
+            std::string const &value) {
+  auto fail = [&w](std::string_view message) {
+    w.put8(static_cast<std::uint8_t>(status::error));
+    w.put16(static_cast<std::uint16_t>(message.size()));
+    w.put_bytes(message);
+  };
+  auto put_value = [&w](std::string const &v) {
+    w.put32(static_cast<std::uint32_t>(v.size()));
+    w.put_bytes(v);
+  };
+  switch (r.code) {
+    case op::push:
+      model.push(r.key, value);
+      w.put8(static_cast<std::uint8_t>(status::ok));
+      break;
+    case op::pop:
+      if (model.empty()) return fail("empty");
+      w.put8(static_cast<std::uint8_t>(status::ok));
+      w.put64(model.front().first);
+      put_value(model.front().second);
+      model.pop();
+      break;
+    case op::pop_key:
+      if (model.count(r.key) == 0) return fail("key missing");
+      w.put8(static_cast<std::uint8_t>(status::ok));
+      put_value(model.first(r.key).second);
+      model.pop(r.key);
+      break;
+    case op::move_to_back:
+      if (model.count(r.key) == 0) return fail("key missing");
+      model.move_to_back(r.key);
+      w.put8(static_cast<std::uint8_t>(status::ok));
+      break;
+    case op::count:
+      w.put8(static_cast<std::uint8_t>(status::ok));
+      w.put64(model.count(r.key));
+      break;
+    default:
+      w.put8(static_cast<std::uint8_t>(status::ok));
+      w.put64(model.size());
+  }
+}
+
+// Zgłasza błąd sprawdzenia (niezależnie od NDEBUG).
+void require(bool condition, char const *what) {
+  if (!condition) throw std::runtime_error(what);
+}
+
+void check(options o) {
+  // Mało kluczy, żeby pop(k) i move_to_back zwykle trafiały.
+  o.queue = "check-" + std::to_string(::getpid());
+  o.keys = std::min<std::uint64_t>(o.keys, 16);
+  client c(o);
+  const std::uint32_t queue = open_queue(c, o.queue);
+  kvfifo<std::uint64_t, std::string> model;
+  std::mt19937_64 rng(2);
+
+  // Paczki różnej wielkości, do depth ramek w drodze.
+  std::deque<std::string> expected;
+  std::string frame;
+  std::uint64_t sent = 0;
+  while (sent < o.ops || !expected.empty()) {
+    while (sent < o.ops && expected.size() < o.depth) {
+      frame.clear();
+      writer w(frame);
+      std::string answer;
+      writer a(answer);
+      const std::size_t at = w.begin_frame();
+      const std::size_t answer_at = a.begin_frame();
+      const auto n = static_cast<std::uint32_t>(1 + rng() % o.batch);
+      for (std::uint32_t i = 0; i < n; ++i) {
+        request r = draw(rng, o.keys);
+        if (rng() % 16 == 0) r.code = op::size;
+        const std::string value =
+            std::to_string(sent + i) + std::string(rng() % 8, 'x');
+        put_request(w, queue, r, value);
+        expect(model, a, r, value);
+      }
+      w.end_frame(at, n);
+      a.end_frame(answer_at, n);
+      c.send(frame);
+      expected.push_back(answer.substr(4));
+      sent += n;
+    }
+    if (c.receive() != expected.front()) {
+      throw std::runtime_error("response differs from the local queue");
+    }
+    expected.pop_front();
+  }
+
+  // Drugie połączenie widzi tę samą kolejkę pod tym samym numerem.
+  client other(o);
+  require(open_queue(other, o.queue) == queue,
+          "second connection got another queue");
+  frame.clear();
+  writer w(frame);
+  std::size_t at = w.begin_frame();
+  put_request(w, queue, {op::size, 0}, {});
+  put_request(w, queue + 1000, {op::pop, 0}, {});
+  w.end_frame(at, 2);
+  other.send(frame);
+  reader r(other.receive());
+  require(r.get32() == 2, "wrong number of responses");
+  require(static_cast<status>(r.get8()) == status::ok, "size failed");
+  require(r.get64() == model.size(), "size differs from the local queue");
+  require(static_cast<status>(r.get8()) == status::error,
+          "request to a missing queue succeeded");
+  require(r.get_bytes(r.get16()) == "no such queue" && r.done(),
+          "wrong error for a missing queue");
+
+  // Niepoprawna ramka zamyka połączenie.
+  frame.clear();
+  at = w.begin_frame();
+  w.put8(200);
+  w.end_frame(at, 1);
+  other.send(frame);
+  bool closed = false;
+  try {
+    other.receive();
+  } catch (std::runtime_error const &) {
+    closed = true;
+  }
+  require(closed, "malformed frame did not close the connection");
+
+  // Klient, który wysłał dużą paczkę i zamknął swoją stronę, dostaje
+  // wszystkie odpowiedzi (więcej, niż mieści się w buforach gniazda), a
+  // potem serwer zamyka połączenie.
+  client half(o);
+  const std::uint32_t half_queue = open_queue(half, o.queue + "-half");
+  const std::string big(1 << 16, 'h');
+  constexpr std::uint32_t pushed = 64;
+  frame.clear();
+  at = w.begin_frame();
+  for (std::uint32_t i = 0; i < pushed; ++i) {
+    put_request(w, half_queue, {op::push, i}, big);
+  }
+  w.end_frame(at, pushed);
+  at = w.begin_frame();
+  for (std::uint32_t i = 0; i < pushed; ++i) {
+    put_request(w, half_queue, {op::pop, 0}, {});
+  }
+  w.end_frame(at, pushed);
+  half.send(frame);
+  half.shutdown();
+  reader pushes(half.receive());
+  require(pushes.get32() == pushed, "wrong number of push responses");
+  for (std::uint32_t i = 0; i < pushed; ++i) {
+    require(static_cast<status>(pushes.get8()) == status::ok, "push failed");
+  }
+  reader pops(half.receive());
+  require(pops.get32() == pushed, "wrong number of pop responses");
+  for (std::uint32_t i = 0; i < pushed; ++i) {
+    require(static_cast<status>(pops.get8()) == status::ok &&
+                pops.get64() == i && pops.get_bytes(pops.get32()) == big,
+            "half-closed connection got a wrong pop response");
+  }
+  require(pops.good() && pops.done(), "bad pop response");
+  closed = false;
+  try {
+    half.receive();
+  } catch (std::runtime_error const &) {
+    closed = true;
+  }
+  require(closed, "server kept a half-closed connection open");
+  std::printf("%llu requests checked\n", static_cast<unsigned long long>(sent));
+  std::printf("All server tests passed!\n");
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  options o;
+  for (int i = 1; i < argc; ++i) {
+    const std::string_view arg = argv[i];
+    const bool has_value = i + 1 < argc;
+    if (arg == "--unix" && has_value) {
+      o.path = argv[++i];
+    } else if (arg == "--tcp" && has_value) {
+      o.port = std::atoi(argv[++i]);
+    } else if (arg == "--ops" && has_value) {
+      o.ops = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--batch" && has_value) {
+      o.batch = std::max(1, std::atoi(argv[++i]));
+    } else if (arg == "--depth" && has_value) {
+      o.depth = std::max(1, std::atoi(argv[++i]));
+    } else if (arg == "--keys" && has_value) {
+      o.keys = std::max<std::uint64_t>(
+          1, std::strtoull(argv[++i], nullptr, 10));
+    } else if (arg == "--value" && has_value) {
+      o.value = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--queue" && has_value) {
+      o.queue = argv[++i];
+    } else if (arg == "--check") {
+      o.check = true;
+    } else {
+      std::fprintf(stderr,
+                   "usage: %s [--unix path | --tcp port] [--ops n] "
+                   "[--batch b] [--depth d] [--keys k] [--value bytes] "
+                   "[--queue name] [--check]\n",
+                   argv[0]);
+      return 2;
+    }
+  }
+  try {
+    if (o.check) {
+      check(o);
+    } else {
+      load(o);
+    }
+  } catch (std::exception const &e) {
+    std::fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+}
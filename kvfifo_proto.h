@@ -0,0 +1,148 @@
+#ifndef KVFIFO_PROTO_H
+#define KVFIFO_PROTO_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Protokół binarny serwera kolejek (kvfifo_server) i jego klientów (np.
+// kvfifo_loadgen). Liczby są zapisywane little endian.
+//
+// Klient wysyła ramki, każda z dowolną liczbą żądań (paczka), i nie musi
+// czekać na odpowiedź przed wysłaniem następnej ramki. Serwer wykonuje
+// żądania połączenia po kolei i na każdą ramkę odpowiada jedną ramką
+// z odpowiedziami na jej żądania, w tej samej kolejności.
+//
+// Ramka: długość reszty ramki (4 bajty), liczba żądań albo odpowiedzi (4),
+// żądania albo odpowiedzi. Żądanie to kod operacji (1 bajt), a dalej:
+//   open          długość nazwy (2), nazwa
+//   push          kolejka (4), klucz (8), długość wartości (4), wartość
+//   pop           kolejka (4)
+//   pop_key       kolejka (4), klucz (8)
+//   move_to_back  kolejka (4), klucz (8)
+//   count         kolejka (4), klucz (8)
+//   size          kolejka (4)
+// Kolejka to numer zwrócony przez open (ta sama nazwa daje ten sam numer
+// wszystkim klientom). Odpowiedź to status (1 bajt): error, długość
+// komunikatu (2) i komunikat (błędy jak w kvfifo, np. "empty") albo ok
+// i wynik: numer kolejki dla open, klucz (8), długość wartości (4) i wartość
+// zdjętego elementu dla pop, długość wartości i wartość dla pop_key, liczba
+// (8) dla count i size, nic dla push i move_to_back. Na ramkę dłuższą niż
+// max_frame albo niepoprawną serwer zamyka połączenie.
+namespace kvfifo_proto {
+
+enum class op : std::uint8_t {
+  open,
+  push,
+  pop,
+  pop_key,
+  move_to_back,
+  count,
+  size,
+};
+
+inline constexpr std::size_t op_count =
+    static_cast<std::size_t>(op::size) + 1;
+
+inline constexpr char const *op_names[op_count] = {
+    "open", "push", "pop", "pop_key", "move_to_back", "count", "size"};
+
+enum class status : std::uint8_t { ok, error };
+
+inline constexpr std::uint32_t max_frame = 16 << 20;
+
+// Dopisuje liczby i napisy na koniec out.
+class writer {
+ public:
+  explicit writer(std::string &out_) : out(out_) {}
+
+  void put8(std::uint8_t value) { out.push_back(static_cast<char>(value)); }
+  void put16(std::uint16_t value) { put(value, 2); }
+  void put32(std::uint32_t value) { put(value, 4); }
+  void put64(std::uint64_t value) { put(value, 8); }
+  void put_bytes(std::string_view bytes) { out.append(bytes); }
+
+  // Zaczyna ramkę: miejsce na długość i liczbę elementów, uzupełniane przez
+  // end_frame.
+  std::size_t begin_frame() {
+    const std::size_t start = out.size();
+    out.append(8, '\0');
+    return start;
+  }
+  void end_frame(std::size_t start, std::uint32_t items) {
+    patch(start, static_cast<std::uint32_t>(out.size() - start - 4));
+    patch(start + 4, items);
+  }
+
+ private:
+  void put(std::uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; ++i) {
+      out.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+    }
+  }
+  void patch(std::size_t at, std::uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+      out[at + i] = static_cast<char>((value >> (8 * i)) & 0xff);
+    }
+  }
+
+  std::string &out;
+};
+
+// Czyta liczby i napisy z bufora. Po przeczytaniu poza końcem good() jest
+// false, a odczyty zwracają zera.
+class reader {
+ public:
+  explicit reader(std::string_view in_) : in(in_) {}
+
+  std::uint8_t get8() { return static_cast<std::uint8_t>(get(1)); }
+  std::uint16_t get16() { return static_cast<std::uint16_t>(get(2)); }
+  std::uint32_t get32() { return static_cast<std::uint32_t>(get(4)); }
+  std::uint64_t get64() { return get(8); }
+  std::string_view get_bytes(std::size_t n) {
+    if (!take(n)) return {};
+    return in.substr(at - n, n);
+  }
+
+  bool good() const noexcept { return ok; }
+  bool done() const noexcept { return at == in.size(); }
+  std::size_t position() const noexcept { return at; }
+
+ private:
+  bool take(std::size_t n) {
+    if (!ok || in.size() - at < n) {
+      ok = false;
+      return false;
+    }
+    at += n;
+    return true;
+  }
+  std::uint64_t get(int bytes) {
+    if (!take(bytes)) return 0;
+    std::uint64_t value = 0;
+    for (int i = 0; i < bytes; ++i) {
+      value |= std::uint64_t{static_cast<unsigned char>(in[at - bytes + i])}
+               << (8 * i);
+    }
+    return value;
+  }
+
+  std::string_view in;
+  std::size_t at = 0;
+  bool ok = true;
+};
+
+// Długość pierwszej pełnej ramki w buf (z nagłówkiem), 0 jeśli ramka nie
+// jest jeszcze cała, albo -1, jeśli jest za długa.
+inline long long frame_size(std::string_view buf) {
+  if (buf.size() < 4) return 0;
+  reader r(buf);
+  const std::uint32_t length = r.get32();
+  if (length > max_frame || length < 4) return -1;
+  return buf.size() - 4 < length ? 0 : 4 + static_cast<long long>(length);
+}
+
+}  // namespace kvfifo_proto
+
+#endif  // KVFIFO_PROTO_H
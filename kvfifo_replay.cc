@@ -0,0 +1,305 @@
+// Odtwarza zapis operacji na kolejkach (zob. kvfifo_trace.h) na wybranej
+// implementacji kolejki i wypisuje przepustowość oraz opóźnienia
+// poszczególnych operacji.
+//
+// Użycie: kvfifo_replay [--backend std|pool|arena] plik
+//
+// Klucze są liczbami z zapisu, a wartości napisami o zapisanym rozmiarze.
+// Operacje, które zgłoszą wyjątek (np. gdy zapis zaczął się w trakcie
+// działania programu i kolejka nie ma elementów sprzed niego), są liczone
+// jako nieudane. Zdarzenia z danymi (element, selected) nie są liczone ani
+// mierzone, tylko zbierane dla operacji, która po nich następuje. Nazwą
+// kursora jest jej zapisany kod.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "kvfifo.h"
+#include "kvfifo_trace.h"
+
+namespace {
+
+using kvfifo_trace::event;
+using kvfifo_trace::op;
+
+template <typename Queue, typename Make>
+class replayer {
+ public:
+  explicit replayer(Make make_) : make(make_) {}
+
+  // Odtwarza wszystkie zdarzenia z r i wypisuje statystyki.
+  void run(kvfifo_trace::reader &r) {
+    event e;
+    size_t events = 0;
+    std::chrono::nanoseconds total{0};
+    while (r.next(e)) {
+      if (e.code == op::element) {
+        elements.emplace_back(e.key, std::string(e.other, 'x'));
+        continue;
+      }
+      if (e.code == op::selected) {
+        selected.push_back(e.key);
+        continue;
+      }
+      ++events;
+      // Wartość i kolejki przygotowujemy poza pomiarem.
+      const std::string value(e.other, 'x');
+      prepare(e);
+      const auto start = std::chrono::steady_clock::now();
+      try {
+        apply(e, value);
+      } catch (std::exception const &) {
+        ++failed;
+      }
+      const auto elapsed = std::chrono::steady_clock::now() - start;
+      total += elapsed;
+      latencies[static_cast<size_t>(e.code)].push_back(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+              .count());
+      elements.clear();
+      selected.clear();
+    }
+    report(events, total);
+  }
+
+ private:
+  Queue &queue(std::uint32_t id) {
+    if (!queues[id]) queues[id].emplace(make());
+    return *queues[id];
+  }
+
+  // Zapewnia, że kolejki, których dotyczy e, istnieją (deque nie unieważnia
+  // referencji przy powiększaniu).
+  void prepare(event const &e) {
+    std::uint32_t top = e.queue;
+    if (e.code == op::copy || e.code == op::move || e.code == op::assign ||
+        e.code == op::append) {
+      top = std::max(top, e.other);
+    }
+    if (queues.size() <= top) queues.resize(top + 1);
+  }
+
+  void apply(event const &e, std::string const &value) {
+    const std::uint64_t k = e.key;
+    switch (e.code) {
+      case op::create:
+        queues[e.queue].emplace(make());
+        break;
+      case op::copy:
+        queues[e.queue].emplace(queue(e.other));
+        break;
+      case op::move:
+        queues[e.queue].emplace(std::move(queue(e.other)));
+        break;
+      case op::assign:
+        // Przypisywana jest kopia robiona przy wywołaniu operator=, która
+        // zaraz potem jest niszczona.
+        queue(e.queue) = std::move(queue(e.other));
+        break;
+      case op::destroy:
+        queues[e.queue].reset();
+        break;
+      case op::push:
+        queue(e.queue).push(k, value);
+        break;
+      case op::push_with_ttl:
+        queue(e.queue).push_with_ttl(k, value, e.arg);
+        break;
+      case op::pop:
+        queue(e.queue).pop();
+        break;
+      case op::pop_key:
+        queue(e.queue).pop(k);
+        break;
+      case op::pop_all:
+        queue(e.queue).pop_all(k);
+        break;
+      case op::move_to_back:
+        queue(e.queue).move_to_back(k);
+        break;
+      case op::move_to_front:
+        queue(e.queue).move_to_front(k);
+        break;
+      case op::pop_range:
+        checksum += queue(e.queue).pop_range(k, e.arg);
+        break;
+      case op::move_range_to_back:
+        checksum += queue(e.queue).move_range_to_back(k, e.arg);
+        break;
+      case op::front:
+        queue(e.queue).front();
+        break;
+      case op::back:
+        queue(e.queue).back();
+        break;
+      case op::first:
+        queue(e.queue).first(k);
+        break;
+      case op::last:
+        queue(e.queue).last(k);
+        break;
+      case op::at:
+        queue(e.queue).at(e.arg);
+        break;
+      case op::count:
+        checksum += queue(e.queue).count(k);
+        break;
+      case op::clear:
+        queue(e.queue).clear();
+        break;
+      case op::expire:
+        checksum += queue(e.queue).expire(e.arg);
+        break;
+      case op::append:
+        queue(e.queue).append(std::move(queue(e.other)));
+        break;
+      case op::extract:
+        pending.emplace(queue(e.queue).extract(k));
+        break;
+      case op::extract_if:
+        // Wybrane klucze są zapisane w kolejności wywołań predykatu.
+        pending.emplace(queue(e.queue).extract_if([this](std::uint64_t k) {
+          return std::find(selected.begin(), selected.end(), k) !=
+                 selected.end();
+        }));
+        break;
+      case op::extracted:
+        queues[e.queue].emplace(pending ? std::move(*pending) : make());
+        pending.reset();
+        break;
+      case op::create_range:
+        queues[e.queue].emplace(make());
+        queues[e.queue]->assign(elements);
+        break;
+      case op::assign_range:
+        queue(e.queue).assign(elements);
+        break;
+      case op::erase_if: {
+        // Wybrane są numery kolejnych wywołań predykatu (rosnąco).
+        size_t call = 0, next = 0;
+        checksum += queue(e.queue).erase_if(
+            [&](std::uint64_t const &, std::string const &) {
+              const bool chosen =
+                  next < selected.size() && selected[next] == call;
+              if (chosen) ++next;
+              ++call;
+              return chosen;
+            });
+        break;
+      }
+      case op::move_keys_to_back:
+        queue(e.queue).move_to_back(selected);
+        break;
+      case op::move_keys_to_front:
+        queue(e.queue).move_to_front(selected);
+        break;
+      case op::front_fair:
+        queue(e.queue).front_fair();
+        break;
+      case op::pop_fair:
+        queue(e.queue).pop_fair();
+        break;
+      case op::set_weight:
+        queue(e.queue).set_weight(k, e.arg);
+        break;
+      case op::open_cursor:
+        queue(e.queue).open_cursor(std::to_string(k));
+        break;
+      case op::close_cursor:
+        queue(e.queue).close_cursor(std::to_string(k));
+        break;
+      case op::cursor_pop:
+        queue(e.queue).cursor_pop(std::to_string(k));
+        break;
+      case op::element:
+      case op::selected:
+        break;
+    }
+  }
+
+  void report(size_t events, std::chrono::nanoseconds total) {
+    const double seconds = std::chrono::duration<double>(total).count();
+    std::printf("%zu events, %zu failed, %.3f s, %.0f ops/s\n", events, failed,
+                seconds, seconds > 0 ? events / seconds : 0.0);
+    std::printf("%-18s %10s %10s %10s %10s %10s\n", "operation", "count",
+                "mean ns", "p50 ns", "p99 ns", "max ns");
+    for (size_t code = 0; code < kvfifo_trace::op_count; ++code) {
+      auto &samples = latencies[code];
+      if (samples.empty()) continue;
+      std::sort(samples.begin(), samples.end());
+      double sum = 0;
+      for (auto sample : samples) sum += sample;
+      auto percentile = [&](double p) {
+        return samples[static_cast<size_t>(p * (samples.size() - 1))];
+      };
+      std::printf("%-18s %10zu %10.0f %10lld %10lld %10lld\n",
+                  kvfifo_trace::op_names[code], samples.size(),
+                  sum / samples.size(), percentile(0.5), percentile(0.99),
+                  samples.back());
+    }
+    std::printf("checksum %zu\n", checksum);
+  }
+
+  Make make;
+  std::deque<std::optional<Queue>> queues;
+  std::optional<Queue> pending;
+  std::vector<std::pair<std::uint64_t, std::string>> elements;
+  std::vector<std::uint64_t> selected;
+  std::vector<long long> latencies[kvfifo_trace::op_count];
+  size_t failed = 0;
+  size_t checksum = 0;
+};
+
+template <typename Queue, typename Make>
+void replay(kvfifo_trace::reader &r, Make make) {
+  replayer<Queue, Make>(make).run(r);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  char const *backend = "std";
+  char const *path = nullptr;
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--backend") == 0 && i + 1 < argc) {
+      backend = argv[++i];
+    } else {
+      path = argv[i];
+    }
+  }
+  if (path == nullptr) {
+    std::fprintf(stderr, "usage: %s [--backend std|pool|arena] trace\n",
+                 argv[0]);
+    return 2;
+  }
+  kvfifo_trace::reader r(path);
+  if (!r.good()) {
+    std::fprintf(stderr, "%s: not a kvfifo trace\n", path);
+    return 1;
+  }
+
+  using std_queue = kvfifo<std::uint64_t, std::string>;
+  using pmr_queue = pmr::kvfifo<std::uint64_t, std::string>;
+  std::printf("backend %s\n", backend);
+  if (std::strcmp(backend, "std") == 0) {
+    replay<std_queue>(r, [] { return std_queue(); });
+  } else if (std::strcmp(backend, "pool") == 0) {
+    std::pmr::unsynchronized_pool_resource pool;
+    replay<pmr_queue>(r, [&pool] { return pmr_queue(&pool); });
+  } else if (std::strcmp(backend, "arena") == 0) {
+    std::pmr::monotonic_buffer_resource arena;
+    replay<pmr_queue>(r, [&arena] { return pmr_queue(&arena); });
+  } else {
+    std::fprintf(stderr, "unknown backend %s\n", backend);
+    return 2;
+  }
+}
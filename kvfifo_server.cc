@@ -0,0 +1,360 @@
+// Serwer udostępniający nazwane kolejki kvfifo<uint64_t, string> przez
+// gniazdo uniksowe albo TCP na 127.0.0.1. Protokół (ramki z paczkami żądań,
+// które można wysyłać bez czekania na odpowiedzi) opisuje kvfifo_proto.h.
+//
+// Użycie: kvfifo_server [--unix ścieżka | --tcp port]
+//
+// Serwer działa w jednym wątku i obsługuje wszystkie połączenia przez
+// poll, więc żądania różnych klientów do jednej kolejki nie potrzebują
+// blokad. Kończy się po SIGINT albo SIGTERM (usuwa wtedy plik gniazda).
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "kvfifo.h"
+#include "kvfifo_proto.h"
+
+namespace {
+
+using namespace kvfifo_proto;
+
+using queue_t = kvfifo<std::uint64_t, std::string>;
+
+volatile sig_atomic_t stopping = 0;
+
+void stop(int) { stopping = 1; }
+
+struct connection {
+  explicit connection(int fd_) : fd(fd_) {}
+  ~connection() { ::close(fd); }
+  connection(connection const &) = delete;
+  connection &operator=(connection const &) = delete;
+
+  int fd;
+  std::string in;
+  std::string out;
+  // Ile bajtów z początku out już wysłano.
+  std::size_t sent = 0;
+  // Czy klient skończył wysyłać (zamknął połączenie albo tylko swoją
+  // stronę przez shutdown). Odpowiedzi z out wysyłamy mu wtedy do końca.
+  bool eof = false;
+};
+
+class server {
+ public:
+  // Wykonuje pełne ramki z c.in i dopisuje odpowiedzi do c.out. Zwraca
+  // false, jeśli ramka jest niepoprawna.
+  bool serve(connection &c) {
+    std::size_t used = 0;
+    for (;;) {
+      const std::string_view rest = std::string_view(c.in).substr(used);
+      const long long size = frame_size(rest);
+      if (size < 0) return false;
+      if (size == 0) break;
+      if (!serve_frame(rest.substr(4, size - 4), c.out)) return false;
+      used += size;
+    }
+    c.in.erase(0, used);
+    return true;
+  }
+
+ private:
+  bool serve_frame(std::string_view body, std::string &out) {
+    reader r(body);
+    const std::uint32_t requests = r.get32();
+    writer w(out);
+    const std::size_t start = w.begin_frame();
+    for (std::uint32_t i = 0; i < requests && r.good(); ++i) {
+      serve_request(r, w);
+    }
+    if (!r.good() || !r.done()) {
+      out.resize(start);
+      return false;
+    }
+    w.end_frame(start, requests);
+    return true;
+  }
+
+  void serve_request(reader &r, writer &w) {
+    const auto code = static_cast<op>(r.get8());
+    if (code == op::open) {
+      const std::string_view name = r.get_bytes(r.get16());
+      if (!r.good()) return;
+      auto it = names.find(name);
+      if (it == names.end()) {
+        it = names.emplace(std::string(name), queues.size()).first;
+        queues.emplace_back();
+      }
+      w.put8(static_cast<std::uint8_t>(status::ok));
+      w.put32(it->second);
+      return;
+    }
+
+    const std::uint32_t handle = r.get32();
+    std::uint64_t key = 0;
+    std::string_view value;
+    switch (code) {
+      case op::push:
+        key = r.get64();
+        value = r.get_bytes(r.get32());
+        break;
+      case op::pop_key:
+      case op::move_to_back:
+      case op::count:
+        key = r.get64();
+        break;
+      case op::pop:
+      case op::size:
+        break;
+      default:
+        r.get_bytes(~std::size_t{0});  // Nieznana operacja psuje ramkę.
+    }
+    if (!r.good()) return;
+    if (handle >= queues.size()) {
+      fail(w, "no such queue");
+      return;
+    }
+
+    queue_t &q = queues[handle];
+    try {
+      switch (code) {
+        case op::push:
+          q.push(key, std::string(value));
+          w.put8(static_cast<std::uint8_t>(status::ok));
+          break;
+        case op::pop: {
+          if (q.empty()) throw std::invalid_argument("empty");
+          auto const &[k, v] = std::as_const(q).front();
+          std::string payload = v;
+          const std::uint64_t popped = k;
+          q.pop();
+          w.put8(static_cast<std::uint8_t>(status::ok));
+          w.put64(popped);
+          put_value(w, payload);
+          break;
+        }
+        case op::pop_key: {
+          if (q.count(key) == 0) throw std::invalid_argument("key missing");
+          std::string payload = std::as_const(q).first(key).second;
+          q.pop(key);
+          w.put8(static_cast<std::uint8_t>(status::ok));
+          put_value(w, payload);
+          break;
+        }
+        case op::move_to_back:
+          q.move_to_back(key);
+          w.put8(static_cast<std::uint8_t>(status::ok));
+          break;
+        case op::count:
+          w.put8(static_cast<std::uint8_t>(status::ok));
+          w.put64(q.count(key));
+          break;
+        default:
+          w.put8(static_cast<std::uint8_t>(status::ok));
+          w.put64(q.size());
+      }
+    } catch (std::invalid_argument const &e) {
+      fail(w, e.what());
+    }
+  }
+
+  static void put_value(writer &w, std::string const &value) {
+    w.put32(static_cast<std::uint32_t>(value.size()));
+    w.put_bytes(value);
+  }
+
+  static void fail(writer &w, std::string_view message) {
+    w.put8(static_cast<std::uint8_t>(status::error));
+    w.put16(static_cast<std::uint16_t>(message.size()));
+    w.put_bytes(message);
+  }
+
+  std::map<std::string, std::uint32_t, std::less<>> names;
+  std::deque<queue_t> queues;
+};
+
+[[noreturn]] void die(char const *what) {
+  std::perror(what);
+  std::exit(1);
+}
+
+void set_nonblocking(int fd) {
+  if (::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+    die("fcntl");
+  }
+}
+
+int listen_unix(char const *path) {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (std::strlen(path) >= sizeof(addr.sun_path)) {
+    std::fprintf(stderr, "socket path too long\n");
+    std::exit(2);
+  }
+  std::strcpy(addr.sun_path, path);
+  const int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) die("socket");
+  ::unlink(path);
+  if (::bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+    die("bind");
+  }
+  return fd;
+}
+
+int listen_tcp(int port) {
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(static_cast<std::uint16_t>(port));
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  const int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) die("socket");
+  const int on = 1;
+  ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if (::bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+    die("bind");
+  }
+  return fd;
+}
+
+// Czyta z c, co jest dostępne, ale tylko dopóki c.in może nie zawierać
+// pełnej ramki. Koniec danych od klienta zaznacza w c.eof. Zwraca false,
+// gdy wystąpił błąd.
+bool receive(connection &c) {
+  char buf[1 << 16];
+  while (c.in.size() < 4 + std::size_t{max_frame}) {
+    const ssize_t n = ::read(c.fd, buf, sizeof(buf));
+    if (n > 0) {
+      c.in.append(buf, n);
+    } else if (n == 0) {
+      c.eof = true;
+      return true;
+    } else {
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+  }
+  return true;
+}
+
+// Wysyła, ile się da, z c.out.
+bool transmit(connection &c) {
+  while (c.sent < c.out.size()) {
+    const ssize_t n =
+        ::send(c.fd, c.out.data() + c.sent, c.out.size() - c.sent,
+               MSG_NOSIGNAL);
+    if (n < 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+    c.sent += n;
+  }
+  c.out.clear();
+  c.sent = 0;
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  char const *path = "kvfifo.sock";
+  int port = 0;
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--unix") == 0 && i + 1 < argc) {
+      path = argv[++i];
+    } else if (std::strcmp(argv[i], "--tcp") == 0 && i + 1 < argc) {
+      port = std::atoi(argv[++i]);
+    } else {
+      std::fprintf(stderr, "usage: %s [--unix path | --tcp port]\n",
+                   argv[0]);
+      return 2;
+    }
+  }
+
+  struct sigaction action{};
+  action.sa_handler = stop;
+  ::sigaction(SIGINT, &action, nullptr);
+  ::sigaction(SIGTERM, &action, nullptr);
+
+  const int listener = port > 0 ? listen_tcp(port) : listen_unix(path);
+  if (::listen(listener, SOMAXCONN) < 0) die("listen");
+  set_nonblocking(listener);
+  if (port > 0) {
+    std::printf("listening on 127.0.0.1:%d\n", port);
+  } else {
+    std::printf("listening on %s\n", path);
+  }
+  std::fflush(stdout);
+
+  server s;
+  std::vector<std::unique_ptr<connection>> connections;
+  std::vector<pollfd> fds;
+  while (!stopping) {
+    fds.assign(1, pollfd{listener, POLLIN, 0});
+    for (auto const &c : connections) {
+      // Nie czytamy od klienta, który skończył wysyłać, ani od takiego, który
+      // nie odbiera odpowiedzi: wtedy out rosłoby bez ograniczeń.
+      short events = c->out.empty() ? 0 : POLLOUT;
+      if (!c->eof && c->out.size() - c->sent <= max_frame) events |= POLLIN;
+      fds.push_back({c->fd, events, 0});
+    }
+    if (::poll(fds.data(), fds.size(), -1) < 0) {
+      if (errno == EINTR) continue;
+      die("poll");
+    }
+
+    // Nowe połączenia dołączają na koniec, więc fds[i + 1] odpowiada
+    // connections[i] dla wszystkich starych połączeń.
+    const std::size_t old = connections.size();
+    if (fds[0].revents & POLLIN) {
+      for (int fd; (fd = ::accept(listener, nullptr, nullptr)) >= 0;) {
+        set_nonblocking(fd);
+        if (port > 0) {
+          const int on = 1;
+          ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        }
+        connections.push_back(std::make_unique<connection>(fd));
+      }
+    }
+    std::vector<bool> closed(connections.size(), false);
+    for (std::size_t i = 0; i < old; ++i) {
+      connection &c = *connections[i];
+      const short events = fds[i + 1].revents;
+      bool alive = c.eof || !(events & (POLLIN | POLLHUP | POLLERR)) ||
+                   receive(c);
+      alive = alive && s.serve(c);
+      if (alive && !c.out.empty()) alive = transmit(c);
+      // Klient, który wysłał żądania i zamknął swoją stronę, dostaje jeszcze
+      // wszystkie odpowiedzi, więc zamykamy połączenie dopiero po nich.
+      closed[i] = !alive || (c.eof && c.out.empty());
+    }
+    std::size_t kept = 0;
+    for (std::size_t i = 0; i < connections.size(); ++i) {
+      if (!closed[i]) connections[kept++] = std::move(connections[i]);
+    }
+    connections.resize(kept);
+  }
+
+  connections.clear();
+  ::close(listener);
+  if (port == 0) ::unlink(path);
+}
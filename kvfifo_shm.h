@@ -0,0 +1,451 @@
+#ifndef KVFIFO_SHM_H
+#define KVFIFO_SHM_H
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+// Kolejka z operacjami kvfifo w pamięci współdzielonej POSIX (shm_open), do
+// przekazywania elementów między procesami na jednym komputerze: push
+// w jednym procesie zapisuje element prosto w segmencie, z którego czyta
+// pop w drugim, bez serializacji i kopiowania przez jądro.
+//
+// Segment ma stałą pojemność (liczbę elementów) ustaloną przy tworzeniu,
+// a K i V muszą być trywialnie kopiowalne, bo w segmencie nie może być
+// wskaźników do prywatnej pamięci procesu. Z tego samego powodu segment,
+// mapowany w każdym procesie pod innym adresem, zamiast wskaźników trzyma
+// numery elementów w swoich tablicach (przesunięcia względem ich początku).
+//
+// Struktura jak w kvfifo_simple: elementy na liście dwukierunkowej
+// w kolejności kolejki, a klucze w drzewie (treap) z łańcuchem elementów
+// każdego klucza. Usuwany jest zawsze najstarszy element klucza, więc
+// łańcuch jest jednokierunkowy. Wolne elementy i węzły kluczy czekają na
+// listach wolnych, więc po utworzeniu segmentu nic nie jest alokowane.
+//
+// Każda operacja bierze blokadę: mutex współdzielony między procesami,
+// odporny na śmierć posiadacza. Jeśli proces zginie w trakcie operacji,
+// segment jest oznaczany jako uszkodzony i kolejne operacje zgłaszają
+// std::runtime_error (nie wiadomo, w jakim stanie zostały dane).
+template <typename K, typename V>
+class shm_kvfifo {
+  static_assert(std::is_trivially_copyable_v<K> &&
+                    std::is_trivially_copyable_v<V>,
+                "shm_kvfifo needs trivially copyable keys and values");
+
+  using index_t = std::uint32_t;
+  static constexpr index_t none = ~index_t{0};
+  static constexpr std::uint64_t magic = 0x3148534D4F464946;  // "FIFOMSH1"
+  static constexpr std::uint32_t version = 1;
+
+  struct entry {
+    V value;
+    // Węzeł klucza, sąsiedzi w kolejce (next łączy też wolne elementy)
+    // i następny element o tym samym kluczu.
+    index_t key, prev, next, next_at_key;
+  };
+
+  struct key_node {
+    K key;
+    // Dzieci w drzewie (left łączy też wolne węzły) i priorytet kopca.
+    index_t left, right;
+    std::uint32_t priority;
+    // Łańcuch elementów klucza, od najstarszego.
+    index_t first, last;
+    std::uint32_t count;
+  };
+
+  struct header {
+    // Zapisywane na końcu tworzenia segmentu.
+    std::atomic<std::uint64_t> ready;
+    std::uint32_t version, key_size, value_size, capacity;
+    pthread_mutex_t lock;
+    std::uint32_t broken;
+    index_t size, head, tail, free_entries, free_keys, root;
+    // Stan generatora priorytetów (xorshift).
+    std::uint32_t seed;
+  };
+
+  static constexpr std::size_t align_up(std::size_t n, std::size_t a) {
+    return (n + a - 1) / a * a;
+  }
+  static constexpr std::size_t entries_offset() {
+    return align_up(sizeof(header), alignof(entry));
+  }
+  static constexpr std::size_t keys_offset(std::size_t capacity) {
+    return align_up(entries_offset() + capacity * sizeof(entry),
+                    alignof(key_node));
+  }
+
+  // Trzyma blokadę segmentu do końca zakresu.
+  class guard {
+   public:
+    explicit guard(header &h_) : h(h_) {
+      const int result = pthread_mutex_lock(&h.lock);
+      if (result == EOWNERDEAD) {
+        h.broken = 1;
+        pthread_mutex_consistent(&h.lock);
+      } else if (result != 0) {
+        throw std::system_error(result, std::generic_category(),
+                                "pthread_mutex_lock");
+      }
+      if (h.broken != 0) {
+        pthread_mutex_unlock(&h.lock);
+        throw std::runtime_error(
+            "shm_kvfifo: a process died while holding the lock");
+      }
+    }
+    guard(guard const &) = delete;
+    guard &operator=(guard const &) = delete;
+    ~guard() { pthread_mutex_unlock(&h.lock); }
+
+   private:
+    header &h;
+  };
+
+ public:
+  // Rozmiar segmentu dla danej pojemności.
+  static constexpr std::size_t segment_bytes(std::size_t capacity) {
+    return keys_offset(capacity) + capacity * sizeof(key_node);
+  }
+
+  // Tworzy segment name (nazwa dla shm_open, np. "/kolejka") na capacity
+  // elementów. Zgłasza std::system_error, jeśli segment już istnieje albo
+  // nie da się go utworzyć.
+  static shm_kvfifo create(char const *name, std::size_t capacity) {
+    if (capacity == 0 || capacity >= none) {
+      throw std::invalid_argument("bad capacity");
+    }
+    const int fd = ::shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) throw_errno("shm_open");
+    const std::size_t bytes = segment_bytes(capacity);
+    if (::ftruncate(fd, static_cast<off_t>(bytes)) != 0) {
+      const int error = errno;
+      ::close(fd);
+      ::shm_unlink(name);
+      throw std::system_error(error, std::generic_category(), "ftruncate");
+    }
+    void *base = map(fd, bytes);
+    if (base == nullptr) {
+      const int error = errno;
+      ::shm_unlink(name);
+      throw std::system_error(error, std::generic_category(), "mmap");
+    }
+    shm_kvfifo result(base, bytes);
+    const int error = result.init(capacity);
+    if (error != 0) {
+      ::shm_unlink(name);
+      throw std::system_error(error, std::generic_category(),
+                              "pthread_mutex_init");
+    }
+    return result;
+  }
+
+  // Dołącza do segmentu utworzonego przez create (także w innym procesie).
+  // Zgłasza std::invalid_argument, jeśli segment nie jest (jeszcze) kolejką
+  // z tymi samymi rozmiarami K i V.
+  static shm_kvfifo open(char const *name) {
+    const int fd = ::shm_open(name, O_RDWR, 0);
+    if (fd < 0) throw_errno("shm_open");
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+      const int error = errno;
+      ::close(fd);
+      throw std::system_error(error, std::generic_category(), "fstat");
+    }
+    const auto bytes = static_cast<std::size_t>(st.st_size);
+    if (bytes < sizeof(header)) {
+      ::close(fd);
+      throw std::invalid_argument("not a shm_kvfifo segment");
+    }
+    void *base = map(fd, bytes);
+    if (base == nullptr) throw_errno("mmap");
+    shm_kvfifo result(base, bytes);
+    header const &h = *result.h;
+    if (h.ready.load(std::memory_order_acquire) != magic ||
+        h.version != version || h.key_size != sizeof(K) ||
+        h.value_size != sizeof(V) || segment_bytes(h.capacity) > bytes) {
+      throw std::invalid_argument("not a shm_kvfifo segment");
+    }
+    result.locate(h.capacity);
+    return result;
+  }
+
+  // Usuwa nazwę segmentu. Procesy, które go mają, mogą go dalej używać.
+  static bool remove(char const *name) noexcept {
+    return ::shm_unlink(name) == 0;
+  }
+
+  shm_kvfifo(shm_kvfifo &&that) noexcept
+      : base(std::exchange(that.base, nullptr)),
+        bytes(that.bytes),
+        h(that.h),
+        entries(that.entries),
+        keys(that.keys) {}
+  shm_kvfifo &operator=(shm_kvfifo that) noexcept {
+    std::swap(base, that.base);
+    std::swap(bytes, that.bytes);
+    std::swap(h, that.h);
+    std::swap(entries, that.entries);
+    std::swap(keys, that.keys);
+    return *this;
+  }
+  ~shm_kvfifo() {
+    if (base != nullptr) ::munmap(base, bytes);
+  }
+
+  // Zgłasza std::length_error, jeśli kolejka jest pełna. Złożoność
+  // O(log d) dla d różnych kluczy (oczekiwana).
+  void push(K const &k, V const &v) {
+    guard locked(*h);
+    if (h->free_entries == none) throw std::length_error("shm_kvfifo full");
+
+    // Dalej bez wyjątków.
+
+    index_t key = find(k);
+    if (key == none) {
+      key = h->free_keys;
+      h->free_keys = keys[key].left;
+      std::construct_at(&keys[key],
+                        key_node{k, none, none, next_priority(), none, none,
+                                 0});
+      insert_key(key);
+    }
+    const index_t e = h->free_entries;
+    h->free_entries = entries[e].next;
+    std::construct_at(&entries[e], entry{v, key, h->tail, none, none});
+    if (h->tail == none) {
+      h->head = e;
+    } else {
+      entries[h->tail].next = e;
+    }
+    h->tail = e;
+    key_node &chain = keys[key];
+    if (chain.count == 0) {
+      chain.first = e;
+    } else {
+      entries[chain.last].next_at_key = e;
+    }
+    chain.last = e;
+    ++chain.count;
+    ++h->size;
+  }
+
+  // Jak w kvfifo: zgłaszają std::invalid_argument, jeśli kolejka jest pusta
+  // albo nie ma w niej klucza k. Złożoność O(log d).
+  void pop() {
+    guard locked(*h);
+    if (h->size == 0) throw std::invalid_argument("empty");
+    erase(h->head);
+  }
+
+  void pop(K const &k) {
+    guard locked(*h);
+    const index_t key = find(k);
+    if (key == none) throw std::invalid_argument("key missing");
+    erase(keys[key].first);
+  }
+
+  // Kopie elementów (referencje do segmentu byłyby ważne tylko pod
+  // blokadą). Wyjątki jak w pop.
+  std::pair<K, V> front() const {
+    guard locked(*h);
+    if (h->size == 0) throw std::invalid_argument("empty");
+    return as_pair(h->head);
+  }
+  std::pair<K, V> back() const {
+    guard locked(*h);
+    if (h->size == 0) throw std::invalid_argument("empty");
+    return as_pair(h->tail);
+  }
+  std::pair<K, V> first(K const &k) const {
+    guard locked(*h);
+    const index_t key = find(k);
+    if (key == none) throw std::invalid_argument("key missing");
+    return as_pair(keys[key].first);
+  }
+  std::pair<K, V> last(K const &k) const {
+    guard locked(*h);
+    const index_t key = find(k);
+    if (key == none) throw std::invalid_argument("key missing");
+    return as_pair(keys[key].last);
+  }
+
+  std::size_t count(K const &k) const {
+    guard locked(*h);
+    const index_t key = find(k);
+    return key == none ? 0 : keys[key].count;
+  }
+
+  std::size_t size() const {
+    guard locked(*h);
+    return h->size;
+  }
+  bool empty() const { return size() == 0; }
+  bool full() const { return size() == capacity(); }
+  std::size_t capacity() const noexcept { return h->capacity; }
+
+ private:
+  shm_kvfifo(void *base_, std::size_t bytes_) noexcept
+      : base(base_), bytes(bytes_), h(static_cast<header *>(base_)) {}
+
+  [[noreturn]] static void throw_errno(char const *what) {
+    throw std::system_error(errno, std::generic_category(), what);
+  }
+
+  // Mapuje fd i go zamyka. nullptr (z errno) przy błędzie.
+  static void *map(int fd, std::size_t bytes) noexcept {
+    void *base =
+        ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    const int error = errno;
+    ::close(fd);
+    errno = error;
+    return base == MAP_FAILED ? nullptr : base;
+  }
+
+  void locate(std::size_t capacity) noexcept {
+    auto *bytes_ = static_cast<unsigned char *>(base);
+    entries = reinterpret_cast<entry *>(bytes_ + entries_offset());
+    keys = reinterpret_cast<key_node *>(bytes_ + keys_offset(capacity));
+  }
+
+  // Przygotowuje świeży (wyzerowany) segment. Zwraca kod błędu
+  // pthread_mutex_init.
+  int init(std::size_t capacity) noexcept {
+    locate(capacity);
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+    const int error = pthread_mutex_init(&h->lock, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+    if (error != 0) return error;
+    h->version = version;
+    h->key_size = sizeof(K);
+    h->value_size = sizeof(V);
+    h->capacity = static_cast<std::uint32_t>(capacity);
+    h->broken = 0;
+    h->size = 0;
+    h->head = h->tail = h->root = none;
+    for (index_t i = 0; i < capacity; ++i) {
+      entries[i].next = i + 1 < capacity ? i + 1 : none;
+      keys[i].left = i + 1 < capacity ? i + 1 : none;
+    }
+    h->free_entries = h->free_keys = 0;
+    h->seed = 2463534242u;
+    h->ready.store(magic, std::memory_order_release);
+    return 0;
+  }
+
+  std::uint32_t next_priority() noexcept {
+    std::uint32_t x = h->seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return h->seed = x;
+  }
+
+  std::pair<K, V> as_pair(index_t e) const noexcept {
+    return {keys[entries[e].key].key, entries[e].value};
+  }
+
+  index_t find(K const &k) const noexcept {
+    index_t t = h->root;
+    while (t != none) {
+      if (k < keys[t].key) {
+        t = keys[t].left;
+      } else if (keys[t].key < k) {
+        t = keys[t].right;
+      } else {
+        break;
+      }
+    }
+    return t;
+  }
+
+  // Dzieli drzewo t na klucze mniejsze od k (l) i pozostałe (r).
+  void split(index_t t, K const &k, index_t &l, index_t &r) noexcept {
+    if (t == none) {
+      l = r = none;
+    } else if (keys[t].key < k) {
+      split(keys[t].right, k, keys[t].right, r);
+      l = t;
+    } else {
+      split(keys[t].left, k, l, keys[t].left);
+      r = t;
+    }
+  }
+
+  // Skleja drzewa, w których klucze l są mniejsze od kluczy r.
+  index_t merge(index_t l, index_t r) noexcept {
+    if (l == none) return r;
+    if (r == none) return l;
+    if (keys[l].priority > keys[r].priority) {
+      keys[l].right = merge(keys[l].right, r);
+      return l;
+    }
+    keys[r].left = merge(l, keys[r].left);
+    return r;
+  }
+
+  void insert_key(index_t node) noexcept {
+    index_t l, r;
+    split(h->root, keys[node].key, l, r);
+    h->root = merge(merge(l, node), r);
+  }
+
+  // Usuwa z drzewa t węzeł z kluczem k (który w nim jest) i zwraca go na
+  // listę wolnych.
+  void erase_key(index_t &t, K const &k) noexcept {
+    if (k < keys[t].key) return erase_key(keys[t].left, k);
+    if (keys[t].key < k) return erase_key(keys[t].right, k);
+    const index_t node = t;
+    t = merge(keys[node].left, keys[node].right);
+    keys[node].left = h->free_keys;
+    h->free_keys = node;
+  }
+
+  // Usuwa element e, najstarszy ze swojego klucza.
+  void erase(index_t e) noexcept {
+    entry &doomed = entries[e];
+    key_node &chain = keys[doomed.key];
+    chain.first = doomed.next_at_key;
+    --chain.count;
+    if (doomed.prev == none) {
+      h->head = doomed.next;
+    } else {
+      entries[doomed.prev].next = doomed.next;
+    }
+    if (doomed.next == none) {
+      h->tail = doomed.prev;
+    } else {
+      entries[doomed.next].prev = doomed.prev;
+    }
+    doomed.next = h->free_entries;
+    h->free_entries = e;
+    --h->size;
+    if (chain.count == 0) {
+      const K k = chain.key;
+      erase_key(h->root, k);
+    }
+  }
+
+  void *base = nullptr;
+  std::size_t bytes = 0;
+  header *h = nullptr;
+  entry *entries = nullptr;
+  key_node *keys = nullptr;
+};
+
+#endif  // KVFIFO_SHM_H
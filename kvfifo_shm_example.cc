@@ -0,0 +1,189 @@
+// Sprawdza shm_kvfifo: najpierw porównuje jej wyniki z kvfifo na losowych
+// operacjach w jednym procesie, potem przekazuje elementy z procesu
+// producenta (fork) do konsumenta przez wspólny segment i mierzy
+// przepustowość.
+//
+// Użycie: kvfifo_shm_example [liczba elementów]
+
+#include "kvfifo_shm.h"
+
+#include <sched.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <tuple>
+#include <vector>
+
+#include "kvfifo.h"
+
+namespace {
+
+struct message {
+  std::uint64_t sequence;
+  double payload;
+};
+
+using shm_queue = shm_kvfifo<int, message>;
+
+std::string segment_name(char const *what) {
+  return "/kvfifo_shm_example_" + std::to_string(::getpid()) + "_" + what;
+}
+
+template <typename F>
+bool throws(F f) {
+  try {
+    f();
+  } catch (std::invalid_argument const &) {
+    return true;
+  }
+  return false;
+}
+
+// Te same operacje na shm_kvfifo i kvfifo dają te same wyniki.
+void semantics_test() {
+  const auto name = segment_name("semantics");
+  auto shm = shm_queue::create(name.c_str(), 64);
+  kvfifo<int, message> reference;
+  [[maybe_unused]] const bool empty_throws = throws([&] { shm.pop(); }) &&
+                                            throws([&] { shm.pop(3); }) &&
+                                            throws([&] { shm.first(3); });
+  assert(empty_throws);
+
+  std::mt19937 rng(7);
+  for (std::uint64_t step = 0; step < 100000; ++step) {
+    const int k = static_cast<int>(rng() % 12);
+    switch (rng() % 4) {
+      case 0:
+      case 1:
+        if (!shm.full()) {
+          shm.push(k, {step, 0.5});
+          reference.push(k, {step, 0.5});
+        } else {
+          [[maybe_unused]] bool full = false;
+          try {
+            shm.push(k, {step, 0.5});
+          } catch (std::length_error const &) {
+            full = true;
+          }
+          assert(full);
+        }
+        break;
+      case 2: {
+        [[maybe_unused]] const bool thrown = throws([&] { shm.pop(); });
+        assert(thrown == reference.empty());
+        if (!reference.empty()) reference.pop();
+        break;
+      }
+      default: {
+        [[maybe_unused]] const bool thrown = throws([&] { shm.pop(k); });
+        assert(thrown == (reference.count(k) == 0));
+        if (reference.count(k) > 0) reference.pop(k);
+      }
+    }
+    assert(shm.size() == reference.size());
+    assert(shm.count(k) == reference.count(k));
+    if (reference.count(k) > 0) {
+      assert(shm.first(k).second.sequence ==
+             reference.first(k).second.sequence);
+      assert(shm.last(k).second.sequence == reference.last(k).second.sequence);
+    }
+    if (!reference.empty()) {
+      assert(shm.front().first == reference.front().first);
+      assert(shm.back().second.sequence == reference.back().second.sequence);
+    }
+  }
+
+  // Drugie otwarcie widzi te same dane.
+  auto again = shm_queue::open(name.c_str());
+  assert(again.size() == shm.size() && again.capacity() == 64);
+  [[maybe_unused]] const bool removed = shm_queue::remove(name.c_str());
+  assert(removed);
+  [[maybe_unused]] bool missing = false;
+  try {
+    shm_queue::open(name.c_str());
+  } catch (std::system_error const &) {
+    missing = true;
+  }
+  assert(missing);
+  std::cout << "Shm semantics test passed" << std::endl;
+}
+
+// Producent w osobnym procesie wstawia n elementów (klucze po kolei od 0 do
+// keys - 1), konsument zdejmuje je na przemian pop i pop(k) i sprawdza, że
+// elementy każdego klucza przychodzą po kolei.
+void cross_process_test(std::uint64_t n) {
+  constexpr int keys = 16;
+  const auto name = segment_name("pipe");
+  auto queue = shm_queue::create(name.c_str(), 4096);
+
+  const auto start = std::chrono::steady_clock::now();
+  const pid_t producer = ::fork();
+  if (producer < 0) throw std::system_error(errno, std::generic_category());
+  if (producer == 0) {
+    auto shm = shm_queue::open(name.c_str());
+    for (std::uint64_t i = 0; i < n;) {
+      try {
+        shm.push(static_cast<int>(i % keys), {i / keys, 1.0});
+        ++i;
+      } catch (std::length_error const &) {
+        ::sched_yield();
+      }
+    }
+    std::_Exit(0);
+  }
+
+  std::vector<std::uint64_t> expected(keys, 0);
+  std::uint64_t received = 0;
+  int k = 0;
+  while (received < n) {
+    if (queue.empty()) {
+      ::sched_yield();
+      continue;
+    }
+    // Co drugi element bierzemy według klucza, jeśli jest.
+    message m;
+    int key;
+    if (received % 2 == 0 || queue.count(k) == 0) {
+      std::tie(key, m) = queue.front();
+      queue.pop();
+    } else {
+      key = k;
+      m = queue.first(k).second;
+      queue.pop(k);
+    }
+    assert(m.sequence == expected[key]);
+    ++expected[key];
+    ++received;
+    k = (k + 1) % keys;
+  }
+  int status = 0;
+  ::waitpid(producer, &status, 0);
+  const double seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+          .count();
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  assert(queue.empty());
+  shm_queue::remove(name.c_str());
+  std::printf("%llu elements across processes in %.3f s, %.0f elements/s\n",
+              static_cast<unsigned long long>(n), seconds, n / seconds);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  const std::uint64_t n = argc > 1 ? std::strtoull(argv[1], nullptr, 10)
+                                   : 200000;
+  semantics_test();
+  cross_process_test(n);
+  std::cout << "All shm tests passed!" << std::endl;
+}
@@ -0,0 +1,431 @@
+#ifndef KVFIFO_STATIC_H
+#define KVFIFO_STATIC_H
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+// Kolejka z operacjami kvfifo o stałej pojemności N, trzymająca elementy
+// i indeks kluczy w tablicach wewnątrz obiektu: po konstrukcji żadna
+// operacja nie alokuje pamięci (o ile nie robią tego konstruktory
+// i przypisania K i V). Kopiowanie kopiuje całe tablice, bez współdzielenia
+// jak w kvfifo.
+//
+// Układ jak w shm_kvfifo: elementy na liście dwukierunkowej w kolejności
+// kolejki, połączone numerami w tablicy, i łańcuch elementów każdego
+// klucza, od najstarszego. Klucze są w drzewie AA (zrównoważonym, więc
+// koszt jest O(log d) dla d różnych kluczy w najgorszym przypadku, nie
+// tylko oczekiwany) i na liście w kolejności kluczy, po której chodzi
+// k_iterator. Wolne elementy i węzły kluczy czekają na listach wolnych.
+//
+// K i V muszą mieć konstruktory domyślne, bo tablice trzymają wartości we
+// wszystkich miejscach, także wolnych. Zwolnione miejsca dostają wartość
+// domyślną (żeby oddać np. pamięć napisu) tylko wtedy, gdy jej utworzenie
+// i przypisanie nie zgłaszają wyjątków; inaczej stara wartość zostaje do
+// czasu ponownego użycia miejsca. Wszystkie operacje są constexpr,
+// więc kolejki można używać w wyrażeniach stałych, jeśli pozwalają na to
+// K i V.
+template <typename K, typename V, std::size_t N>
+class static_kvfifo {
+  static_assert(N > 0 && N < 0xffffffff, "static_kvfifo capacity");
+  static_assert(std::is_default_constructible_v<K> &&
+                    std::is_default_constructible_v<V>,
+                "static_kvfifo needs default constructible keys and values");
+
+  // Dla małych kolejek krótsze numery, żeby elementy zajmowały mniej
+  // miejsca.
+  using index_t =
+      std::conditional_t<(N < 0xffff), std::uint16_t, std::uint32_t>;
+  static constexpr index_t none = static_cast<index_t>(~index_t{0});
+
+  struct entry {
+    V value{};
+    // Węzeł klucza, sąsiedzi w kolejce (next łączy też wolne elementy)
+    // i następny element o tym samym kluczu.
+    index_t key = none, prev = none, next = none, next_at_key = none;
+  };
+
+  struct key_node {
+    K key{};
+    // Dzieci w drzewie (left łączy też wolne węzły), poziom w drzewie AA
+    // i sąsiednie klucze w kolejności kluczy.
+    index_t left = none, right = none, level = 0;
+    index_t lower = none, higher = none;
+    // Łańcuch elementów klucza, od najstarszego.
+    index_t first = none, last = none;
+    index_t count = 0;
+  };
+
+ public:
+  class k_iterator {
+   public:
+    using iterator_category = std::bidirectional_iterator_tag;
+    using value_type = K;
+    using difference_type = std::ptrdiff_t;
+    using pointer = K const *;
+    using reference = K const &;
+
+    constexpr k_iterator() noexcept = default;
+
+    constexpr reference operator*() const noexcept {
+      return queue->keys[node].key;
+    }
+    constexpr pointer operator->() const noexcept { return &**this; }
+
+    constexpr k_iterator &operator++() noexcept {
+      node = queue->keys[node].higher;
+      return *this;
+    }
+    constexpr k_iterator operator++(int) noexcept {
+      k_iterator old = *this;
+      ++*this;
+      return old;
+    }
+    // Cofnięcie k_end() daje największy klucz.
+    constexpr k_iterator &operator--() noexcept {
+      node = node == none ? queue->highest : queue->keys[node].lower;
+      return *this;
+    }
+    constexpr k_iterator operator--(int) noexcept {
+      k_iterator old = *this;
+      --*this;
+      return old;
+    }
+
+    friend constexpr bool operator==(k_iterator const &a,
+                                     k_iterator const &b) noexcept {
+      return a.node == b.node;
+    }
+
+   private:
+    friend class static_kvfifo;
+    constexpr k_iterator(static_kvfifo const *queue_, index_t node_) noexcept
+        : queue(queue_), node(node_) {}
+
+    static_kvfifo const *queue = nullptr;
+    index_t node = none;
+  };
+
+  constexpr static_kvfifo() noexcept(
+      std::is_nothrow_default_constructible_v<K> &&
+      std::is_nothrow_default_constructible_v<V>) {
+    link_free();
+  }
+
+  // Zgłasza std::length_error, jeśli kolejka jest pełna. Złożoność
+  // O(log d) dla d różnych kluczy.
+  constexpr void push(K const &k, V const &v) {
+    if (size_ == N) throw std::length_error("static_kvfifo full");
+    index_t key = find(k);
+    const bool fresh = key == none;
+    if (fresh) {
+      key = free_keys;
+      keys[key].key = k;
+    }
+    const index_t e = free_entries;
+    entries[e].value = v;
+
+    // Dalej bez wyjątków.
+
+    if (fresh) {
+      free_keys = keys[key].left;
+      insert_key(key);
+    }
+    free_entries = entries[e].next;
+    entries[e].key = key;
+    entries[e].next_at_key = none;
+    append(e);
+    key_node &chain = keys[key];
+    if (chain.count == 0) {
+      chain.first = e;
+    } else {
+      entries[chain.last].next_at_key = e;
+    }
+    chain.last = e;
+    ++chain.count;
+    ++size_;
+  }
+
+  // Jak w kvfifo: zgłaszają std::invalid_argument, jeśli kolejka jest pusta
+  // albo nie ma w niej klucza k. Złożoność O(log d).
+  constexpr void pop() {
+    if (size_ == 0) throw std::invalid_argument("empty");
+    erase(head);
+  }
+
+  constexpr void pop(K const &k) { erase(keys[existing(k)].first); }
+
+  // Przenosi elementy klucza k na koniec kolejki, zachowując ich kolejność.
+  // Złożoność O(m + log d) dla m elementów klucza k.
+  constexpr void move_to_back(K const &k) {
+    const index_t key = existing(k);
+    for (index_t e = keys[key].first; e != none; e = entries[e].next_at_key) {
+      unlink(e);
+      append(e);
+    }
+  }
+
+  constexpr std::pair<K const &, V &> front() {
+    if (size_ == 0) throw std::invalid_argument("empty");
+    return as_pair(head);
+  }
+  constexpr std::pair<K const &, V const &> front() const {
+    if (size_ == 0) throw std::invalid_argument("empty");
+    return as_pair(head);
+  }
+  constexpr std::pair<K const &, V &> back() {
+    if (size_ == 0) throw std::invalid_argument("empty");
+    return as_pair(tail);
+  }
+  constexpr std::pair<K const &, V const &> back() const {
+    if (size_ == 0) throw std::invalid_argument("empty");
+    return as_pair(tail);
+  }
+  constexpr std::pair<K const &, V &> first(K const &k) {
+    return as_pair(keys[existing(k)].first);
+  }
+  constexpr std::pair<K const &, V const &> first(K const &k) const {
+    return as_pair(keys[existing(k)].first);
+  }
+  constexpr std::pair<K const &, V &> last(K const &k) {
+    return as_pair(keys[existing(k)].last);
+  }
+  constexpr std::pair<K const &, V const &> last(K const &k) const {
+    return as_pair(keys[existing(k)].last);
+  }
+
+  constexpr std::size_t count(K const &k) const {
+    const index_t key = find(k);
+    return key == none ? 0 : keys[key].count;
+  }
+
+  constexpr std::size_t size() const noexcept { return size_; }
+  constexpr bool empty() const noexcept { return size_ == 0; }
+  constexpr bool full() const noexcept { return size_ == N; }
+  static constexpr std::size_t capacity() noexcept { return N; }
+
+  // Złożoność O(n).
+  constexpr void clear() {
+    for (index_t e = head; e != none; e = entries[e].next) {
+      release(entries[e].value);
+    }
+    for (index_t key = lowest; key != none; key = keys[key].higher) {
+      release(keys[key].key);
+    }
+    link_free();
+  }
+
+  constexpr k_iterator k_begin() const noexcept { return {this, lowest}; }
+  constexpr k_iterator k_end() const noexcept { return {this, none}; }
+
+ private:
+  // Ustawia pustą kolejkę ze wszystkimi miejscami na listach wolnych.
+  constexpr void link_free() noexcept {
+    for (std::size_t i = 0; i < N; ++i) {
+      entries[i].next = static_cast<index_t>(i + 1 < N ? i + 1 : none);
+      keys[i].left = static_cast<index_t>(i + 1 < N ? i + 1 : none);
+    }
+    free_entries = free_keys = 0;
+    head = tail = root = lowest = highest = none;
+    size_ = 0;
+  }
+
+  // Zwalnia zasoby wartości z wolnego miejsca (dla typów, które je mają).
+  // Wołane z operacji noexcept, więc pomija typy, dla których mogłoby to
+  // zgłosić wyjątek.
+  template <typename T>
+  static constexpr void release(T &slot) noexcept {
+    if constexpr (!std::is_trivially_destructible_v<T> &&
+                  std::is_nothrow_default_constructible_v<T> &&
+                  std::is_nothrow_move_assignable_v<T>) {
+      slot = T();
+    }
+  }
+
+  constexpr std::pair<K const &, V &> as_pair(index_t e) noexcept {
+    return {keys[entries[e].key].key, entries[e].value};
+  }
+  constexpr std::pair<K const &, V const &> as_pair(
+      index_t e) const noexcept {
+    return {keys[entries[e].key].key, entries[e].value};
+  }
+
+  constexpr index_t find(K const &k) const {
+    index_t t = root;
+    while (t != none) {
+      if (k < keys[t].key) {
+        t = keys[t].left;
+      } else if (keys[t].key < k) {
+        t = keys[t].right;
+      } else {
+        break;
+      }
+    }
+    return t;
+  }
+
+  // Węzeł klucza k; zgłasza std::invalid_argument, jeśli go nie ma.
+  constexpr index_t existing(K const &k) const {
+    const index_t key = find(k);
+    if (key == none) throw std::invalid_argument("key missing");
+    return key;
+  }
+
+  constexpr index_t level(index_t t) const noexcept {
+    return t == none ? 0 : keys[t].level;
+  }
+
+  // Obroty drzewa AA: skew usuwa lewe poziome krawędzie, split podwójne
+  // prawe.
+  constexpr index_t skew(index_t t) noexcept {
+    if (t == none || keys[t].left == none) return t;
+    const index_t l = keys[t].left;
+    if (keys[l].level != keys[t].level) return t;
+    keys[t].left = keys[l].right;
+    keys[l].right = t;
+    return l;
+  }
+  constexpr index_t split(index_t t) noexcept {
+    if (t == none || keys[t].right == none) return t;
+    const index_t r = keys[t].right;
+    if (level(keys[r].right) != keys[t].level) return t;
+    keys[t].right = keys[r].left;
+    keys[r].left = t;
+    ++keys[r].level;
+    return r;
+  }
+
+  // Wstawia do drzewa i na listę kluczy węzeł node, którego klucza w nich
+  // nie ma.
+  constexpr void insert_key(index_t node) noexcept {
+    key_node &n = keys[node];
+    n.left = n.right = none;
+    n.level = 1;
+    n.count = 0;
+    // Sąsiedzi w kolejności kluczy to ostatnie węzły, przy których zejście
+    // poszło w prawo i w lewo.
+    n.lower = n.higher = none;
+    for (index_t t = root; t != none;) {
+      if (n.key < keys[t].key) {
+        n.higher = t;
+        t = keys[t].left;
+      } else {
+        n.lower = t;
+        t = keys[t].right;
+      }
+    }
+    (n.lower == none ? lowest : keys[n.lower].higher) = node;
+    (n.higher == none ? highest : keys[n.higher].lower) = node;
+    root = insert_node(root, node);
+  }
+
+  constexpr index_t insert_node(index_t t, index_t node) noexcept {
+    if (t == none) return node;
+    if (keys[node].key < keys[t].key) {
+      keys[t].left = insert_node(keys[t].left, node);
+    } else {
+      keys[t].right = insert_node(keys[t].right, node);
+    }
+    return split(skew(t));
+  }
+
+  // Usuwa z drzewa t węzeł node i zwraca nowy korzeń t.
+  constexpr index_t erase_node(index_t t, index_t node) noexcept {
+    if (t != node) {
+      if (keys[node].key < keys[t].key) {
+        keys[t].left = erase_node(keys[t].left, node);
+      } else {
+        keys[t].right = erase_node(keys[t].right, node);
+      }
+    } else if (keys[t].left == none && keys[t].right == none) {
+      return none;
+    } else {
+      // Węzeł wewnętrzny zastępujemy jego poprzednikiem albo następnikiem
+      // (liściem), przepinając dzieci, bo elementy pamiętają numery węzłów
+      // swoich kluczy.
+      const index_t next =
+          keys[t].left == none ? keys[t].higher : keys[t].lower;
+      if (keys[t].left == none) {
+        keys[t].right = erase_node(keys[t].right, next);
+      } else {
+        keys[t].left = erase_node(keys[t].left, next);
+      }
+      keys[next].left = keys[t].left;
+      keys[next].right = keys[t].right;
+      keys[next].level = keys[t].level;
+      t = next;
+    }
+
+    // Wyrównanie poziomów po usunięciu.
+    const index_t should = static_cast<index_t>(
+        std::min(level(keys[t].left), level(keys[t].right)) + 1);
+    if (should < keys[t].level) {
+      keys[t].level = should;
+      if (index_t r = keys[t].right; r != none && should < keys[r].level) {
+        keys[r].level = should;
+      }
+    }
+    t = skew(t);
+    keys[t].right = skew(keys[t].right);
+    if (index_t r = keys[t].right; r != none) {
+      keys[r].right = skew(keys[r].right);
+    }
+    t = split(t);
+    keys[t].right = split(keys[t].right);
+    return t;
+  }
+
+  // Zdejmuje węzeł node z drzewa i listy kluczy i zwraca go na listę
+  // wolnych.
+  constexpr void erase_key(index_t node) noexcept {
+    root = erase_node(root, node);
+    key_node &n = keys[node];
+    (n.lower == none ? lowest : keys[n.lower].higher) = n.higher;
+    (n.higher == none ? highest : keys[n.higher].lower) = n.lower;
+    release(n.key);
+    n.left = free_keys;
+    free_keys = node;
+  }
+
+  constexpr void append(index_t e) noexcept {
+    entries[e].prev = tail;
+    entries[e].next = none;
+    (tail == none ? head : entries[tail].next) = e;
+    tail = e;
+  }
+
+  constexpr void unlink(index_t e) noexcept {
+    entry &x = entries[e];
+    (x.prev == none ? head : entries[x.prev].next) = x.next;
+    (x.next == none ? tail : entries[x.next].prev) = x.prev;
+  }
+
+  // Usuwa element e, najstarszy ze swojego klucza.
+  constexpr void erase(index_t e) noexcept {
+    entry &doomed = entries[e];
+    key_node &chain = keys[doomed.key];
+    chain.first = doomed.next_at_key;
+    --chain.count;
+    unlink(e);
+    release(doomed.value);
+    doomed.next = free_entries;
+    free_entries = e;
+    --size_;
+    if (chain.count == 0) erase_key(doomed.key);
+  }
+
+  std::array<entry, N> entries{};
+  std::array<key_node, N> keys{};
+  index_t free_entries = 0, free_keys = 0;
+  index_t head = none, tail = none, root = none;
+  // Najmniejszy i największy klucz.
+  index_t lowest = none, highest = none;
+  std::size_t size_ = 0;
+};
+
+#endif  // KVFIFO_STATIC_H
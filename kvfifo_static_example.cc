@@ -0,0 +1,304 @@
+// Sprawdza static_kvfifo: porównuje jej wyniki z kvfifo na losowych
+// operacjach, sprawdza, że operacje nie alokują pamięci i że kolejka działa
+// w wyrażeniach stałych, a na koniec porównuje czas tej samej mieszanki
+// operacji na obu kolejkach.
+//
+// Użycie: kvfifo_static_example [liczba operacji]
+
+#include "kvfifo_static.h"
+
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <iterator>
+#include <new>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "kvfifo.h"
+
+namespace {
+
+std::size_t allocations = 0;
+
+}  // namespace
+
+// Wszystkie zwykłe formy operatorów new i delete (także tablicowe
+// i z wyrównaniem), żeby liczenie obejmowało każdą alokację, a pamięć była
+// zwalniana funkcją pasującą do tej, która ją przydzieliła.
+namespace {
+
+void *allocate(std::size_t size, std::size_t alignment) {
+  ++allocations;
+  size = size == 0 ? 1 : size;
+  void *p = nullptr;
+  if (alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+    p = std::malloc(size);
+  } else if (::posix_memalign(&p, alignment, size) != 0) {
+    p = nullptr;
+  }
+  if (p == nullptr) throw std::bad_alloc();
+  return p;
+}
+
+}  // namespace
+
+void *operator new(std::size_t size) {
+  return allocate(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+void *operator new[](std::size_t size) {
+  return allocate(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+void *operator new(std::size_t size, std::align_val_t alignment) {
+  return allocate(size, static_cast<std::size_t>(alignment));
+}
+void *operator new[](std::size_t size, std::align_val_t alignment) {
+  return allocate(size, static_cast<std::size_t>(alignment));
+}
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void *p, std::size_t) noexcept { std::free(p); }
+void operator delete(void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t, std::align_val_t) noexcept {
+  std::free(p);
+}
+void operator delete[](void *p, std::size_t, std::align_val_t) noexcept {
+  std::free(p);
+}
+
+namespace {
+
+template <typename F>
+bool throws(F f) {
+  try {
+    f();
+  } catch (std::invalid_argument const &) {
+    return true;
+  }
+  return false;
+}
+
+// Kolejka w wyrażeniu stałym: zwraca klucze w kolejności zdejmowania.
+constexpr int constant_queue() {
+  static_kvfifo<int, int, 8> q;
+  q.push(3, 30);
+  q.push(1, 10);
+  q.push(3, 31);
+  q.push(2, 20);
+  q.move_to_back(3);
+  q.front().second += 1;
+  int keys = 0;
+  for (auto it = q.k_begin(); it != q.k_end(); ++it) keys = keys * 10 + *it;
+  int sum = q.first(3).second + q.last(3).second;  // 61
+  q.pop(3);
+  auto copy = q;
+  copy.clear();
+  int order = 0;
+  while (!q.empty()) {
+    order = order * 10 + q.front().first;
+    q.pop();
+  }
+  return keys * 1000000 + order * 1000 + sum + (copy.empty() ? 0 : 1);
+}
+static_assert(constant_queue() == 123 * 1000000 + 123 * 1000 + 61);
+
+using small_queue = static_kvfifo<int, std::string, 64>;
+
+void check_same(small_queue const &q, kvfifo<int, std::string> const &r) {
+  assert(q.size() == r.size() && q.empty() == r.empty());
+  assert(q.full() == (r.size() == small_queue::capacity()));
+  if (!r.empty()) {
+    assert(q.front().first == r.front().first);
+    assert(q.front().second == r.front().second);
+    assert(q.back().second == r.back().second);
+  }
+  std::vector<int> keys(q.k_begin(), q.k_end());
+  assert(keys == std::vector<int>(r.k_begin(), r.k_end()));
+  for (int k : keys) {
+    [[maybe_unused]] const bool same =
+        q.count(k) == r.count(k) &&
+        q.first(k).second == r.first(k).second &&
+        q.last(k).second == r.last(k).second;
+    assert(same);
+  }
+  if (!keys.empty()) assert(*std::prev(q.k_end()) == keys.back());
+}
+
+// Te same operacje na static_kvfifo i kvfifo dają te same wyniki.
+void semantics_test() {
+  small_queue q;
+  kvfifo<int, std::string> reference;
+  [[maybe_unused]] const bool empty_throws =
+      throws([&] { q.pop(); }) && throws([&] { q.pop(3); }) &&
+      throws([&] { q.front(); }) && throws([&] { q.move_to_back(3); });
+  assert(empty_throws);
+
+  std::mt19937 rng(5);
+  for (int step = 0; step < 200000; ++step) {
+    // Raz mało kluczy (długie łańcuchy), raz dużo (duże drzewo).
+    const int keys = step / 1000 % 2 == 0 ? 8 : 200;
+    const int k = static_cast<int>(rng() % keys);
+    const std::string v = std::to_string(step);
+    switch (rng() % 8) {
+      case 0:
+      case 1:
+      case 2:
+        if (q.full()) {
+          [[maybe_unused]] bool full = false;
+          try {
+            q.push(k, v);
+          } catch (std::length_error const &) {
+            full = true;
+          }
+          assert(full);
+        } else {
+          q.push(k, v);
+          reference.push(k, v);
+        }
+        break;
+      case 3: {
+        [[maybe_unused]] const bool thrown = throws([&] { q.pop(); });
+        assert(thrown == reference.empty());
+        if (!reference.empty()) reference.pop();
+        break;
+      }
+      case 4:
+      case 5: {
+        [[maybe_unused]] const bool thrown = throws([&] { q.pop(k); });
+        assert(thrown == (reference.count(k) == 0));
+        if (reference.count(k) > 0) reference.pop(k);
+        break;
+      }
+      case 6: {
+        [[maybe_unused]] const bool thrown =
+            throws([&] { q.move_to_back(k); });
+        assert(thrown == (reference.count(k) == 0));
+        if (reference.count(k) > 0) reference.move_to_back(k);
+        break;
+      }
+      default:
+        if (rng() % 64 == 0) {
+          // Kopia jest niezależna od oryginału.
+          small_queue copy = q;
+          kvfifo<int, std::string> reference_copy = reference;
+          q.clear();
+          reference.clear();
+          check_same(copy, reference_copy);
+        } else if (!q.empty()) {
+          q.back().second += "!";
+          reference.back().second += "!";
+        }
+    }
+    check_same(q, reference);
+  }
+
+  // Klucze rosnące i malejące (najgorsze dla niezrównoważonego drzewa).
+  static_kvfifo<int, int, 4096> sorted;
+  for (int i = 0; i < 2048; ++i) {
+    sorted.push(i, i);
+    sorted.push(-i - 1, i);
+  }
+  assert(sorted.full() && *sorted.k_begin() == -2048);
+  for (int i = 0; i < 2048; ++i) sorted.pop(i);
+  assert(sorted.size() == 2048 && *std::prev(sorted.k_end()) == -1);
+  std::cout << "Static semantics test passed" << std::endl;
+}
+
+// Po konstrukcji operacje na kolejce nie alokują pamięci.
+void heap_free_test() {
+  using queue = static_kvfifo<int, double, 1024>;
+  auto *q = new queue();
+  [[maybe_unused]] const std::size_t before = allocations;
+  for (int round = 0; round < 100; ++round) {
+    for (int i = 0; q->size() < 1000; ++i) q->push(i % 37, i);
+    for (int k = 0; k < 37; k += 3) q->move_to_back(k);
+    while (q->count(5) > 0) q->pop(5);
+    while (q->size() > 100) q->pop();
+  }
+  queue copy = *q;
+  copy.clear();
+  assert(allocations == before);
+  delete q;
+  std::cout << "Static heap-free test passed" << std::endl;
+}
+
+// Wartość, której konstruktor domyślny może zgłosić wyjątek: zwalniając
+// miejsce, kolejka jej nie resetuje (pop jest noexcept).
+struct fragile {
+  static inline bool armed = false;
+  fragile() noexcept(false) {
+    if (armed) throw std::runtime_error("fragile");
+  }
+  explicit fragile(int value_) : value(value_) {}
+  ~fragile() {}
+  int value = 0;
+};
+
+void fragile_test() {
+  static_kvfifo<int, fragile, 4> q;
+  fragile::armed = true;
+  q.push(1, fragile(10));
+  q.push(2, fragile(20));
+  q.push(1, fragile(11));
+  q.pop();
+  q.pop(1);
+  assert(q.size() == 1 && q.front().second.value == 20);
+  q.clear();
+  assert(q.empty());
+  fragile::armed = false;
+  std::cout << "Static fragile value test passed" << std::endl;
+}
+
+// Ta sama mieszanka operacji na obu kolejkach.
+template <typename Queue>
+double run(Queue &q, std::size_t n) {
+  std::mt19937 rng(9);
+  const auto start = std::chrono::steady_clock::now();
+  long long sum = 0;
+  for (std::size_t i = 0; i < n; ++i) {
+    const int k = static_cast<int>(rng() % 64);
+    if (q.size() < 900 && rng() % 2 == 0) {
+      q.push(k, static_cast<long long>(i));
+    } else if (q.count(k) > 0) {
+      sum += q.first(k).second;
+      q.pop(k);
+    } else if (!q.empty()) {
+      sum += q.front().second;
+      q.pop();
+    }
+  }
+  const double seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+          .count();
+  assert(sum > 0);
+  return seconds;
+}
+
+void benchmark(std::size_t n) {
+  auto *fixed = new static_kvfifo<int, long long, 1024>();
+  kvfifo<int, long long> dynamic;
+  const double fixed_seconds = run(*fixed, n);
+  const double dynamic_seconds = run(dynamic, n);
+  delete fixed;
+  std::printf("%zu ops: static_kvfifo %.0f ops/s, kvfifo %.0f ops/s\n", n,
+              n / fixed_seconds, n / dynamic_seconds);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  const std::size_t n = argc > 1 ? std::strtoull(argv[1], nullptr, 10)
+                                 : 2000000;
+  semantics_test();
+  heap_free_test();
+  fragile_test();
+  benchmark(n);
+  std::cout << "All static tests passed!" << std::endl;
+}
@@ -3,10 +3,14 @@
 
 #include "kvfifo.h"
 #include <cassert>
+#include <map>
 #include <memory>
 #include <vector>
 #include <string>
+#include <utility>
 #include <iostream>
+#include <memory_resource>
+#include <thread>
 
 using std::string;
 using std::cout;
@@ -265,6 +269,988 @@ namespace mkostyk {
         }
     }
 
+    void ttl_test() {
+        cout << "TTL test" << endl;
+        kvfifo<string, int> kvf;
+
+        kvf.push("A", 0);
+        kvf.push_with_ttl("B", 1, 10);
+        kvf.push_with_ttl("A", 2, 5);
+        kvf.push_with_ttl("C", 3, 100000);
+        kvf.push_with_ttl("B", 4, 5000000000ull);
+        kvf.push_with_ttl("B", 5, 10);
+
+        // Nic nie wygasa, więc nie powinno być kopii.
+        kvfifo<string, int> copy = kvf;
+        assert(kvf.expire(4) == 0 && kvf.size() == 6);
+
+        kvf.move_to_back("A");
+        kvf.pop("B");
+        assert(kvf.expire(5) == 1);
+        assert(kvf.size() == 4 && kvf.count("A") == 1 && kvf.count("B") == 2);
+        assert(copy.size() == 6);
+
+        // Terminy liczone od czasu ostatniego expire.
+        kvf.push_with_ttl("D", 6, 3);
+        assert(kvf.expire(7) == 0);
+        assert(kvf.expire(8) == 1 && kvf.count("D") == 0);
+        assert(kvf.expire(10) == 1 && kvf.count("B") == 1);
+        assert(kvf.expire(100000) == 1 && kvf.count("C") == 0);
+
+        kvfifo<string, int> later = kvf;
+        assert(later.expire(4999999999ull) == 0);
+        assert(later.expire(5000000000ull) == 1);
+        assert(later.size() == 1 && later.front().first == "A");
+        assert(kvf.size() == 2 && kvf.front().second == 4);
+
+        // Termin nasycony do największego czasu wygasa dopiero w nim.
+        kvfifo<int, int> forever;
+        forever.push_with_ttl(1, 1, ~0ull);
+        assert(forever.expire(~0ull) == 1 && forever.empty());
+        kvfifo<int, int> mixed;
+        mixed.push_with_ttl(1, 2, ~0ull);
+        mixed.push_with_ttl(2, 3, 10);
+        assert(mixed.expire(10) == 1 && mixed.size() == 1);
+        // Po przesunięciu czasu nasyca się też mniejszy ttl.
+        mixed.push_with_ttl(3, 4, ~0ull - 5);
+        assert(mixed.expire(~0ull - 1) == 0 && mixed.size() == 2);
+        assert(mixed.expire(~0ull) == 2 && mixed.empty());
+
+        // Losowe terminy, sprawdzamy, że wygasają dokładnie w swoim czasie.
+        kvfifo<int, int> many;
+        unsigned seed = 42;
+        std::vector<int> expiring(1 << 16, 0);
+        for (int i = 0; i < 20000; ++i) {
+            seed = seed * 1103515245u + 12345u;
+            int ttl = (seed >> 8) % expiring.size();
+            many.push_with_ttl(i % 100, i, ttl);
+            ++expiring[ttl];
+        }
+        for (size_t t = 0; t < expiring.size(); t += 7) {
+            size_t expected = 0;
+            for (size_t u = (t < 7 ? 0 : t - 6); u <= t; ++u)
+                expected += expiring[u];
+            assert(many.expire(t) == expected);
+        }
+    }
+
+    void fair_test() {
+        cout << "Fair test" << endl;
+        kvfifo<string, int> kvf;
+
+        for (int i = 0; i < 6; ++i)
+            kvf.push("noisy", i);
+        kvf.push("b", 10);
+        kvf.push("c", 20);
+        kvf.push("c", 21);
+
+        kvfifo<string, int> const copy = kvf;
+        assert(copy.front_fair().first == "b");
+
+        // Klucze rosnąco, po jednym elemencie na turę.
+        string expected[] = {"b", "c", "noisy", "c", "noisy", "noisy"};
+        for (auto &key : expected) {
+            assert(kvf.front_fair().first == key);
+            kvf.pop_fair();
+        }
+        assert(kvf.size() == 3 && kvf.count("noisy") == 3);
+        assert(copy.size() == 9);
+
+        // Wagi: "a" dostaje dwa elementy na turę.
+        kvf.set_weight("a", 2);
+        kvf.push("a", 30);
+        kvf.push("a", 31);
+        kvf.push("a", 32);
+        kvf.pop("noisy");
+        string weighted[] = {"a", "a", "noisy", "a", "noisy"};
+        for (auto &key : weighted) {
+            assert(kvf.front_fair().first == key);
+            kvf.pop_fair();
+        }
+        assert(kvf.empty());
+
+        // Usunięcie klucza, na który wskazuje kursor, przesuwa kursor dalej.
+        kvf.push("x", 1);
+        kvf.push("y", 2);
+        kvf.push("x", 3);
+        kvf.pop_fair();
+        assert(kvf.front_fair().first == "y");
+        kvf.pop("y");
+        assert(kvf.front_fair().first == "x" && kvf.front_fair().second == 3);
+    }
+
+    void batch_move_test() {
+        cout << "Batch move test" << endl;
+        kvfifo<string, int> kvf;
+        string keys[] = {"a", "b", "c", "a", "d", "b", "c"};
+        for (int i = 0; i < 7; ++i)
+            kvf.push(keys[i], i);
+        kvf.push_with_ttl("b", 7, 5);
+
+        auto order = [](kvfifo<string, int> q) {
+            std::vector<int> values;
+            for (; !q.empty(); q.pop())
+                values.push_back(q.front().second);
+            return values;
+        };
+
+        kvfifo<string, int> copy = kvf;
+        kvf.move_to_back(std::vector<string>{"c", "a"});
+        assert((order(kvf) == std::vector<int>{1, 4, 5, 7, 2, 6, 0, 3}));
+        assert((order(copy) == std::vector<int>{0, 1, 2, 3, 4, 5, 6, 7}));
+
+        kvf.move_to_front(std::vector<string>{"d", "b", "d"});
+        assert((order(kvf) == std::vector<int>{4, 1, 5, 7, 2, 6, 0, 3}));
+
+        kvf.move_to_front("a");
+        assert((order(kvf) == std::vector<int>{0, 3, 4, 1, 5, 7, 2, 6}));
+        assert(kvf.first("b").second == 1 && kvf.last("b").second == 7);
+
+        // Brakujący klucz: wyjątek i brak zmian.
+        bool thrown = false;
+        try {
+            kvf.move_to_back(std::vector<string>{"a", "zzz"});
+        } catch (std::invalid_argument const &) {
+            thrown = true;
+        }
+        assert(thrown);
+        assert((order(kvf) == std::vector<int>{0, 3, 4, 1, 5, 7, 2, 6}));
+
+        // Zegary przesuniętych elementów dalej działają.
+        assert(kvf.expire(5) == 1 && kvf.count("b") == 2);
+    }
+
+    void append_test() {
+        cout << "Append test" << endl;
+        kvfifo<string, int> global, worker;
+        global.push("a", 0);
+        global.push("b", 1);
+        global.push_with_ttl("a", 2, 10);
+        worker.push("b", 3);
+        worker.push_with_ttl("c", 4, 5);
+        worker.push_with_ttl("a", 5, 20);
+        worker.push("c", 6);
+
+        global.append(std::move(worker));
+        assert(worker.empty() && worker.count("a") == 0);
+        assert(global.size() == 7);
+        assert(global.count("a") == 3 && global.count("b") == 2 &&
+               global.count("c") == 2);
+        assert(global.first("b").second == 1 && global.last("b").second == 3);
+        assert(global.last("a").second == 5 && global.back().second == 6);
+
+        // Zegary przeniesionych elementów działają w nowej kolejce.
+        assert(global.expire(5) == 1 && global.count("c") == 1);
+        assert(global.expire(10) == 1 && global.expire(20) == 1);
+        assert(global.count("a") == 1 && global.size() == 4);
+
+        // Współdzielona kolejka jest kopiowana, a kopia pozostaje nietknięta.
+        kvfifo<string, int> shared;
+        shared.push("d", 7);
+        shared.push("a", 8);
+        kvfifo<string, int> keeper = shared;
+        global.append(std::move(shared));
+        assert(keeper.size() == 2 && keeper.front().second == 7);
+        assert(global.size() == 6 && global.back().second == 8);
+        assert(global.last("a").second == 8 && global.count("d") == 1);
+
+        global.append(std::move(global));
+        assert(global.size() == 12 && global.count("a") == 4);
+    }
+
+    void extract_test() {
+        cout << "Extract test" << endl;
+        kvfifo<string, int> kvf;
+        string keys[] = {"a", "b", "c", "a", "d", "b", "c", "a"};
+        for (int i = 0; i < 8; ++i)
+            kvf.push(keys[i], i);
+        kvf.push_with_ttl("c", 8, 10);
+
+        kvfifo<string, int> copy = kvf;
+        kvfifo<string, int> as = kvf.extract("a");
+        assert(as.size() == 3 && as.count("a") == 3);
+        assert(as.front().second == 0 && as.back().second == 7);
+        assert(kvf.size() == 6 && kvf.count("a") == 0);
+        assert(copy.size() == 9 && copy.count("a") == 3);
+
+        // Kursor pop_fair wskazujący na wyjęty klucz przechodzi dalej.
+        kvf.pop_fair();
+        kvfifo<string, int> cs = kvf.extract_if([](string const &k) {
+            return k >= "c";
+        });
+        assert(cs.size() == 4 && cs.count("c") == 3 && cs.count("d") == 1);
+        std::vector<int> order;
+        for (; !cs.empty(); cs.pop()) {
+            order.push_back(cs.front().second);
+            if (cs.front().second == 6)
+                // Termin ważności przeszedł razem z elementem.
+                assert(cs.expire(10) == 1);
+        }
+        assert((order == std::vector<int>{2, 4, 6}));
+        assert(kvf.size() == 1 && kvf.front_fair().second == 5);
+        assert(kvf.expire(10) == 0);
+
+        kvfifo<string, int> none = kvf.extract_if([](string const &) {
+            return false;
+        });
+        assert(none.empty() && kvf.size() == 1);
+
+        bool thrown = false;
+        try {
+            kvf.extract("a");
+        } catch (std::invalid_argument const &) {
+            thrown = true;
+        }
+        assert(thrown && kvf.size() == 1);
+    }
+
+    void aliased_copy_test() {
+        cout << "Aliased copy test" << endl;
+        kvfifo<string, int> kvf;
+        string keys[] = {"a", "b", "a", "c"};
+        for (int i = 0; i < 4; ++i)
+            kvf.push(keys[i], i);
+
+        auto &ref = kvf.front().second;
+        kvfifo<string, int> copy = kvf;
+        kvfifo<string, int> copy_of_copy;
+        copy_of_copy = copy;
+        auto const &ccopy = copy;
+        auto const &ckvf = kvf;
+
+        // Kopia nadal współdzieli dane, zapamiętała tylko wartość pod ref.
+        assert(&ccopy.back().second == &ckvf.back().second);
+        ref = 10;
+        assert(kvf.front().second == 10);
+        assert(ccopy.front().second == 0);
+        assert(std::as_const(copy_of_copy).front().second == 0);
+
+        // Ponowna referencja do tej samej wartości nie odłącza danych.
+        assert(&kvf.front().second == &ref);
+        assert(&ccopy.back().second == &ckvf.back().second);
+
+        // Nowa referencja, gdy dane są współdzielone: właściciel się odłącza
+        // (unieważniając ref), a kopie widzą stare wartości.
+        auto const &seen = ccopy.last("a").second;
+        auto &ref_2 = kvf.last("a").second;
+        ref_2 = 20;
+        assert(seen == 2 && ckvf.last("a").second == 20);
+        assert(ckvf.front().second == 10);
+        assert(&ccopy.back().second != &ckvf.back().second);
+        auto &ref_3 = kvf.front().second;
+        ref_3 = 11;
+        assert(ccopy.front().second == 0);
+
+        // Kopia robiona później widzi obecne wartości.
+        kvfifo<string, int> late = kvf;
+        ref_3 = 12;
+        assert(std::as_const(late).front().second == 11);
+        assert(std::as_const(late).last("a").second == 20);
+
+        // Non-const dostęp w kopii odłącza ją z jej wartościami.
+        assert(copy.front().second == 0 && copy.last("a").second == 2);
+        copy.front().second = 5;
+        assert(kvf.front().second == 12 && ccopy.front().second == 5);
+
+        // Przeniesienie zachowuje własność, a zniszczenie właściciela nie
+        // zmienia tego, co widzą kopie.
+        kvfifo<string, int> moved = std::move(kvf);
+        ref_3 = 13;
+        assert(std::as_const(moved).front().second == 13);
+        assert(std::as_const(copy_of_copy).front().second == 0);
+        moved.pop();
+        assert(moved.size() == 3 && std::as_const(late).size() == 4);
+        assert(std::as_const(late).front().second == 11);
+        late.pop("a");
+        assert(late.front().second == 1 && late.last("a").second == 20);
+        assert(std::as_const(copy_of_copy).last("a").second == 2);
+
+        // Const referencja wzięta w kopii przed wydaniem non-const
+        // referencji właścicielowi nie widzi jego zapisów.
+        kvfifo<int, int> q1, q2;
+        q1.push(1, 10);
+        q1.push(2, 20);
+        q1.front();
+        q2 = q1;
+        auto const &y = std::as_const(q2).back().second;
+        q1.back().second = 99;
+        assert(y == 20 && std::as_const(q2).back().second == 20);
+        assert(std::as_const(q1).back().second == 99);
+    }
+
+    void lazy_index_test() {
+        cout << "Lazy index test" << endl;
+        kvfifo<string, int> kvf;
+        string keys[] = {"a", "b", "a", "c", "b"};
+        for (int i = 0; i < 5; ++i)
+            kvf.push(keys[i], i);
+
+        // Kopie odłączone przez pop i push nie budują indeksu kluczy, dopiero
+        // operacje na kluczach.
+        kvfifo<string, int> fifo = kvf;
+        fifo.pop();
+        fifo.push("d", 5);
+        kvfifo<string, int> fifo_2 = fifo;
+        fifo_2.pop();
+        assert(fifo_2.front().second == 2 && fifo_2.back().second == 5);
+        assert(fifo_2.count("a") == 1 && fifo_2.count("b") == 1);
+        assert(fifo_2.first("d").second == 5);
+        fifo_2.pop("b");
+        assert(fifo_2.size() == 3 && fifo_2.front().second == 2);
+
+        kvfifo<string, int> keyed = kvf;
+        keyed.push("e", 6);
+        keyed.move_to_back("a");
+        assert(keyed.back().second == 2 && keyed.last("e").second == 6);
+        int expected[] = {1, 3, 4, 6, 0, 2};
+        for (int value : expected) {
+            assert(keyed.front().second == value);
+            keyed.pop();
+        }
+
+        // Indeks budowany leniwie przez stałe operacje na dwóch kopiach
+        // współdzielących dane, każda w swoim wątku.
+        kvfifo<string, int> unindexed = kvf;
+        unindexed.pop();
+        for (int i = 0; i < 1000; ++i)
+            unindexed.push(keys[i % 5], i);
+        for (int round = 0; round < 20; ++round) {
+            kvfifo<string, int> shared = unindexed;
+            shared.pop();
+            kvfifo<string, int> const reader_1 = shared, reader_2 = shared;
+            size_t counted[2] = {0, 0}, positions[2] = {0, 0};
+            int firsts[2] = {0, 0};
+            std::thread worker([&] {
+                counted[0] = reader_1.count("a");
+                firsts[0] = reader_1.first("c").second;
+                positions[0] = reader_1.position_of_first("b");
+            });
+            positions[1] = reader_2.position_of_first("b");
+            counted[1] = reader_2.count("a");
+            firsts[1] = reader_2.first("c").second;
+            worker.join();
+            assert(counted[0] == 401 && counted[1] == 401);
+            assert(firsts[0] == 3 && firsts[1] == 3);
+            assert(positions[0] == 2 && positions[1] == 2);
+        }
+
+        kvfifo<string, int> timed = kvf;
+        timed.pop();
+        timed.push_with_ttl("f", 7, 5);
+        assert(timed.expire(5) == 1 && timed.count("f") == 0);
+        assert(timed.size() == 4);
+
+        kvfifo<string, int> appended = kvf;
+        appended.pop();
+        kvfifo<string, int> tail = kvf;
+        tail.pop();
+        appended.append(std::move(tail));
+        assert(appended.size() == 8 && appended.count("b") == 4);
+        assert(appended.front_fair().second == 2);
+
+        int i = 0;
+        string sorted[] = {"a", "b", "c"};
+        for (auto it = fifo.k_begin(); it != fifo.k_end(); ++it, ++i)
+            assert(i < 4 && *it == (i < 3 ? sorted[i] : "d"));
+        assert(i == 4);
+    }
+
+    void shared_key_test() {
+        cout << "Shared key test" << endl;
+        kvfifo<string, int> kvf;
+        kvf.push("key", 0);
+        kvf.push("other", 1);
+        kvf.push("key", 2);
+        // Każdy klucz jest trzymany raz.
+        assert(&kvf.front().first == &kvf.back().first);
+        assert(&kvf.front().first == &*kvf.k_begin());
+
+        // Element dodany do kopii bez indeksu kluczy ma własną kopię klucza
+        // (budowa indeksu nie zmienia elementów).
+        kvfifo<string, int> copy = kvf;
+        copy.pop();
+        copy.push("key", 3);
+        assert(copy.count("key") == 2);
+        assert(copy.first("key").first == copy.last("key").first);
+
+        // Małe klucze są trzymane wprost w elementach, bez bloków
+        // kontrolnych.
+        kvfifo<int, int> small;
+        for (int i = 0; i < 100; ++i) small.push(i % 7, i);
+        kvfifo_memory_usage usage = small.memory_usage();
+        assert(usage.payload == 100 * 2 * sizeof(int));
+        kvfifo<int, int> small_copy = small;
+        small_copy.pop();
+        small_copy.push(3, 100);
+        assert(small_copy.count(3) == 15 && small_copy.last(3).second == 100);
+        assert(small_copy.first(1).second == 1 && small.first(0).second == 0);
+    }
+
+    void memory_usage_test() {
+        cout << "Memory usage test" << endl;
+        kvfifo<string, int> kvf;
+        kvfifo_memory_usage empty = kvf.memory_usage();
+        assert(empty.payload == 0 && empty.index == 0 && empty.timers == 0);
+        assert(empty.exclusive == empty.total() && empty.shared == 0);
+
+        for (int i = 0; i < 100; ++i)
+            kvf.push(i % 2 ? "odd" : "even", i);
+        kvfifo_memory_usage usage = kvf.memory_usage();
+        assert(usage.payload == 100 * sizeof(int) + 2 * sizeof(string));
+        assert(usage.node_overhead > 0 && usage.index > 0);
+        assert(usage.exclusive == usage.total());
+
+        // Kopia współdzieli wszystko, dopóki się nie odłączy.
+        kvfifo<string, int> copy = kvf;
+        assert(copy.memory_usage().shared == usage.total());
+        assert(kvf.memory_usage().exclusive == 0);
+        copy.pop();
+        assert(copy.memory_usage().shared == 0);
+        // Odłączona kopia nie ma jeszcze indeksu kluczy.
+        assert(copy.memory_usage().index == 0);
+        assert(copy.memory_usage().payload == usage.payload - sizeof(int));
+
+        // Koło czasowe zostaje po wygaśnięciu elementów, aż do shrink_to_fit.
+        for (int i = 0; i < 10; ++i)
+            kvf.push_with_ttl("ttl", i, 5);
+        kvf.expire(5);
+        assert(kvf.memory_usage().timers > 0);
+        kvfifo<string, int> shared = kvf;
+        kvf.shrink_to_fit();
+        assert(kvf.memory_usage().timers > 0);
+        shared = copy;
+        kvf.shrink_to_fit();
+        assert(kvf.memory_usage().timers == 0);
+        assert(kvf.memory_usage().total() == usage.total());
+        kvf.push_with_ttl("ttl", 0, 5);
+        assert(kvf.expire(10) == 1 && kvf.size() == 100);
+    }
+
+    void bulk_test() {
+        cout << "Bulk test" << endl;
+        kvfifo<string, int> kvf;
+        assert(kvf.sum() == 0 && kvf.count_if([](int) { return true; }) == 0);
+        long long expected_sum = 0;
+        for (int i = 0; i < 1000; ++i) {
+            kvf.push(i % 3 ? "b" : "a", i - 500);
+            expected_sum += i - 500;
+        }
+        assert(kvf.sum() == expected_sum);
+        assert(kvf.count_if([](int v) { return v > 0; }) == 499);
+        assert((kvf.min_max() == std::pair<int, int>{-500, 499}));
+        assert(kvf.count_if("a", [](int v) { return v % 2 == 0; }) == 167);
+        assert(kvf.sum("a") == 166833 - 334 * 500);
+        assert((kvf.min_max("b") == std::pair<int, int>{-499, 498}));
+        assert(kvf.sum("missing") == 0);
+        assert(kvf.count_if("missing", [](int) { return true; }) == 0);
+
+        bool thrown = false;
+        try {
+            kvf.min_max("missing");
+        } catch (std::invalid_argument const &) {
+            thrown = true;
+        }
+        assert(thrown);
+
+        // Kopia widzi wartości z chwili kopiowania.
+        auto &ref = kvf.front().second;
+        kvfifo<string, int> copy = kvf;
+        ref = 10000;
+        assert(copy.sum() == expected_sum && copy.min_max().second == 499);
+        assert(kvf.sum() == expected_sum + 10500);
+        assert(kvf.min_max("a").second == 10000);
+
+        kvfifo<int, string> strings;
+        strings.push(1, "a");
+        strings.push(2, "bb");
+        strings.push(1, "ccc");
+        assert(strings.count_if([](string const &v) { return v.size() > 1; }) == 2);
+        assert(strings.count_if(1, [](string const &v) { return v.size() > 1; }) == 1);
+    }
+
+    void bulk_removal_test() {
+        cout << "Bulk removal test" << endl;
+        kvfifo<string, int> kvf;
+        string keys[] = {"a", "b", "a", "c", "b", "a"};
+        for (int i = 0; i < 6; ++i)
+            kvf.push(keys[i], i);
+        kvf.push_with_ttl("a", 6, 5);
+        kvf.push_with_ttl("c", 7, 5);
+
+        kvfifo<string, int> copy = kvf;
+        kvf.pop_all("a");
+        assert(kvf.size() == 4 && kvf.count("a") == 0);
+        assert(kvf.front().second == 1 && kvf.back().second == 7);
+        assert(copy.size() == 8 && copy.count("a") == 4);
+        assert(kvf.expire(5) == 1 && kvf.size() == 3);
+
+        bool thrown = false;
+        try {
+            kvf.pop_all("a");
+        } catch (std::invalid_argument const &) {
+            thrown = true;
+        }
+        assert(thrown && kvf.size() == 3);
+
+        // Kursor pop_fair na usuwanym kluczu przechodzi dalej.
+        copy.pop_fair();
+        assert(copy.front_fair().second == 1);
+        std::vector<int> seen;
+        assert(copy.erase_if([&](string const &k, int v) {
+            seen.push_back(v);
+            return k == "b" || v % 3 == 0;
+        }) == 4);
+        assert((seen == std::vector<int>{1, 2, 3, 4, 5, 6, 7}));
+        assert(copy.size() == 3 && copy.count("b") == 0);
+        assert(copy.front().second == 2 && copy.back().second == 7);
+        assert(copy.first("a").second == 2 && copy.last("a").second == 5);
+        assert(copy.front_fair().second == 7);
+        // Zegary usuniętych elementów też znikają.
+        assert(copy.expire(5) == 1 && copy.size() == 2);
+
+        // Wyjątek z pred nie zmienia kolejki.
+        thrown = false;
+        try {
+            copy.erase_if([](string const &, int v) {
+                if (v == 5) throw std::runtime_error("pred");
+                return true;
+            });
+        } catch (std::runtime_error const &) {
+            thrown = true;
+        }
+        assert(thrown && copy.size() == 2 && copy.front().second == 2);
+        assert(copy.erase_if([](string const &, int) { return true; }) == 2);
+        assert(copy.empty() && copy.count("a") == 0);
+    }
+
+    struct throwing_value {
+        int value;
+        static inline bool fail = false;
+        explicit throwing_value(int value_) : value(value_) {}
+        throwing_value(throwing_value const &that) : value(that.value) {
+            if (fail) throw std::runtime_error("copy");
+        }
+    };
+
+    void push_guarantee_test() {
+        cout << "Push guarantee test" << endl;
+        kvfifo<string, throwing_value> kvf;
+        kvf.push("a", throwing_value(0));
+        kvf.push_with_ttl("b", throwing_value(1), 5);
+
+        // Nieudane wstawienie (dla istniejącego i nowego klucza, z terminem
+        // ważności i bez) niczego nie zmienia.
+        throwing_value::fail = true;
+        for (string key : {"a", "c"}) {
+            for (bool ttl : {false, true}) {
+                bool thrown = false;
+                try {
+                    if (ttl)
+                        kvf.push_with_ttl(key, throwing_value(2), 1);
+                    else
+                        kvf.push(key, throwing_value(2));
+                } catch (std::runtime_error const &) {
+                    thrown = true;
+                }
+                assert(thrown && kvf.size() == 2);
+                assert(kvf.count("a") == 1 && kvf.count("c") == 0);
+            }
+        }
+        throwing_value::fail = false;
+
+        kvf.push("c", throwing_value(3));
+        assert(kvf.back().second.value == 3 && kvf.first("c").second.value == 3);
+        assert(kvf.expire(1) == 0 && kvf.expire(5) == 1);
+        assert(kvf.size() == 2 && kvf.front().second.value == 0);
+    }
+
+    // Zasób, który liczy zaalokowane bajty.
+    struct counting_resource : std::pmr::memory_resource {
+        size_t allocated = 0, in_use = 0;
+
+        void *do_allocate(size_t bytes, size_t alignment) override {
+            allocated += bytes;
+            in_use += bytes;
+            return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+        }
+        void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+            in_use -= bytes;
+            std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+        }
+        bool do_is_equal(std::pmr::memory_resource const &that)
+                const noexcept override {
+            return this == &that;
+        }
+    };
+
+    void pmr_test() {
+        cout << "Pmr test" << endl;
+        counting_resource arena, other_arena;
+        {
+            pmr::kvfifo<string, int> kvf(&arena);
+            assert(kvf.get_allocator().resource() == &arena);
+            size_t before = arena.allocated;
+            kvf.push("a", 1);
+            kvf.push_with_ttl("b", 2, 5);
+            kvf.push("a", 3);
+            assert(arena.allocated > before);
+
+            // Odłączona kopia dziedziczy zasób.
+            pmr::kvfifo<string, int> copy = kvf;
+            before = arena.allocated;
+            copy.pop();
+            assert(arena.allocated > before);
+            assert(copy.get_allocator().resource() == &arena);
+            assert(kvf.size() == 3 && copy.size() == 2);
+
+            // Dołączenie kolejki z innego zasobu kopiuje ją (razem z
+            // terminami ważności) do naszego zasobu.
+            pmr::kvfifo<string, int> other(&other_arena);
+            other.push_with_ttl("c", 4, 2);
+            other.push("a", 5);
+            before = arena.allocated;
+            kvf.append(std::move(other));
+            assert(arena.allocated > before);
+            assert(kvf.size() == 5 && kvf.count("a") == 3);
+            assert(kvf.last("a").second == 5);
+            assert(kvf.expire(2) == 1 && kvf.count("c") == 0);
+            assert(kvf.expire(5) == 1 && kvf.count("b") == 0);
+            assert(kvf.front().second == 1 && kvf.back().second == 5);
+        }
+        assert(arena.in_use == 0 && other_arena.in_use == 0);
+
+        // Kolejka w arenie żądania.
+        std::pmr::monotonic_buffer_resource request_arena;
+        pmr::kvfifo<int, int> kvf(&request_arena);
+        for (int i = 0; i < 100; i++)
+            kvf.push(i % 10, i);
+        assert(kvf.count(3) == 10 && kvf.first(3).second == 3);
+    }
+
+    void range_test() {
+        cout << "Range test" << endl;
+        std::vector<std::pair<string, int>> input = {
+            {"b", 0}, {"a", 1}, {"b", 2}, {"c", 3}, {"a", 4}, {"b", 5}};
+        kvfifo<string, int> kvf(input.begin(), input.end());
+        assert(kvf.size() == 6);
+        assert(kvf.front().second == 0 && kvf.back().second == 5);
+        assert(kvf.count("a") == 2 && kvf.count("b") == 3 && kvf.count("c") == 1);
+        assert(kvf.first("b").second == 0 && kvf.last("b").second == 5);
+        assert(kvf.first("a").second == 1 && kvf.last("a").second == 4);
+        auto k_it = kvf.k_begin();
+        assert(*k_it == "a" && *++k_it == "b" && *++k_it == "c");
+        assert(++k_it == kvf.k_end());
+        // Elementy o tym samym kluczu dzielą jeden obiekt klucza.
+        assert(&kvf.front().first == &kvf.last("b").first);
+
+        // Zwykłe operacje działają na zbudowanej kolejce.
+        kvf.pop("b");
+        kvf.move_to_back("a");
+        kvf.push("c", 6);
+        assert(kvf.front().second == 2 && kvf.back().second == 6);
+        assert(kvf.first("a").second == 1 && kvf.count("c") == 2);
+
+        // assign zastępuje zawartość, kopie widzą starą.
+        kvfifo<string, int> copy = kvf;
+        std::map<string, int> sorted = {{"x", 7}, {"y", 8}};
+        kvf.assign(sorted);
+        assert(kvf.size() == 2 && kvf.front().first == "x");
+        assert(kvf.count("a") == 0 && kvf.count("y") == 1);
+        assert(copy.size() == 6 && copy.back().second == 6);
+        kvf.assign(std::vector<std::pair<string, int>>());
+        assert(kvf.empty());
+
+        kvfifo<string, int> empty(input.end(), input.end());
+        assert(empty.empty() && empty.k_begin() == empty.k_end());
+    }
+
+    // Wartości klucza k od najstarszej, zdejmowane przez pop(k).
+    std::vector<int> drain(kvfifo<string, int> &kvf, string const &k) {
+        std::vector<int> values;
+        while (kvf.count(k) > 0) {
+            values.push_back(kvf.first(k).second);
+            kvf.pop(k);
+        }
+        return values;
+    }
+
+    void key_chain_test() {
+        cout << "Key chain test" << endl;
+        // Usuwanie ze środka, początku i końca łańcucha klucza.
+        kvfifo<string, int> kvf;
+        for (int i = 0; i < 8; ++i)
+            kvf.push_with_ttl("a", i, i % 2 ? 5 : 50);
+        kvf.push("b", 100);
+        assert(kvf.expire(5) == 4);
+        assert(kvf.count("a") == 4);
+        assert(kvf.first("a").second == 0 && kvf.last("a").second == 6);
+        kvf.erase_if([](string const &, int v) { return v == 0 || v == 6; });
+        assert(kvf.first("a").second == 2 && kvf.last("a").second == 4);
+        kvf.push("a", 8);
+        assert((drain(kvf, "a") == std::vector<int>{2, 4, 8}));
+        assert(kvf.size() == 1 && kvf.first("b").second == 100);
+
+        // Sklejanie łańcuchów przy append i przenoszenie przy extract.
+        kvfifo<string, int> other;
+        for (int i = 0; i < 3; ++i) {
+            kvf.push("a", i);
+            other.push("a", 10 + i);
+            other.push("c", 20 + i);
+        }
+        kvf.append(std::move(other));
+        assert(kvf.count("a") == 6 && kvf.last("a").second == 12);
+        kvfifo<string, int> cs = kvf.extract("c");
+        assert(cs.count("c") == 3 && kvf.count("c") == 0);
+        assert((drain(cs, "c") == std::vector<int>{20, 21, 22}));
+        kvf.move_to_front("a");
+        assert(kvf.back().first == "b");
+        assert((drain(kvf, "a") == std::vector<int>{0, 1, 2, 10, 11, 12}));
+
+        // Klucze występujące raz.
+        for (int i = 0; i < 100; ++i)
+            kvf.push(std::to_string(i), i);
+        kvf.pop_all("b");
+        for (int i = 0; i < 100; i += 3)
+            kvf.pop(std::to_string(i));
+        assert(kvf.size() == 66 && kvf.count("1") == 1 && kvf.count("3") == 0);
+        assert(&kvf.first("50").first == &kvf.last("50").first);
+    }
+
+    void key_rank_test() {
+        cout << "Key rank test" << endl;
+        kvfifo<int, int> kvf;
+        assert(kvf.distinct_keys() == 0 && kvf.key_rank(5) == 0);
+        assert(kvf.count_range(0, 10) == 0);
+        bool thrown = false;
+        try {
+            kvf.nth_key(0);
+        } catch (std::invalid_argument const &) {
+            thrown = true;
+        }
+        assert(thrown);
+
+        // Klucze 0, 2, ..., 198, klucz k występuje k % 3 + 1 razy.
+        for (int i = 0; i < 100; ++i)
+            for (int j = 0; j <= i % 3; ++j)
+                kvf.push(2 * i, j);
+        assert(kvf.distinct_keys() == 100);
+        assert(kvf.nth_key(0) == 0 && kvf.nth_key(42) == 84);
+        assert(kvf.key_rank(84) == 42 && kvf.key_rank(85) == 43);
+        assert(kvf.key_rank(-1) == 0 && kvf.key_rank(1000) == 100);
+        assert(kvf.distinct_keys(10, 20) == 5 && kvf.distinct_keys(20, 10) == 0);
+        // Klucze 10, 12, 14, 16, 18 to i = 5..9: 3 + 1 + 2 + 3 + 1 elementów.
+        assert(kvf.count_range(10, 20) == 10);
+        assert(kvf.count_range(-5, 1000) == kvf.size());
+
+        // Liczniki nadążają za zmianami.
+        kvf.pop(12);
+        kvf.pop_all(14);
+        kvf.push(11, 0);
+        assert(kvf.distinct_keys(10, 20) == 4 && kvf.count_range(10, 20) == 8);
+        kvfifo<int, int> copy = kvf;
+        copy.pop();
+        assert(copy.count_range(0, 1) == 0 && kvf.count_range(0, 1) == 1);
+
+        // Przesuwanie iteratora kluczy o wiele pozycji naraz.
+        auto it = kvf.k_begin();
+        it += 50;
+        assert(*it == kvf.nth_key(50) && it - kvf.k_begin() == 50);
+        assert(kvf.k_begin() + kvf.distinct_keys() == kvf.k_end());
+        it -= 50;
+        assert(it == kvf.k_begin() && kvf.k_end() - it == 99);
+    }
+
+    void key_range_ops_test() {
+        cout << "Key range operations test" << endl;
+        kvfifo<int, int> kvf;
+        for (int i = 0; i < 20; ++i)
+            kvf.push(i % 10, i);
+        // Puste przedziały niczego nie zmieniają i nie kopiują danych.
+        kvfifo<int, int> copy = kvf;
+        assert(kvf.pop_range(3, 3) == 0 && kvf.pop_range(5, 2) == 0);
+        assert(kvf.move_range_to_back(20, 30) == 0);
+        assert(kvf.memory_usage().exclusive == 0);
+
+        // Grupy kluczy 2, 3 i 4 trafiają na koniec w kolejności kluczy.
+        assert(kvf.move_range_to_back(2, 5) == 6);
+        auto values = [](kvfifo<int, int> q) {
+            std::vector<int> result;
+            for (; !q.empty(); q.pop())
+                result.push_back(q.front().second);
+            return result;
+        };
+        std::vector<int> expected = {0, 1, 5, 6, 7, 8, 9, 10, 11, 15, 16,
+                                     17, 18, 19, 2, 12, 3, 13, 4, 14};
+        assert(values(kvf) == expected);
+        assert(copy.front().second == 0 && copy.back().second == 19);
+
+        // pop_range usuwa całe grupy, także z terminami ważności.
+        kvf.push_with_ttl(6, 20, 5);
+        assert(kvf.pop_range(5, 8) == 7);
+        assert(kvf.size() == 14 && kvf.count(6) == 0 && kvf.count(8) == 2);
+        assert(kvf.distinct_keys() == 7 && kvf.nth_key(5) == 8);
+        assert(kvf.expire(5) == 0);
+        assert(kvf.pop_range(-100, 100) == 14 && kvf.empty());
+        assert(copy.size() == 20);
+
+        // Kursor pop_fair przechodzi za usunięty przedział.
+        for (int i = 0; i < 6; ++i)
+            kvf.push(i % 3, i);
+        kvf.pop_fair();
+        assert(kvf.front_fair().first == 1);
+        kvf.pop_range(1, 2);
+        assert(kvf.front_fair().first == 2);
+    }
+
+    void position_test() {
+        cout << "Position test" << endl;
+        kvfifo<int, int> kvf;
+        for (int i = 0; i < 30; ++i)
+            kvf.push(i % 7, i);
+        assert(kvf.position_of_first(3) == 3 && kvf.position_of_last(3) == 24);
+        assert(kvf.at(0).second == 0 && kvf.at(29).second == 29);
+        bool thrown = false;
+        try {
+            kvf.at(30);
+        } catch (std::invalid_argument const &) {
+            thrown = true;
+        }
+        assert(thrown);
+
+        // Numery nadążają za usuwaniem i przesuwaniem elementów.
+        kvf.pop();
+        kvf.pop(3);
+        kvf.move_to_front(5);
+        kvf.move_to_back(1);
+        kvf.push(9, 30);
+        const std::vector<int> expected = [&] {
+            kvfifo<int, int> q = kvf;
+            std::vector<int> result;
+            for (; !q.empty(); q.pop())
+                result.push_back(q.front().second);
+            return result;
+        }();
+        for (size_t i = 0; i < expected.size(); ++i)
+            assert(kvf.at(i).second == expected[i]);
+        assert(kvf.position_of_first(5) == 0 && kvf.position_of_last(5) == 3);
+        assert(kvf.position_of_first(1) == 23 && kvf.position_of_last(9) == 28);
+
+        // Wartość z at można zmienić, kopia widzi starą.
+        kvfifo<int, int> copy = kvf;
+        kvf.at(4).second = -1;
+        assert(copy.at(4).second == expected[4] && kvf.at(4).second == -1);
+
+        const kvfifo<int, int> &view = kvf;
+        assert(view.at(28).first == 9);
+        thrown = false;
+        try {
+            view.position_of_first(42);
+        } catch (std::invalid_argument const &) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+
+    void cursor_test() {
+        cout << "Cursor test" << endl;
+        kvfifo<int, int> kvf;
+        kvf.push(0, 0);
+        kvf.open_cursor("audit");
+        kvf.open_cursor("replica");
+        for (int i = 1; i <= 6; ++i)
+            kvf.push(i % 3, i);
+        assert(kvf.cursor_lag("audit") == 6 && kvf.cursor_lag("replica") == 6);
+
+        // Właściciel zdejmuje i przesuwa elementy, kursory widzą wszystkie
+        // w kolejności wstawiania.
+        kvf.pop();
+        kvf.pop(1);
+        kvf.move_to_back(2);
+        kvf.pop_all(0);
+        assert(kvf.size() == 3);
+        std::vector<int> seen;
+        for (; kvf.cursor_lag("audit") > 0; kvf.cursor_pop("audit"))
+            seen.push_back(kvf.cursor_front("audit").second);
+        assert((seen == std::vector<int>{1, 2, 3, 4, 5, 6}));
+
+        // Usunięte elementy czekają tylko na drugi kursor.
+        auto retained = kvf.memory_usage().payload;
+        kvf.cursor_pop("replica");
+        kvf.cursor_pop("replica");
+        assert(kvf.memory_usage().payload < retained);
+        kvf.push(7, 7);
+        assert(kvf.cursor_front("audit").second == 7);
+        assert(kvf.cursor_lag("replica") == 5);
+
+        // Kopia ma własne kursory.
+        kvfifo<int, int> copy = kvf;
+        copy.cursor_pop("replica");
+        assert(copy.cursor_front("replica").second == 4);
+        assert(kvf.cursor_front("replica").second == 3);
+
+        // extract daje kopie elementów, na które czekają kursory.
+        auto twos = kvf.extract(2);
+        assert(twos.size() == 2 && twos.front().second == 2);
+        kvf.clear();
+        seen.clear();
+        for (; kvf.cursor_lag("replica") > 0; kvf.cursor_pop("replica"))
+            seen.push_back(kvf.cursor_front("replica").second);
+        assert((seen == std::vector<int>{3, 4, 5, 6, 7}));
+
+        bool thrown = false;
+        try {
+            kvf.cursor_front("replica");
+        } catch (std::invalid_argument const &) {
+            thrown = true;
+        }
+        assert(thrown);
+        thrown = false;
+        try {
+            kvf.open_cursor("audit");
+        } catch (std::invalid_argument const &) {
+            thrown = true;
+        }
+        assert(thrown);
+
+        kvf.close_cursor("audit");
+        kvf.close_cursor("replica");
+        assert(kvf.memory_usage().payload == 0);
+        copy.close_cursor("audit");
+        assert(copy.cursor_lag("replica") == 4);
+
+        // Dołączone elementy są dla kursorów nowe.
+        kvfifo<int, int> tail;
+        tail.push(8, 8);
+        tail.push(9, 9);
+        copy.pop();
+        copy.append(std::move(tail));
+        seen.clear();
+        for (; copy.cursor_lag("replica") > 0; copy.cursor_pop("replica"))
+            seen.push_back(copy.cursor_front("replica").second);
+        assert((seen == std::vector<int>{4, 5, 6, 7, 8, 9}));
+        copy.close_cursor("replica");
+        assert(copy.size() == 5 && copy.back().second == 9);
+
+        // Pusta dołączana kolejka też traci kursory i wagi kluczy.
+        kvfifo<int, int> idle;
+        idle.open_cursor("replica");
+        idle.set_weight(1, 3);
+        copy.append(std::move(idle));
+        assert(copy.size() == 5);
+        thrown = false;
+        try {
+            idle.cursor_lag("replica");
+        } catch (std::invalid_argument const &) {
+            thrown = true;
+        }
+        assert(thrown);
+        idle.push(1, 0);
+        idle.push(1, 1);
+        idle.push(2, 2);
+        idle.pop_fair();
+        assert(idle.front_fair().first == 2);
+    }
+
     void mkostyk_kvfifo_test_main() {
         cout << "\033[1;37m" << "---------- MKOSTYK TEST ----------" << "\033[0m" << endl;
         peczar_test();
@@ -273,6 +1259,25 @@ namespace mkostyk {
         shared_data_test();
         very_long_key_test();
         invalidating_references_test();
+        ttl_test();
+        fair_test();
+        batch_move_test();
+        append_test();
+        extract_test();
+        aliased_copy_test();
+        lazy_index_test();
+        shared_key_test();
+        memory_usage_test();
+        bulk_test();
+        bulk_removal_test();
+        push_guarantee_test();
+        pmr_test();
+        range_test();
+        key_chain_test();
+        key_rank_test();
+        key_range_ops_test();
+        position_test();
+        cursor_test();
     }
 } // namespace mkostyk
 #endif // KVFIFO_TEST_H_
\ No newline at end of file
@@ -0,0 +1,428 @@
+#ifndef KVFIFO_TRACE_H
+#define KVFIFO_TRACE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <mutex>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+// Zapis operacji na kolejkach kvfifo do pliku binarnego, do odtwarzania
+// przez kvfifo_replay. Zapis jest wkompilowany tylko wtedy, gdy przed
+// dołączeniem kvfifo.h zdefiniowano KVFIFO_TRACE, i działa między
+// kvfifo_trace::start(path) a kvfifo_trace::stop().
+//
+// Plik zaczyna się od "KVFT" i bajtu wersji, dalej są zdarzenia po 25 bajtów
+// (liczby little endian): operacja (1 bajt), kolejka (4), druga kolejka albo
+// rozmiar wartości (4), klucz (8) i argument (8). Kolejki są numerowane od 1,
+// numer zniszczonej kolejki może zostać użyty ponownie. Klucz całkowity jest
+// zapisywany wprost, inne jako std::hash (tak samo nazwy kursorów). Rozmiar
+// wartości to size() dla kontenerów, a sizeof dla innych typów. Argumentem
+// jest ttl w push_with_ttl, czas w expire, numer elementu w at, kod końca
+// przedziału (hi) w operacjach na przedziałach kluczy, waga w set_weight
+// i liczba usuniętych elementów w erase_if.
+//
+// Operacje, których nie da się opisać jednym zdarzeniem, są poprzedzone
+// zdarzeniami z danymi: element dla każdej pary z zakresu (create_range,
+// assign_range) i selected dla każdego wyboru predykatu (erase_if,
+// extract_if) albo klucza z listy (move_keys_to_back, move_keys_to_front).
+// Takie paczki są zapisywane w całości i tylko po udanej operacji.
+namespace kvfifo_trace {
+
+// Przy każdej operacji napisano, co oprócz kolejki zawiera zdarzenie.
+enum class op : std::uint8_t {
+  create,
+  copy,           // druga kolejka: źródło
+  move,           // druga kolejka: źródło
+  assign,         // druga kolejka: przypisywana
+  destroy,
+  push,           // klucz, rozmiar wartości
+  push_with_ttl,  // klucz, rozmiar wartości, ttl
+  pop,
+  pop_key,        // klucz
+  pop_all,        // klucz
+  move_to_back,   // klucz
+  move_to_front,  // klucz
+  front,          // niestałe front (może odłączyć kopię)
+  back,           // niestałe back
+  first,          // niestałe first, klucz
+  last,           // niestałe last, klucz
+  count,          // klucz
+  clear,
+  expire,         // czas
+  append,         // druga kolejka: dołączana
+  extract,        // klucz; następne zdarzenie tego wątku to extracted
+  extract_if,     // jak extract; poprzedzają wybrane klucze
+  extracted,      // nowa kolejka z wynikiem poprzedniego extract(_if)
+  pop_range,      // klucz lo, kod klucza hi
+  move_range_to_back,  // klucz lo, kod klucza hi
+  at,             // niestałe at, numer elementu
+  element,        // klucz, rozmiar wartości
+  selected,       // numer elementu (erase_if) albo klucz
+  create_range,   // nowa kolejka z poprzedzających elementów
+  assign_range,   // zawartość z poprzedzających elementów
+  erase_if,       // liczba usuniętych, poprzedzają numery usuniętych
+  move_keys_to_back,   // poprzedzają klucze w kolejności przesuwania
+  move_keys_to_front,  // poprzedzają klucze w kolejności przesuwania
+  front_fair,     // niestałe front_fair
+  pop_fair,
+  set_weight,     // klucz, waga
+  open_cursor,    // kod nazwy
+  close_cursor,   // kod nazwy
+  cursor_pop,     // kod nazwy
+};
+
+inline constexpr std::size_t op_count =
+    static_cast<std::size_t>(op::cursor_pop) + 1;
+
+inline constexpr char const *op_names[op_count] = {
+    "create",       "copy",          "move",
+    "assign",       "destroy",       "push",
+    "push_with_ttl", "pop",          "pop_key",
+    "pop_all",      "move_to_back",  "move_to_front",
+    "front",        "back",          "first",
+    "last",         "count",         "clear",
+    "expire",       "append",        "extract",
+    "extract_if",   "extracted",     "pop_range",
+    "move_range_to_back", "at",      "element",
+    "selected",     "create_range",  "assign_range",
+    "erase_if",     "move_keys_to_back", "move_keys_to_front",
+    "front_fair",   "pop_fair",      "set_weight",
+    "open_cursor",  "close_cursor",  "cursor_pop"};
+
+struct event {
+  op code = op::create;
+  std::uint32_t queue = 0;
+  // Druga kolejka albo rozmiar wartości.
+  std::uint32_t other = 0;
+  std::uint64_t key = 0;
+  std::uint64_t arg = 0;
+};
+
+inline constexpr unsigned char magic[5] = {'K', 'V', 'F', 'T', 2};
+inline constexpr std::size_t event_bytes = 25;
+
+namespace detail {
+template <typename T>
+void put(unsigned char *&out, T value) noexcept {
+  for (std::size_t i = 0; i < sizeof(T); ++i) {
+    *out++ = static_cast<unsigned char>(value >> (8 * i));
+  }
+}
+
+template <typename T>
+T get(unsigned char const *&in) noexcept {
+  T value = 0;
+  for (std::size_t i = 0; i < sizeof(T); ++i) {
+    value |= static_cast<T>(*in++) << (8 * i);
+  }
+  return value;
+}
+}  // namespace detail
+
+inline void encode(event const &e, unsigned char *out) noexcept {
+  detail::put(out, static_cast<std::uint8_t>(e.code));
+  detail::put(out, e.queue);
+  detail::put(out, e.other);
+  detail::put(out, e.key);
+  detail::put(out, e.arg);
+}
+
+inline event decode(unsigned char const *in) noexcept {
+  event e;
+  e.code = static_cast<op>(detail::get<std::uint8_t>(in));
+  e.queue = detail::get<std::uint32_t>(in);
+  e.other = detail::get<std::uint32_t>(in);
+  e.key = detail::get<std::uint64_t>(in);
+  e.arg = detail::get<std::uint64_t>(in);
+  return e;
+}
+
+// Zapisuje zdarzenia ze wszystkich kolejek (i wątków) do jednego pliku.
+class recorder {
+ public:
+  // Obiekt żyje do końca programu, bo kolejki mogą być niszczone nawet po
+  // zniszczeniu obiektów statycznych.
+  static recorder &instance() {
+    static recorder *const instance = new recorder;
+    return *instance;
+  }
+
+  bool active() const noexcept {
+    return enabled.load(std::memory_order_relaxed);
+  }
+
+  // Zaczyna zapis do nowego pliku path. Zwraca false, jeśli nie udało się go
+  // otworzyć.
+  bool start(char const *path) {
+    std::lock_guard lock(mutex);
+    close();
+    file = std::fopen(path, "wb");
+    if (file == nullptr) return false;
+    std::fwrite(magic, 1, sizeof(magic), file);
+    ids.clear();
+    free_ids.clear();
+    next_id = 1;
+    enabled.store(true, std::memory_order_relaxed);
+    return true;
+  }
+
+  // Kończy zapis i zamyka plik.
+  void stop() {
+    std::lock_guard lock(mutex);
+    close();
+  }
+
+  // Zdarzenie dla kolejki queue (i other, jeśli podana).
+  void add(event e, void const *queue, void const *other = nullptr) {
+    std::lock_guard lock(mutex);
+    if (file == nullptr) return;
+    e.queue = id_of(queue);
+    if (other != nullptr) e.other = id_of(other);
+    if (e.code == op::destroy) release(queue);
+    append(e);
+  }
+
+  // Kolejne zdarzenia dla kolejki queue, zapisywane razem (bez zdarzeń
+  // innych wątków pomiędzy).
+  void add(std::vector<event> events, void const *queue) {
+    std::lock_guard lock(mutex);
+    if (file == nullptr) return;
+    for (event &e : events) {
+      e.queue = id_of(queue);
+      append(e);
+    }
+  }
+
+ private:
+  static constexpr std::size_t flush_bytes = 1 << 16;
+
+  recorder() = default;
+
+  std::uint32_t id_of(void const *queue) {
+    auto [it, inserted] = ids.try_emplace(queue, 0);
+    if (inserted) {
+      if (free_ids.empty()) {
+        it->second = next_id++;
+      } else {
+        it->second = free_ids.back();
+        free_ids.pop_back();
+      }
+    }
+    return it->second;
+  }
+
+  void release(void const *queue) {
+    auto it = ids.find(queue);
+    free_ids.push_back(it->second);
+    ids.erase(it);
+  }
+
+  void append(event const &e) {
+    buffer.resize(buffer.size() + event_bytes);
+    encode(e, buffer.data() + buffer.size() - event_bytes);
+    if (buffer.size() >= flush_bytes) flush();
+  }
+
+  void flush() {
+    std::fwrite(buffer.data(), 1, buffer.size(), file);
+    buffer.clear();
+  }
+
+  void close() {
+    enabled.store(false, std::memory_order_relaxed);
+    if (file == nullptr) return;
+    flush();
+    std::fclose(file);
+    file = nullptr;
+  }
+
+  std::atomic<bool> enabled = false;
+  std::mutex mutex;
+  std::FILE *file = nullptr;
+  std::vector<unsigned char> buffer;
+  std::unordered_map<void const *, std::uint32_t> ids;
+  std::vector<std::uint32_t> free_ids;
+  std::uint32_t next_id = 1;
+};
+
+inline bool start(char const *path) {
+  return recorder::instance().start(path);
+}
+
+inline void stop() { recorder::instance().stop(); }
+
+template <typename K>
+std::uint64_t key_code(K const &k) {
+  if constexpr (std::is_integral_v<K> || std::is_enum_v<K>) {
+    return static_cast<std::uint64_t>(k);
+  } else {
+    return std::hash<K>()(k);
+  }
+}
+
+template <typename V>
+std::uint32_t value_size(V const &v) {
+  std::uint64_t size = sizeof(V);
+  if constexpr (requires { std::size(v); }) {
+    size = static_cast<std::uint64_t>(std::size(v));
+  }
+  return static_cast<std::uint32_t>(
+      std::min<std::uint64_t>(size, std::numeric_limits<std::uint32_t>::max()));
+}
+
+// Zapamiętuje wybory predykatu erase_if (numery elementów w kolejce) albo
+// extract_if (kody kluczy), żeby zapisać je razem z operacją. Predykat
+// opakowany przez by_position (by_key) woła się tak samo jak oryginalny.
+class selection {
+ public:
+  template <typename Pred>
+  auto by_position(Pred &pred) {
+    return [this, &pred](auto const &k, auto const &v) {
+      const bool chosen = static_cast<bool>(pred(k, v));
+      if (chosen) note(calls);
+      ++calls;
+      return chosen;
+    };
+  }
+
+  template <typename Pred>
+  auto by_key(Pred &pred) {
+    return [this, &pred](auto const &k) {
+      const bool chosen = static_cast<bool>(pred(k));
+      if (chosen) note(key_code(k));
+      return chosen;
+    };
+  }
+
+  std::vector<std::uint64_t> const &codes() const noexcept { return chosen; }
+
+ private:
+  // Bez aktywnego zapisu nic nie zapamiętuje. Jeśli zabraknie pamięci,
+  // przerywa zapis, a nie operację.
+  void note(std::uint64_t code) noexcept {
+    recorder &r = recorder::instance();
+    if (!r.active()) return;
+    try {
+      chosen.push_back(code);
+    } catch (...) {
+      r.stop();
+    }
+  }
+
+  std::vector<std::uint64_t> chosen;
+  std::uint64_t calls = 0;
+};
+
+// Zapisuje operację code na kolejce queue. Znaczenie args zależy od
+// operacji: druga kolejka (wskaźnik), czas, klucz, wartość i ttl, klucz
+// i waga, zakres par albo kluczy, wybory predykatu (selection).
+// Bez aktywnego zapisu kosztuje jeden odczyt flagi. Nie zgłasza wyjątków
+// (jest wołane też w destruktorze): jeśli zapis się nie uda, zapis jest
+// przerywany.
+template <op code, typename... Args>
+void record(void const *queue, Args const &...args) noexcept {
+  recorder &r = recorder::instance();
+  if (!r.active()) return;
+  try {
+    event e;
+    e.code = code;
+    auto const params = std::tie(args...);
+    if constexpr (code == op::copy || code == op::move ||
+                  code == op::assign || code == op::append) {
+      return r.add(e, queue, std::get<0>(params));
+    } else if constexpr (code == op::create_range ||
+                         code == op::assign_range) {
+      std::vector<event> batch;
+      for (auto const &pair : std::get<0>(params)) {
+        batch.push_back({op::element, 0, value_size(std::get<1>(pair)),
+                         key_code(std::get<0>(pair)), 0});
+      }
+      batch.push_back(e);
+      return r.add(std::move(batch), queue);
+    } else if constexpr (code == op::move_keys_to_back ||
+                         code == op::move_keys_to_front) {
+      std::vector<event> batch;
+      for (auto const &k : std::get<0>(params)) {
+        batch.push_back({op::selected, 0, 0, key_code(k), 0});
+      }
+      batch.push_back(e);
+      return r.add(std::move(batch), queue);
+    } else if constexpr (code == op::erase_if || code == op::extract_if) {
+      auto const &codes = std::get<0>(params).codes();
+      std::vector<event> batch;
+      for (std::uint64_t chosen : codes) {
+        batch.push_back({op::selected, 0, 0, chosen, 0});
+      }
+      e.arg = codes.size();
+      batch.push_back(e);
+      return r.add(std::move(batch), queue);
+    } else if constexpr (code == op::expire || code == op::at) {
+      e.arg = std::get<0>(params);
+    } else if constexpr (code == op::pop_range ||
+                         code == op::move_range_to_back) {
+      e.key = key_code(std::get<0>(params));
+      e.arg = key_code(std::get<1>(params));
+    } else if constexpr (code == op::set_weight) {
+      e.key = key_code(std::get<0>(params));
+      e.arg = std::get<1>(params);
+    } else if constexpr (sizeof...(Args) > 0) {
+      e.key = key_code(std::get<0>(params));
+      if constexpr (sizeof...(Args) > 1) {
+        e.other = value_size(std::get<1>(params));
+      }
+      if constexpr (sizeof...(Args) > 2) e.arg = std::get<2>(params);
+    }
+    r.add(e, queue);
+  } catch (...) {
+    r.stop();
+  }
+}
+
+// Czyta zdarzenia z pliku zapisanego przez recorder.
+class reader {
+ public:
+  explicit reader(char const *path) : file(std::fopen(path, "rb")) {
+    unsigned char header[sizeof(magic)];
+    if (file != nullptr &&
+        (std::fread(header, 1, sizeof(header), file) != sizeof(header) ||
+         !std::equal(header, header + sizeof(header), magic))) {
+      std::fclose(file);
+      file = nullptr;
+    }
+  }
+  reader(reader const &) = delete;
+  reader &operator=(reader const &) = delete;
+  ~reader() {
+    if (file != nullptr) std::fclose(file);
+  }
+
+  // Czy plik jest otwarty i ma poprawny nagłówek.
+  bool good() const noexcept { return file != nullptr; }
+
+  // Następne zdarzenie albo false na końcu pliku.
+  bool next(event &e) {
+    unsigned char bytes[event_bytes];
+    if (file == nullptr ||
+        std::fread(bytes, 1, event_bytes, file) != event_bytes) {
+      return false;
+    }
+    e = decode(bytes);
+    return static_cast<std::size_t>(e.code) < op_count;
+  }
+
+ private:
+  std::FILE *file;
+};
+
+}  // namespace kvfifo_trace
+
+#endif  // KVFIFO_TRACE_H
@@ -0,0 +1,124 @@
+// Zapisuje operacje przykładowego obciążenia (mieszanka push, pop, pop(k),
+// move_to_back, operacji na przedziałach kluczy, kopii, terminów ważności
+// i operacji zapisywanych paczkami)
+// i sprawdza, co trafiło do pliku. Plik można potem odtworzyć przez
+// kvfifo_replay.
+//
+// Użycie: kvfifo_trace_example [plik]
+
+#define KVFIFO_TRACE
+#include "kvfifo.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using kvfifo_trace::op;
+
+int main(int argc, char **argv) {
+  char const *path = argc > 1 ? argv[1] : "kvfifo_trace_example.kvft";
+
+  // Przed start nic nie jest zapisywane.
+  kvfifo<int, std::string> before;
+  before.push(1, "a");
+
+  [[maybe_unused]] const bool started = kvfifo_trace::start(path);
+  assert(started);
+  {
+    kvfifo<int, std::string> kvf;
+    kvf.push(1, "abc");
+    kvf.push_with_ttl(2, "de", 10);
+    kvf.push(1, "f");
+    auto copy = kvf;
+    kvf.pop();
+    kvf.move_to_back(2);
+    assert(copy.count(1) == 2);
+    auto part = copy.extract(1);
+    copy = part;
+    kvf.expire(10);
+  }
+  for (int round = 0; round < 1000; ++round) {
+    kvfifo<int, std::string> kvf;
+    for (int i = 0; i < 100; ++i) kvf.push(i % 7, std::string(i % 13, 'x'));
+    for (int i = 0; i < 20; ++i) kvf.pop(i % 7);
+    kvf.move_to_back(3);
+    kvf.move_range_to_back(1, 3);
+    kvf.pop_range(5, 7);
+    kvfifo<int, std::string> copy = kvf;
+    kvf.front().second += "y";
+    while (!copy.empty()) copy.pop();
+  }
+  {
+    // Operacje zapisywane paczkami: zakres par, wybory predykatu, lista
+    // kluczy.
+    std::vector<std::pair<int, std::string>> items = {
+        {4, "ab"}, {5, "c"}, {4, "d"}};
+    kvfifo<int, std::string> kvf(items.begin(), items.end());
+    kvf.erase_if([](int, std::string const &v) { return v == "c"; });
+    kvf.push(6, "e");
+    kvf.move_to_front(std::vector<int>{6, 4});
+    kvf.set_weight(4, 2);
+    kvf.open_cursor("reader");
+    kvf.push(7, "f");
+    kvf.cursor_pop("reader");
+  }
+  kvfifo_trace::stop();
+  before.pop();
+
+  kvfifo_trace::reader r(path);
+  assert(r.good());
+  std::vector<kvfifo_trace::event> events;
+  for (kvfifo_trace::event e; r.next(e);) events.push_back(e);
+
+  std::vector<op> expected = {
+      op::create, op::push,   op::push_with_ttl, op::push,      op::copy,
+      op::pop,    op::move_to_back, op::count,   op::extract,   op::extracted,
+      op::copy,   op::assign, op::destroy,       op::expire,    op::destroy,
+      op::destroy, op::destroy};
+  assert(events.size() > expected.size());
+  for (size_t i = 0; i < expected.size(); ++i) {
+    assert(events[i].code == expected[i]);
+  }
+  // push(1, "abc"): kolejka 1, klucz 1, rozmiar 3.
+  assert(events[1].queue == 1 && events[1].key == 1 && events[1].other == 3);
+  // push_with_ttl(2, "de", 10).
+  assert(events[2].key == 2 && events[2].other == 2 && events[2].arg == 10);
+  // Kopia (kolejka 2) z kolejki 1, a wynik extract to kolejka 3.
+  assert(events[4].queue == 2 && events[4].other == 1);
+  assert(events[9].queue == 3);
+  // Przypisanie do kolejki 2 kopii (4) kolejki 3.
+  assert(events[10].queue == 4 && events[10].other == 3);
+  assert(events[11].queue == 2 && events[11].other == 4);
+  assert(events[13].queue == 1 && events[13].arg == 10);
+  // Przedział kluczy: klucz lo, argument hi.
+  [[maybe_unused]] auto ranged =
+      std::find_if(events.begin(), events.end(),
+                   [](auto const &e) { return e.code == op::pop_range; });
+  assert(ranged != events.end() && ranged->key == 5 && ranged->arg == 7);
+  assert(std::prev(ranged)->code == op::move_range_to_back);
+  // Zakres: element dla każdej pary, potem create_range.
+  [[maybe_unused]] auto created =
+      std::find_if(events.begin(), events.end(),
+                   [](auto const &e) { return e.code == op::create_range; });
+  assert(created != events.end() && created - events.begin() >= 3);
+  assert(created[-3].code == op::element && created[-3].key == 4 &&
+         created[-3].other == 2);
+  assert(created[-1].code == op::element && created[-1].key == 4);
+  // erase_if: numer wybranego elementu i liczba usuniętych.
+  assert(created[1].code == op::selected && created[1].key == 1);
+  assert(created[2].code == op::erase_if && created[2].arg == 1);
+  // move_to_front(keys): klucze w kolejności z listy.
+  assert(created[4].code == op::selected && created[4].key == 6);
+  assert(created[5].code == op::selected && created[5].key == 4);
+  assert(created[6].code == op::move_keys_to_front);
+  assert(created[7].code == op::set_weight && created[7].arg == 2);
+  assert(created[8].code == op::open_cursor &&
+         created[10].code == op::cursor_pop &&
+         created[10].key == created[8].key);
+
+  std::cout << events.size() << " events written to " << path << std::endl;
+  std::cout << "All trace tests passed!" << std::endl;
+}